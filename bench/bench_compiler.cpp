@@ -0,0 +1,318 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include "tokenisation.hpp"
+#include "parser.hpp"
+#include "resolution.hpp"
+#include "generation.hpp"
+#include "arm64_backend.hpp"
+#include "output_buffer.hpp"
+#include "bytecode.hpp"
+#include "vm.hpp"
+#include "incremental.hpp"
+
+// Global allocation counters, so benchmarks can report heap traffic
+static std::atomic<std::size_t> g_alloc_count { 0 };
+static std::atomic<std::size_t> g_alloc_bytes { 0 };
+
+static void* counted_alloc(const std::size_t size)
+{
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc {};
+}
+
+void* operator new(const std::size_t size)
+{
+    return counted_alloc(size);
+}
+
+void* operator new[](const std::size_t size)
+{
+    return counted_alloc(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// Minimal timing harness: runs `body` until at least `min_seconds` have elapsed
+// and reports the best per-iteration time.
+double time_best(const std::function<void()>& body, const double min_seconds = 0.5)
+{
+    double best = 1e300;
+    double total = 0;
+    while (total < min_seconds) {
+        const auto start = std::chrono::steady_clock::now();
+        body();
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, elapsed);
+        total += elapsed;
+    }
+    return best;
+}
+
+void report(const char* name, const double seconds, const std::size_t items, const char* unit, const std::size_t bytes)
+{
+    std::printf("%-28s %10.3f ms  %8.2f M%s/s  %8.1f MB/s\n", name, seconds * 1e3, items / seconds / 1e6, unit,
+        bytes / seconds / 1e6);
+}
+
+std::string keyword_heavy_source(const int stmts)
+{
+    std::string src;
+    for (int i = 0; i < stmts; i++) {
+        src += "if (x) { var v" + std::to_string(i) + " = 1; } elif (y) { exit(2); } else { z = 3; }\n";
+    }
+    return src;
+}
+
+std::string comment_heavy_source(const int stmts)
+{
+    std::string src;
+    for (int i = 0; i < stmts; i++) {
+        src += "    // generated comment line with padding ..........................................\n";
+        src += "/* block comment\n   spanning lines ......................................... */\n";
+        src += "        var x" + std::to_string(i) + " = " + std::to_string(i * 7919) + ";          \n";
+    }
+    return src;
+}
+
+std::string statement_heavy_source(const int stmts)
+{
+    std::string src = "var v0 = 1;\n";
+    for (int i = 1; i < stmts; i++) {
+        src += "var v" + std::to_string(i) + " = (v" + std::to_string(i - 1) + " + 3) * 2 - " + std::to_string(i % 97)
+            + " / 4;\n";
+    }
+    return src;
+}
+
+void bench_tokenise(const char* name, const std::string& src)
+{
+    std::size_t count = 0;
+    const double seconds = time_best([&] {
+        Tokeniser tokeniser(src);
+        count = tokeniser.tokenise().size();
+    });
+    report(name, seconds, count, "tok", src.size());
+}
+
+template <typename T>
+std::size_t node_bytes(const std::vector<T>& nodes)
+{
+    return nodes.size() * sizeof(T);
+}
+
+// Bytes held by the node arrays of `prog`, not counting the Interner
+std::size_t ast_bytes(const NodeProg& prog)
+{
+    return node_bytes(prog.exprs) + node_bytes(prog.literals) + node_bytes(prog.stmts)
+        + node_bytes(prog.scope_stmts) + node_bytes(prog.scopes) + node_bytes(prog.exits)
+        + node_bytes(prog.vars) + node_bytes(prog.assigns) + node_bytes(prog.ifs)
+        + node_bytes(prog.preds);
+}
+
+// Lexes and parses in streaming mode, as the driver does, and reports the heap
+// allocations made per run
+void bench_parse(const char* name, const std::string& src, const std::size_t stmts)
+{
+    std::size_t allocs = 0;
+    std::size_t bytes = 0;
+    std::size_t ast = 0;
+    const double seconds = time_best([&] {
+        const std::size_t count_before = g_alloc_count.load();
+        const std::size_t bytes_before = g_alloc_bytes.load();
+        {
+            Tokeniser tokeniser(src);
+            Parser parser(tokeniser);
+            const auto prog = parser.parse_prog();
+            if (!prog.has_value() || prog->body.count != stmts) {
+                std::abort();
+            }
+            ast = ast_bytes(prog.value());
+        }
+        allocs = g_alloc_count.load() - count_before;
+        bytes = g_alloc_bytes.load() - bytes_before;
+    }, 2.0);
+    report(name, seconds, stmts, "stmt", src.size());
+    std::printf("%-28s %10zu allocations  %8.1f MB requested\n", "", allocs, bytes / 1e6);
+    std::printf("%-28s %10.1f MB of AST nodes\n", "", ast / 1e6);
+}
+
+// Generates -O0 macOS code for `src` once, then times printing it as assembly
+// and writing out.asm, and reports the heap allocations made per run
+void bench_emit(const char* name, const std::string& src)
+{
+    using Backend = arm64::Backend<arm64::Os::macos>;
+    Tokeniser tokeniser(src);
+    Parser parser(tokeniser);
+    std::optional<NodeProg> prog = parser.parse_prog();
+    if (!prog.has_value()) {
+        std::abort();
+    }
+    NameResolver(prog.value()).resolve_prog();
+    const Backend::Code code = Generator<Backend>(std::move(prog.value())).gen_prog();
+
+    std::size_t allocs = 0;
+    std::size_t bytes = 0;
+    std::size_t text = 0;
+    const double seconds = time_best([&] {
+        const std::size_t count_before = g_alloc_count.load();
+        const std::size_t bytes_before = g_alloc_bytes.load();
+        {
+            OutputBuffer assembly;
+            Backend::print(assembly, code);
+            if (!assembly.write_to("bench_emit.asm")) {
+                std::abort();
+            }
+            text = assembly.size();
+        }
+        allocs = g_alloc_count.load() - count_before;
+        bytes = g_alloc_bytes.load() - bytes_before;
+    }, 2.0);
+    report(name, seconds, code.size(), "inst", text);
+    std::printf("%-28s %10zu allocations  %8.1f MB requested\n", "", allocs, bytes / 1e6);
+    std::remove("bench_emit.asm");
+}
+
+// A chain of divisions by assorted constants, each written either as a literal
+// (which the generators strength-reduce) or as a variable (which stays a
+// udiv). The added constant keeps the value from collapsing to zero.
+std::string division_heavy_source(const int stmts, const bool literal_divisors)
+{
+    static const uint64_t divisors[] = { 3, 7, 10, 16, 641, 1000, 12345, 4294967311ULL };
+    constexpr std::size_t divisor_count = sizeof(divisors) / sizeof(divisors[0]);
+    std::string src = "var x = 123456789;\n";
+    if (!literal_divisors) {
+        for (std::size_t i = 0; i < divisor_count; i++) {
+            src += "var d" + std::to_string(i) + " = " + std::to_string(divisors[i]) + ";\n";
+        }
+    }
+    for (int i = 0; i < stmts; i++) {
+        const std::size_t d = static_cast<std::size_t>(i) % divisor_count;
+        src += "x = x / "
+            + (literal_divisors ? std::to_string(divisors[d]) : "d" + std::to_string(d))
+            + " + " + std::to_string(1000003 + i % 89) + ";\n";
+    }
+    return src + "exit(x);\n";
+}
+
+// Compiles `src` at -O0, where nothing is folded away, with the compiler under
+// build/, then times runs of the program it produced, which needs an arm64
+// macOS or Linux host. The shell reports 126 or 127 when it cannot run it.
+void bench_run(const char* name, const std::string& src, const std::size_t stmts)
+{
+    std::ofstream("bench_run.micro") << src;
+    std::remove("out");
+    const auto start = std::chrono::steady_clock::now();
+    std::system("./build/microcompiler -O0 bench_run.micro > /dev/null 2>&1");
+    const double compile = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const int status = std::ifstream("out").good() ? std::system("./out > /dev/null 2>&1") : -1;
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 126 || WEXITSTATUS(status) == 127) {
+        std::printf("%-28s skipped: the compiled program cannot run on this host\n", name);
+        return;
+    }
+    const double seconds = time_best([] { std::system("./out"); }, 2.0);
+    report(name, seconds, stmts, "stmt", src.size());
+    std::printf("%-28s %10.3f ms to compile and run once\n", "", compile * 1e3);
+    std::remove("bench_run.micro");
+}
+
+// Lowers `src` to bytecode once, unfolded as at -O0, then times the
+// in-process interpreter that --run uses on it
+void bench_vm(const char* name, const std::string& src)
+{
+    Tokeniser tokeniser(src);
+    Parser parser(tokeniser);
+    std::optional<NodeProg> prog = parser.parse_prog();
+    if (!prog.has_value()) {
+        std::abort();
+    }
+    NameResolver(prog.value()).resolve_prog();
+    const bytecode::Program program = bytecode::Compiler(std::move(prog.value())).compile_prog();
+
+    uint64_t sink = 0;
+    const double seconds = time_best([&] { sink += bytecode::run(program); }, 2.0);
+    report(name, seconds, program.code.size(), "inst", program.code.size() * sizeof(bytecode::Inst));
+    if (sink == 1) {
+        std::puts("");
+    }
+}
+
+// Compiles `src` once, then times incremental compiles of it with `edited`
+// in turn, as the compile server does for -O1 with --incremental. Only the
+// machine code is produced; nothing is written.
+void bench_incremental(const char* name, const std::string& src, const std::string& edited)
+{
+    using Backend = arm64::Backend<arm64::Os::linux_gnu>;
+    IncrementalCompiler compiler;
+    OutputBuffer assembly;
+    IncrementalCompiler::MachineCode<Backend> machine_code;
+    const auto compile = [&](const std::string& version) {
+        compiler.compile<Backend>(version, "bench", OptLevel::o1, PeepholeRules::default_window, assembly,
+            machine_code);
+    };
+    const auto start = std::chrono::steady_clock::now();
+    compile(src);
+    const double cold = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bool toggle = false;
+    std::size_t parsed = 0;
+    const double seconds = time_best([&] {
+        toggle = !toggle;
+        compile(toggle ? edited : src);
+        parsed = compiler.stats().parsed;
+    });
+    report(name, seconds, src.size(), "B", src.size());
+    std::printf("%-28s %10.3f ms cold, %zu statements compiled per edit\n", "", cold * 1e3, parsed);
+}
+
+// `src` with the first occurrence of `from` after its middle replaced
+std::string edit_middle(std::string src, const std::string& from, const std::string& to)
+{
+    return src.replace(src.find(from, src.size() / 2), from.size(), to);
+}
+
+int main()
+{
+    bench_tokenise("tokenise/keyword_heavy", keyword_heavy_source(200000));
+    bench_tokenise("tokenise/comment_heavy", comment_heavy_source(200000));
+    bench_parse("parse/1M_statements", statement_heavy_source(1000000), 1000000);
+    bench_emit("emit/asm_text", statement_heavy_source(200000));
+    bench_run("run/divide_by_literal", division_heavy_source(200000, true), 200000);
+    bench_run("run/divide_by_variable", division_heavy_source(200000, false), 200000);
+    bench_vm("vm/statements", statement_heavy_source(200000));
+    bench_vm("vm/divide_by_literal", division_heavy_source(200000, true));
+    bench_vm("vm/divide_by_variable", division_heavy_source(200000, false));
+    const std::string statements = statement_heavy_source(100000);
+    bench_incremental("incremental/edit_literal", statements, edit_middle(statements, " + 3)", " + 5)"));
+    bench_incremental("incremental/insert_var", statements, edit_middle(statements, "\nvar", "\nvar inserted = 1;\nvar"));
+    return 0;
+}
@@ -0,0 +1,391 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "output_buffer.hpp"
+
+// Structured ARM64 instructions, as the generators emit them. Keeping them as
+// data rather than text lets later passes (the peephole optimiser) match and
+// rewrite them; they only become assembly text when printed.
+namespace arm64 {
+
+// x0-x30 by number; 31 is sp. The zero register shares sp's encoding, so it
+// gets a number of its own here.
+using Reg = uint8_t;
+constexpr Reg sp = 31;
+constexpr Reg xzr = 32;
+constexpr Reg no_reg = UINT8_MAX;
+
+enum class Opcode : uint8_t {
+    // rd = rn
+    mov,
+    // rd = imm, imm <= 0xffff
+    mov_imm,
+    // rd = imm << shift, or insert imm at shift keeping the other bits, or
+    // rd = ~(imm << shift)
+    movz,
+    movk,
+    movn,
+    // rd = rn op rm
+    add,
+    sub,
+    mul,
+    udiv,
+    // rd = rn op imm, imm a 12-bit value optionally shifted left by 12
+    add_imm,
+    sub_imm,
+    // rd = rn | imm, imm a logical (bitmask) immediate
+    orr_imm,
+    // rd = rn shifted by imm
+    lsl_imm,
+    lsr_imm,
+    // rd = rn op (rm shifted by `shift`)
+    add_lsl,
+    add_lsr,
+    sub_lsl,
+    // rd = high 64 bits of rn * rm
+    umulh,
+    // rd = -rn
+    neg,
+    // rd <-> [rn, #imm], or [rn, rm] when rm is set
+    ldr,
+    str,
+    // Flags from rn - imm
+    cmp_imm,
+    // To label imm; cbz/cbnz test rn
+    b,
+    beq,
+    cbz,
+    cbnz,
+    svc,
+    // Defines label imm
+    label,
+    // Deleted by an optimisation; never printed
+    nop
+};
+
+struct Inst {
+    Opcode op;
+    Reg rd = no_reg;
+    Reg rn = no_reg;
+    Reg rm = no_reg;
+    uint8_t shift = 0;
+    uint64_t imm = 0;
+};
+
+// The OS the program runs on, which decides how it makes the exit syscall and
+// how the compiler turns the code into an executable
+enum class Os : uint8_t {
+    macos,
+    linux_gnu
+};
+
+inline bool is_branch(const Opcode op)
+{
+    return op == Opcode::b || op == Opcode::beq || op == Opcode::cbz || op == Opcode::cbnz;
+}
+
+// The register an instruction writes, if any
+inline Reg def(const Inst& inst)
+{
+    switch (inst.op) {
+    case Opcode::mov:
+    case Opcode::mov_imm:
+    case Opcode::movz:
+    case Opcode::movk:
+    case Opcode::movn:
+    case Opcode::add:
+    case Opcode::sub:
+    case Opcode::mul:
+    case Opcode::udiv:
+    case Opcode::add_imm:
+    case Opcode::sub_imm:
+    case Opcode::orr_imm:
+    case Opcode::lsl_imm:
+    case Opcode::lsr_imm:
+    case Opcode::add_lsl:
+    case Opcode::add_lsr:
+    case Opcode::sub_lsl:
+    case Opcode::umulh:
+    case Opcode::neg:
+    case Opcode::ldr:
+        return inst.rd;
+    default:
+        return no_reg;
+    }
+}
+
+// Whether an instruction reads register `reg`
+inline bool uses(const Inst& inst, const Reg reg)
+{
+    switch (inst.op) {
+    case Opcode::movk:
+        return inst.rd == reg;
+    case Opcode::str:
+        return inst.rd == reg || inst.rn == reg || inst.rm == reg;
+    case Opcode::svc:
+        // The exit syscall reads its status and its number, which is in x16
+        // on macOS and x8 on Linux
+        return reg == 0 || reg == 16 || reg == 8;
+    default:
+        return inst.rn == reg || inst.rm == reg;
+    }
+}
+
+// Assembly names of x0-x30, sp and xzr, indexed by Reg
+constexpr std::string_view reg_names[] = { "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11",
+    "x12", "x13", "x14", "x15", "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27",
+    "x28", "x29", "x30", "sp", "xzr" };
+
+inline void print_reg(OutputBuffer& out, const Reg reg)
+{
+    assert(reg <= xzr);
+    out.append(reg_names[reg]);
+}
+
+inline void print_label(OutputBuffer& out, const uint64_t label)
+{
+    out.append("label");
+    out.append_uint(label);
+}
+
+inline void print_inst(OutputBuffer& out, const Inst& inst)
+{
+    // "    mnemonic rd, rn"
+    const auto rd_rn = [&](const std::string_view mnemonic) {
+        out.append("    ");
+        out.append(mnemonic);
+        out.append(' ');
+        print_reg(out, inst.rd);
+        out.append(", ");
+        print_reg(out, inst.rn);
+    };
+    const auto rrr = [&](const std::string_view mnemonic) {
+        rd_rn(mnemonic);
+        out.append(", ");
+        print_reg(out, inst.rm);
+        out.append('\n');
+    };
+    const auto rri = [&](const std::string_view mnemonic) {
+        rd_rn(mnemonic);
+        out.append(", #");
+        out.append_uint(inst.imm);
+        out.append('\n');
+    };
+    const auto arith_imm = [&](const std::string_view mnemonic) {
+        rd_rn(mnemonic);
+        out.append(", #");
+        if (inst.imm > 0xfff) {
+            out.append_uint(inst.imm >> 12);
+            out.append(", lsl #12\n");
+        }
+        else {
+            out.append_uint(inst.imm);
+            out.append('\n');
+        }
+    };
+    const auto shifted = [&](const std::string_view mnemonic, const std::string_view shift) {
+        rd_rn(mnemonic);
+        out.append(", ");
+        print_reg(out, inst.rm);
+        out.append(", ");
+        out.append(shift);
+        out.append(" #");
+        out.append_uint(inst.shift);
+        out.append('\n');
+    };
+    const auto mem = [&](const std::string_view mnemonic) {
+        out.append("    ");
+        out.append(mnemonic);
+        out.append(' ');
+        print_reg(out, inst.rd);
+        out.append(", [");
+        print_reg(out, inst.rn);
+        if (inst.rm != no_reg) {
+            out.append(", ");
+            print_reg(out, inst.rm);
+        }
+        else {
+            out.append(", #");
+            out.append_uint(inst.imm);
+        }
+        out.append("]\n");
+    };
+    const auto branch = [&](const std::string_view mnemonic) {
+        out.append("    ");
+        out.append(mnemonic);
+        out.append(' ');
+        if (inst.rn != no_reg) {
+            print_reg(out, inst.rn);
+            out.append(", ");
+        }
+        print_label(out, inst.imm);
+        out.append('\n');
+    };
+    const auto wide = [&](const std::string_view mnemonic) {
+        out.append("    ");
+        out.append(mnemonic);
+        out.append(' ');
+        print_reg(out, inst.rd);
+        out.append(", #");
+        out.append_uint(inst.imm);
+        out.append(", lsl #");
+        out.append_uint(inst.shift);
+        out.append('\n');
+    };
+    switch (inst.op) {
+    case Opcode::mov:
+        rd_rn("mov");
+        out.append('\n');
+        return;
+    case Opcode::mov_imm:
+        out.append("    mov ");
+        print_reg(out, inst.rd);
+        out.append(", #");
+        out.append_uint(inst.imm);
+        out.append('\n');
+        return;
+    case Opcode::movz:
+        return wide("movz");
+    case Opcode::movk:
+        return wide("movk");
+    case Opcode::movn:
+        return wide("movn");
+    case Opcode::add:
+        return rrr("add");
+    case Opcode::sub:
+        return rrr("sub");
+    case Opcode::mul:
+        return rrr("mul");
+    case Opcode::udiv:
+        return rrr("udiv");
+    case Opcode::add_imm:
+        return arith_imm("add");
+    case Opcode::sub_imm:
+        return arith_imm("sub");
+    case Opcode::orr_imm:
+        return rri("orr");
+    case Opcode::lsl_imm:
+        return rri("lsl");
+    case Opcode::lsr_imm:
+        return rri("lsr");
+    case Opcode::add_lsl:
+        return shifted("add", "lsl");
+    case Opcode::add_lsr:
+        return shifted("add", "lsr");
+    case Opcode::sub_lsl:
+        return shifted("sub", "lsl");
+    case Opcode::umulh:
+        return rrr("umulh");
+    case Opcode::neg:
+        rd_rn("neg");
+        out.append('\n');
+        return;
+    case Opcode::ldr:
+        return mem("ldr");
+    case Opcode::str:
+        return mem("str");
+    case Opcode::cmp_imm:
+        out.append("    cmp ");
+        print_reg(out, inst.rn);
+        out.append(", #");
+        out.append_uint(inst.imm);
+        out.append('\n');
+        return;
+    case Opcode::b:
+        return branch("b");
+    case Opcode::beq:
+        return branch("beq");
+    case Opcode::cbz:
+        return branch("cbz");
+    case Opcode::cbnz:
+        return branch("cbnz");
+    case Opcode::svc:
+        out.append("    svc #0x");
+        out.append_hex(inst.imm);
+        out.append('\n');
+        return;
+    case Opcode::label:
+        print_label(out, inst.imm);
+        out.append(":\n");
+        return;
+    case Opcode::nop:
+        return;
+    }
+}
+
+// Exits the process with the status in x0
+inline void emit_exit(std::vector<Inst>& code, const Os os)
+{
+    if (os == Os::macos) {
+        code.push_back({ Opcode::mov_imm, 16, no_reg, no_reg, 0, 1 });
+        code.push_back({ Opcode::svc, no_reg, no_reg, no_reg, 0, 0x80 });
+    }
+    else {
+        code.push_back({ Opcode::mov_imm, 8, no_reg, no_reg, 0, 93 });
+        code.push_back({ Opcode::svc, no_reg, no_reg, no_reg, 0, 0 });
+    }
+}
+
+// Prints the instructions alone, appending to `out`. Sized up front from the
+// instruction count. Only an instruction with a wide immediate prints past 32
+// bytes, so the buffer rarely has to grow.
+inline void print_insts(OutputBuffer& out, const std::vector<Inst>& code)
+{
+    out.reserve(out.size() + 32 * code.size() + 32);
+    for (const Inst& inst : code) {
+        print_inst(out, inst);
+    }
+}
+
+// Prints a whole program, entered at its first instruction
+inline void print(OutputBuffer& out, const std::vector<Inst>& code)
+{
+    out.append(".global _start\n_start:\n");
+    print_insts(out, code);
+}
+
+// The instruction set as the target-independent machine passes see it: the
+// opcodes they rewrite between, and which instructions write a register or
+// end a basic block
+struct Isa {
+    using Inst = arm64::Inst;
+    using Opcode = arm64::Opcode;
+    using Reg = arm64::Reg;
+
+    static constexpr Reg sp = arm64::sp;
+    static constexpr Reg no_reg = arm64::no_reg;
+
+    // rd = rn, and rd = imm in one instruction
+    static constexpr Opcode mov = Opcode::mov;
+    static constexpr Opcode mov_imm = Opcode::mov_imm;
+    // rd <-> [rn, #imm]
+    static constexpr Opcode load = Opcode::ldr;
+    static constexpr Opcode store = Opcode::str;
+    // rd = rn +- imm
+    static constexpr Opcode add_imm = Opcode::add_imm;
+    static constexpr Opcode sub_imm = Opcode::sub_imm;
+    // cmp rn, #imm; b.eq imm, which fuse into cbz rn, imm
+    static constexpr Opcode cmp_imm = Opcode::cmp_imm;
+    static constexpr Opcode branch_eq = Opcode::beq;
+    static constexpr Opcode branch_zero = Opcode::cbz;
+    static constexpr Opcode jump = Opcode::b;
+    static constexpr Opcode label = Opcode::label;
+    static constexpr Opcode nop = Opcode::nop;
+
+    static Reg def(const Inst& inst)
+    {
+        return arm64::def(inst);
+    }
+
+    // Control can arrive at a label from elsewhere, and leaves at a branch or
+    // a syscall
+    static bool ends_block(const Inst& inst)
+    {
+        return inst.op == Opcode::label || is_branch(inst.op) || inst.op == Opcode::svc;
+    }
+};
+
+} // namespace arm64
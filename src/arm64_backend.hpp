@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "arm64.hpp"
+#include "encoder.hpp"
+#include "immediates.hpp"
+#include "output_buffer.hpp"
+#include "strength_reduction.hpp"
+#include "target.hpp"
+
+namespace arm64 {
+
+// The ARM64 backend for `os` (see target.hpp). x0-x15 hold values, and x16
+// and x17 are the scratch registers. The exit syscall number goes in x16 on
+// macOS and x8 on Linux, neither of which holds anything by then.
+template <Os os>
+struct Backend {
+    using Isa = arm64::Isa;
+    using Code = std::vector<Inst>;
+
+    static constexpr uint32_t num_regs = 16;
+    // Largest scaled offset of ldr/str x, [sp, #imm]
+    static constexpr uint64_t max_slot_offset = 32760;
+    static constexpr uint16_t elf_machine = 183; // EM_AARCH64
+    // macOS executables go through as and ld
+    static constexpr bool system_toolchain = os == Os::macos;
+
+    static Reg reg(const uint32_t index)
+    {
+        assert(index < num_regs);
+        return static_cast<Reg>(index);
+    }
+
+    static Reg scratch(const uint32_t n)
+    {
+        assert(n < 2);
+        return static_cast<Reg>(16 + n);
+    }
+
+    static void mov(Code& code, const Reg rd, const Reg rn)
+    {
+        code.push_back({ Opcode::mov, rd, rn });
+    }
+
+    static void mov_imm(Code& code, const Reg rd, const uint64_t value)
+    {
+        emit_mov_imm(code, rd, value);
+    }
+
+    static void binary(Code& code, const BinaryOp op, const Reg rd, const Reg rn, const Reg rm)
+    {
+        switch (op) {
+        case BinaryOp::add:
+            code.push_back({ Opcode::add, rd, rn, rm });
+            return;
+        case BinaryOp::sub:
+            code.push_back({ Opcode::sub, rd, rn, rm });
+            return;
+        case BinaryOp::mul:
+            code.push_back({ Opcode::mul, rd, rn, rm });
+            return;
+        case BinaryOp::udiv:
+            code.push_back({ Opcode::udiv, rd, rn, rm });
+            return;
+        }
+    }
+
+    static bool fits_add_imm(const uint64_t value)
+    {
+        return arm64::fits_add_imm(value);
+    }
+
+    static void add_imm(Code& code, const Reg rd, const Reg rn, const uint64_t value)
+    {
+        emit_add_imm(code, rd, rn, value);
+    }
+
+    static void mul_imm(Code& code, const Reg rd, const Reg rn, const uint64_t factor, const Reg tmp)
+    {
+        emit_mul_imm(code, rd, rn, factor, tmp);
+    }
+
+    static void udiv_imm(Code& code, const Reg rd, const Reg rn, const uint64_t divisor, const Reg tmp)
+    {
+        emit_udiv_imm(code, rd, rn, divisor, tmp);
+    }
+
+    // An offset past the reach of an immediate goes through rd
+    static void load_slot(Code& code, const Reg rd, const uint64_t slot)
+    {
+        const uint64_t offset = slot * 8;
+        if (offset <= max_slot_offset) {
+            code.push_back({ Opcode::ldr, rd, sp, no_reg, 0, offset });
+            return;
+        }
+        emit_mov_imm(code, rd, offset);
+        code.push_back({ Opcode::ldr, rd, sp, rd });
+    }
+
+    // An offset past the reach of an immediate goes through scratch(1), so
+    // `rs` is never that
+    static void store_slot(Code& code, const Reg rs, const uint64_t slot)
+    {
+        const uint64_t offset = slot * 8;
+        if (offset <= max_slot_offset) {
+            code.push_back({ Opcode::str, rs, sp, no_reg, 0, offset });
+            return;
+        }
+        assert(rs != scratch(1));
+        emit_mov_imm(code, scratch(1), offset);
+        code.push_back({ Opcode::str, rs, sp, scratch(1) });
+    }
+
+    // Moves sp down by `bytes`, a multiple of 16, through scratch(0) when it
+    // does not fit an immediate
+    static void reserve_frame(Code& code, const uint64_t bytes)
+    {
+        if (!is_arith_imm(bytes)) {
+            emit_mov_imm(code, scratch(0), bytes);
+            code.push_back({ Opcode::sub, sp, sp, scratch(0) });
+        }
+        else if (bytes > 0) {
+            code.push_back({ Opcode::sub_imm, sp, sp, no_reg, 0, bytes });
+        }
+    }
+
+    static void label(Code& code, const uint64_t label)
+    {
+        code.push_back({ Opcode::label, no_reg, no_reg, no_reg, 0, label });
+    }
+
+    static void jump(Code& code, const uint64_t label)
+    {
+        code.push_back({ Opcode::b, no_reg, no_reg, no_reg, 0, label });
+    }
+
+    static void branch_zero(Code& code, const Reg cond, const uint64_t label)
+    {
+        code.push_back({ Opcode::cbz, no_reg, cond, no_reg, 0, label });
+    }
+
+    static void branch_nonzero(Code& code, const Reg cond, const uint64_t label)
+    {
+        code.push_back({ Opcode::cbnz, no_reg, cond, no_reg, 0, label });
+    }
+
+    // Exits with the status in reg(0)
+    static void exit(Code& code)
+    {
+        emit_exit(code, os);
+    }
+
+    [[nodiscard]] static std::vector<uint32_t> encode(const Code& code)
+    {
+        return Encoder(code).encode();
+    }
+
+    static void print(OutputBuffer& out, const Code& code)
+    {
+        arm64::print(out, code);
+    }
+
+    static void print_insts(OutputBuffer& out, const Code& code)
+    {
+        arm64::print_insts(out, code);
+    }
+};
+
+} // namespace arm64
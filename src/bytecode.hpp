@@ -0,0 +1,427 @@
+#pragma once
+
+#include "parser.hpp"
+#include "symbols.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// A register bytecode for running programs in-process (see vm.hpp). Every
+// value is a uint64_t register in one flat frame: variables get the slots the
+// native generator would give them, so a slot freed by a closed scope is reused
+// the same way, and expression temporaries sit above the highest slot.
+namespace bytecode {
+
+enum class Op : uint8_t {
+    // r[a] = imm
+    load_imm,
+    // r[a] = r[b]
+    mov,
+    // r[a] = r[b] op r[c], where a division by zero gives 0
+    add,
+    sub,
+    mul,
+    div,
+    // Superinstructions for a literal operand: r[a] = r[b] op imm. A subtract
+    // is an add of the negated literal.
+    add_imm,
+    mul_imm,
+    div_imm,
+    shr_imm,
+    // r[a] = imm op r[b], for a literal lhs of a subtract or divide
+    rsub_imm,
+    rdiv_imm,
+    // Jump to instruction imm, unconditionally or if r[a] == 0
+    jump,
+    jump_zero,
+    // Fused `if (x - y)`: jump to instruction imm if r[a] == r[b]
+    jump_eq,
+    // Fused `if (x - k)`: jump to instruction b if r[a] == imm
+    jump_eq_imm,
+    // Stop with exit value r[a], or imm
+    exit,
+    exit_imm
+};
+
+constexpr std::size_t op_count = static_cast<std::size_t>(Op::exit_imm) + 1;
+
+struct Inst {
+    Op op;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint64_t imm;
+};
+
+struct Program {
+    std::vector<Inst> code;
+    // Variable slots and temporaries together
+    uint32_t num_regs;
+};
+
+// Lowers the resolved AST to bytecode. Expressions are walked with an explicit
+// work stack, as in Generator, and each leaves an operand rather than a value
+// in a register: a literal, a variable's own slot, or a temporary. Operators
+// with a literal operand become the _imm forms, an expression assigned to a
+// variable is computed straight into its slot, and an if compares its
+// subtraction instead of computing it, so `x = x + 1` and `if (x - 3)` are
+// each a single instruction.
+class Compiler {
+public:
+    inline explicit Compiler(NodeProg prog)
+        : m_prog(std::move(prog))
+        , m_vars(m_prog.symbols.size())
+    {
+    }
+
+    [[nodiscard]] Program compile_prog()
+    {
+        // Most statements are a single instruction
+        m_code.reserve(m_prog.stmts.size() + 1);
+        for (NodeIndex i = 0; i < m_prog.body.count; i++) {
+            compile_stmt(m_prog.scope_stmts[m_prog.body.first + i]);
+        }
+        emit({ Op::exit_imm, 0, 0, 0, 0 });
+
+        // Only now is the number of slots known, so temporaries can be placed
+        const auto temp_base = static_cast<uint32_t>(m_max_slots);
+        for (Inst& inst : m_code) {
+            for (uint32_t* reg : { &inst.a, &inst.b, &inst.c }) {
+                if (is_temp(*reg)) {
+                    *reg = temp_base + (*reg & ~temp_flag);
+                }
+            }
+        }
+        // jump_eq_imm keeps its target in b, which is never a temporary
+        return { std::move(m_code), temp_base + m_max_temps };
+    }
+
+private:
+    // Marks a temporary's register until compile_prog places it
+    static constexpr uint32_t temp_flag = 1u << 31;
+
+    struct Operand {
+        bool is_imm;
+        // The literal, or the register
+        uint64_t value;
+    };
+
+    static bool is_temp(const uint32_t reg)
+    {
+        return (reg & temp_flag) != 0;
+    }
+
+    void emit(const Inst& inst)
+    {
+        m_code.push_back(inst);
+    }
+
+    // Index of the next instruction, for jump targets
+    [[nodiscard]] uint64_t here() const
+    {
+        return m_code.size();
+    }
+
+    [[nodiscard]] uint32_t slot_of(const SymbolId sym) const
+    {
+        const Var* var = m_vars.lookup(sym);
+        assert(var != nullptr); // Checked by NameResolver
+        return var->slot;
+    }
+
+    uint32_t alloc_temp()
+    {
+        const uint32_t temp = m_temp_count++;
+        m_max_temps = std::max(m_max_temps, m_temp_count);
+        return temp_flag | temp;
+    }
+
+    // Temporaries are freed in the reverse of the order they were taken
+    void release(const Operand& operand)
+    {
+        if (!operand.is_imm && is_temp(static_cast<uint32_t>(operand.value))) {
+            m_temp_count--;
+        }
+    }
+
+    static uint64_t fold(const ExprKind kind, const uint64_t lhs, const uint64_t rhs)
+    {
+        switch (kind) {
+        case ExprKind::add:
+            return lhs + rhs;
+        case ExprKind::sub:
+            return lhs - rhs;
+        case ExprKind::multi:
+            return lhs * rhs;
+        default:
+            return rhs == 0 ? 0 : lhs / rhs;
+        }
+    }
+
+    void emit_binary(const ExprKind kind, const uint32_t dst, const Operand& lhs, const Operand& rhs)
+    {
+        const auto b = static_cast<uint32_t>(lhs.value);
+        const auto c = static_cast<uint32_t>(rhs.value);
+        if (rhs.is_imm) {
+            const uint64_t imm = rhs.value;
+            switch (kind) {
+            case ExprKind::add:
+                emit({ Op::add_imm, dst, b, 0, imm });
+                return;
+            case ExprKind::sub:
+                emit({ Op::add_imm, dst, b, 0, -imm });
+                return;
+            case ExprKind::multi:
+                emit({ Op::mul_imm, dst, b, 0, imm });
+                return;
+            default:
+                if (imm == 0) {
+                    emit({ Op::load_imm, dst, 0, 0, 0 });
+                }
+                else if ((imm & (imm - 1)) == 0) {
+                    emit({ Op::shr_imm, dst, b, 0, static_cast<uint64_t>(__builtin_ctzll(imm)) });
+                }
+                else {
+                    emit({ Op::div_imm, dst, b, 0, imm });
+                }
+                return;
+            }
+        }
+        if (lhs.is_imm) {
+            const uint64_t imm = lhs.value;
+            switch (kind) {
+            case ExprKind::add:
+                emit({ Op::add_imm, dst, c, 0, imm });
+                return;
+            case ExprKind::sub:
+                emit({ Op::rsub_imm, dst, c, 0, imm });
+                return;
+            case ExprKind::multi:
+                emit({ Op::mul_imm, dst, c, 0, imm });
+                return;
+            default:
+                emit({ Op::rdiv_imm, dst, c, 0, imm });
+                return;
+            }
+        }
+        static constexpr Op ops[] = { Op::add, Op::sub, Op::mul, Op::div };
+        emit({ ops[static_cast<uint8_t>(kind) - static_cast<uint8_t>(ExprKind::add)], dst, b, c, 0 });
+    }
+
+    // Emits the code for `root` and returns where its value ends up. With
+    // `dest`, an operator at the root writes there instead of a temporary.
+    Operand compile_expr(const NodeIndex root, const std::optional<uint32_t> dest = {})
+    {
+        m_pending_exprs.clear();
+        m_operands.clear();
+        m_pending_exprs.push_back({ root, false });
+        while (!m_pending_exprs.empty()) {
+            const PendingExpr pending = m_pending_exprs.back();
+            m_pending_exprs.pop_back();
+            const NodeExpr& expr = m_prog.exprs[pending.index];
+            switch (expr.kind) {
+            case ExprKind::int_lit:
+                m_operands.push_back({ true, static_cast<uint64_t>(m_prog.literals[expr.lhs]) });
+                continue;
+            case ExprKind::ident:
+                m_operands.push_back({ false, slot_of(expr.lhs) });
+                continue;
+            default:
+                break;
+            }
+            if (!pending.combine) {
+                // Pushed in reverse: the lhs runs first
+                m_pending_exprs.push_back({ pending.index, true });
+                m_pending_exprs.push_back({ expr.rhs, false });
+                m_pending_exprs.push_back({ expr.lhs, false });
+                continue;
+            }
+            const Operand rhs = m_operands.back();
+            m_operands.pop_back();
+            const Operand lhs = m_operands.back();
+            m_operands.pop_back();
+            if (lhs.is_imm && rhs.is_imm) {
+                m_operands.push_back({ true, fold(expr.kind, lhs.value, rhs.value) });
+                continue;
+            }
+            release(rhs);
+            release(lhs);
+            const uint32_t dst = pending.index == root && dest.has_value() ? *dest : alloc_temp();
+            emit_binary(expr.kind, dst, lhs, rhs);
+            m_operands.push_back({ false, dst });
+        }
+        return m_operands.back();
+    }
+
+    // Evaluates `root` into register `dst`
+    void compile_expr_into(const NodeIndex root, const uint32_t dst)
+    {
+        const Operand value = compile_expr(root, dst);
+        if (value.is_imm) {
+            emit({ Op::load_imm, dst, 0, 0, value.value });
+        }
+        else if (value.value != dst) {
+            emit({ Op::mov, dst, static_cast<uint32_t>(value.value), 0, 0 });
+        }
+    }
+
+    // Emits a jump taken when `root` is zero and returns its index, for the
+    // caller to patch with the target once known, or returns nothing if
+    // `root` is a literal that is not zero
+    std::optional<std::size_t> compile_jump_if_zero(const NodeIndex root)
+    {
+        const NodeExpr& expr = m_prog.exprs[root];
+        if (expr.kind == ExprKind::sub) {
+            // x - y is zero exactly when x == y, so no difference is computed
+            const Operand lhs = compile_expr(expr.lhs);
+            const Operand rhs = compile_expr(expr.rhs);
+            release(rhs);
+            release(lhs);
+            const std::size_t at = m_code.size();
+            if (lhs.is_imm && rhs.is_imm) {
+                if (lhs.value != rhs.value) {
+                    return {};
+                }
+                emit({ Op::jump, 0, 0, 0, 0 });
+            }
+            else if (lhs.is_imm || rhs.is_imm) {
+                const Operand& reg = lhs.is_imm ? rhs : lhs;
+                const Operand& imm = lhs.is_imm ? lhs : rhs;
+                emit({ Op::jump_eq_imm, static_cast<uint32_t>(reg.value), 0, 0, imm.value });
+            }
+            else {
+                emit({ Op::jump_eq, static_cast<uint32_t>(lhs.value), static_cast<uint32_t>(rhs.value), 0, 0 });
+            }
+            return at;
+        }
+        const Operand value = compile_expr(root);
+        release(value);
+        if (value.is_imm && value.value != 0) {
+            return {};
+        }
+        const std::size_t at = m_code.size();
+        if (value.is_imm) {
+            emit({ Op::jump, 0, 0, 0, 0 });
+        }
+        else {
+            emit({ Op::jump_zero, static_cast<uint32_t>(value.value), 0, 0, 0 });
+        }
+        return at;
+    }
+
+    void patch(const std::size_t at, const uint64_t target)
+    {
+        Inst& inst = m_code[at];
+        if (inst.op == Op::jump_eq_imm) {
+            inst.b = static_cast<uint32_t>(target);
+        }
+        else {
+            inst.imm = target;
+        }
+    }
+
+    void compile_scope(const NodeScope& scope)
+    {
+        m_vars.begin_scope();
+        for (NodeIndex i = 0; i < scope.count; i++) {
+            compile_stmt(m_prog.scope_stmts[scope.first + i]);
+        }
+        // The scope's slots are free for whatever is declared next
+        m_slot_count -= static_cast<uint32_t>(m_vars.end_scope());
+    }
+
+    // One arm of an if: its body runs when `cond` is not zero and then jumps
+    // to the end, which is patched once the whole if is done
+    void compile_branch(const NodeIndex cond, const NodeIndex scope)
+    {
+        const std::optional<std::size_t> if_false = compile_jump_if_zero(cond);
+        compile_scope(m_prog.scopes[scope]);
+        m_end_jumps.push_back(m_code.size());
+        emit({ Op::jump, 0, 0, 0, 0 });
+        if (if_false.has_value()) {
+            patch(*if_false, here());
+        }
+    }
+
+    void compile_stmt(const NodeIndex index)
+    {
+        const NodeStmt& stmt = m_prog.stmts[index];
+        switch (stmt.kind) {
+        case StmtKind::exit: {
+            const Operand value = compile_expr(m_prog.exits[stmt.index].expr);
+            release(value);
+            if (value.is_imm) {
+                emit({ Op::exit_imm, 0, 0, 0, value.value });
+            }
+            else {
+                emit({ Op::exit, static_cast<uint32_t>(value.value), 0, 0, 0 });
+            }
+            return;
+        }
+        case StmtKind::var: {
+            // Declared after its initialiser, as NameResolver checks it
+            const NodeStmtVar& stmt_var = m_prog.vars[stmt.index];
+            const uint32_t slot = m_slot_count;
+            compile_expr_into(stmt_var.expr, slot);
+            m_vars.declare(stmt_var.sym, { slot });
+            m_slot_count++;
+            m_max_slots = std::max(m_max_slots, m_slot_count);
+            return;
+        }
+        case StmtKind::assign: {
+            const NodeStmtAssign& stmt_assign = m_prog.assigns[stmt.index];
+            compile_expr_into(stmt_assign.expr, slot_of(stmt_assign.sym));
+            return;
+        }
+        case StmtKind::scope:
+            compile_scope(m_prog.scopes[stmt.index]);
+            return;
+        case StmtKind::if_: {
+            const NodeStmtIf& stmt_if = m_prog.ifs[stmt.index];
+            // Nested ifs push and patch their own jumps above this mark
+            const std::size_t mark = m_end_jumps.size();
+            compile_branch(stmt_if.expr, stmt_if.scope);
+            for (NodeIndex p = stmt_if.pred; p != no_node; p = m_prog.preds[p].pred) {
+                const NodeIfPred& pred = m_prog.preds[p];
+                if (pred.kind == IfPredKind::else_) {
+                    compile_scope(m_prog.scopes[pred.scope]);
+                    break;
+                }
+                compile_branch(pred.expr, pred.scope);
+            }
+            for (std::size_t i = mark; i < m_end_jumps.size(); i++) {
+                patch(m_end_jumps[i], here());
+            }
+            m_end_jumps.resize(mark);
+            return;
+        }
+        }
+    }
+
+    struct Var {
+        uint32_t slot;
+    };
+
+    struct PendingExpr {
+        NodeIndex index;
+        // Set once the operands are done, to apply the operator
+        bool combine;
+    };
+
+    const NodeProg m_prog;
+    std::vector<Inst> m_code {};
+    // Slots in use by variables in scope
+    uint32_t m_slot_count = 0;
+    uint32_t m_max_slots = 0;
+    uint32_t m_temp_count = 0;
+    uint32_t m_max_temps = 0;
+    ScopedSymbolTable<Var> m_vars;
+    std::vector<PendingExpr> m_pending_exprs {};
+    std::vector<Operand> m_operands {};
+    // Jumps to the end of the ifs being compiled, innermost last
+    std::vector<std::size_t> m_end_jumps {};
+};
+
+} // namespace bytecode
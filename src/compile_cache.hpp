@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk cache of finished executables, keyed by a 128-bit hash of the source
+// bytes and of everything else that decides the output: the compiler build,
+// the target and the optimisation flags. A hit copies the stored executable
+// into place, so tokenising, parsing, codegen and assembling are all skipped.
+//
+// Several compiler processes (and the threads of a batch) may share one
+// directory. An entry is written to a private temporary file and linked into
+// place, so readers only ever see whole entries. An entry's mtime records its
+// last use, and the oldest go first once the cache outgrows its size limit.
+// The hit and miss counters and the running byte total live in a small stats
+// file, updated under flock.
+class CompileCache final {
+public:
+    struct Key {
+        uint64_t high;
+        uint64_t low;
+
+        [[nodiscard]] std::string hex() const
+        {
+            std::string text(32, '0');
+            put_hex(text.data(), high);
+            put_hex(text.data() + 16, low);
+            return text;
+        }
+
+    private:
+        static void put_hex(char* out, const uint64_t value)
+        {
+            char digits[16];
+            const std::to_chars_result result = std::to_chars(digits, digits + 16, value, 16);
+            const std::size_t count = static_cast<std::size_t>(result.ptr - digits);
+            std::memcpy(out + 16 - count, digits, count);
+        }
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        // Bytes held by entries
+        uint64_t bytes = 0;
+    };
+
+    CompileCache(std::string dir, const uint64_t max_bytes)
+        : m_dir(std::move(dir))
+        , m_max_bytes(max_bytes)
+    {
+    }
+
+    // Creates the directory if need be. Returns false if it is unusable.
+    bool open() const
+    {
+        if (::mkdir(m_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        struct stat st {};
+        return ::stat(m_dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && ::access(m_dir.c_str(), W_OK) == 0;
+    }
+
+    // `config` is everything besides the source that changes the output
+    [[nodiscard]] static Key key(const std::string_view source, const std::string_view config)
+    {
+        const uint64_t config_hash = hash(config, 0x9e3779b97f4a7c15);
+        return { hash(source, config_hash), hash(source, ~config_hash ^ 0x2545f4914f6cdd1d) };
+    }
+
+    // Copies the entry for `key` to `path` as an executable and marks it used.
+    // Counts a hit or a miss; returns whether it was a hit.
+    bool fetch(const Key& key, const std::string& path)
+    {
+        const std::string entry = entry_path(key);
+        bool hit = false;
+        const int in = ::open(entry.c_str(), O_RDONLY);
+        if (in >= 0) {
+            hit = copy(in, path, 0755);
+            // Touching the entry makes it the most recently used
+            (void)::futimens(in, nullptr);
+            ::close(in);
+        }
+        update_stats([&](Stats& stats) { (hit ? stats.hits : stats.misses)++; });
+        return hit;
+    }
+
+    // Adds the executable at `path` under `key`, then evicts the least recently
+    // used entries if the cache has grown past its limit. A failure to store
+    // only loses the entry.
+    void store(const Key& key, const std::string& path)
+    {
+        const int in = ::open(path.c_str(), O_RDONLY);
+        if (in < 0) {
+            return;
+        }
+        struct stat st {};
+        const std::string entry = entry_path(key);
+        const std::string temp = entry + ".tmp." + std::to_string(::getpid()) + "."
+            + std::to_string(s_temp_count.fetch_add(1, std::memory_order_relaxed));
+        const bool copied = ::fstat(in, &st) == 0 && copy(in, temp, 0644);
+        ::close(in);
+        // Unlike rename, link fails if another store got there first, so an
+        // entry's bytes are counted once however many processes race to add it
+        const bool added = copied && ::link(temp.c_str(), entry.c_str()) == 0;
+        ::unlink(temp.c_str());
+        if (!added) {
+            return;
+        }
+        update_stats([&](Stats& stats) {
+            stats.bytes += static_cast<uint64_t>(st.st_size);
+            if (stats.bytes > m_max_bytes) {
+                stats.bytes = evict();
+            }
+        });
+    }
+
+    [[nodiscard]] Stats stats()
+    {
+        Stats result;
+        update_stats([&](Stats& stats) { result = stats; });
+        return result;
+    }
+
+private:
+    // Temporary files older than this were left by a compiler that died
+    static constexpr time_t stale_temp_seconds = 3600;
+
+    // A wyhash-style mix: 128-bit multiply, folded back to 64 bits
+    static uint64_t mix(const uint64_t a, const uint64_t b)
+    {
+        const __uint128_t product = static_cast<__uint128_t>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+    static uint64_t hash(const std::string_view bytes, const uint64_t seed)
+    {
+        constexpr uint64_t prime0 = 0xa0761d6478bd642f;
+        constexpr uint64_t prime1 = 0xe7037ed1a0b428db;
+        uint64_t h = seed ^ mix(bytes.size() ^ prime0, prime1);
+        std::size_t i = 0;
+        for (; i + 8 <= bytes.size(); i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes.data() + i, 8);
+            h = mix(h ^ word, prime1);
+        }
+        uint64_t tail = 0;
+        // An empty view may have a null data(), which memcpy must not be given
+        if (i < bytes.size()) {
+            std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+        }
+        return mix(mix(h ^ tail, prime0), prime1 ^ bytes.size());
+    }
+
+    static timespec last_used(const struct stat& st)
+    {
+#if defined(__APPLE__)
+        return st.st_mtimespec;
+#else
+        return st.st_mtim;
+#endif
+    }
+
+    [[nodiscard]] std::string entry_path(const Key& key) const
+    {
+        return m_dir + "/" + key.hex();
+    }
+
+    // Copies the rest of `in` to a new file at `path`
+    static bool copy(const int in, const std::string& path, const mode_t mode)
+    {
+        const int out = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+        if (out < 0) {
+            return false;
+        }
+        char buffer[1 << 16];
+        bool ok = true;
+        ssize_t count = 0;
+        while (ok && (count = ::read(in, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t done = 0; ok && done < count;) {
+                const ssize_t written = ::write(out, buffer + done, static_cast<std::size_t>(count - done));
+                ok = written > 0;
+                done += ok ? written : 0;
+            }
+        }
+        // The mode passed to open is masked by the umask
+        ok = ok && count == 0 && ::fchmod(out, mode) == 0;
+        return ::close(out) == 0 && ok;
+    }
+
+    // Runs `update` on the stats with the stats file locked, and writes them
+    // back. Without the file the counters are simply not kept.
+    template <typename Update>
+    void update_stats(Update&& update)
+    {
+        const std::string path = m_dir + "/stats";
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return;
+        }
+        if (::flock(fd, LOCK_EX) != 0) {
+            ::close(fd);
+            return;
+        }
+        char text[64] {};
+        const ssize_t count = ::pread(fd, text, sizeof(text) - 1, 0);
+        Stats stats;
+        if (count > 0) {
+            const char* pos = text;
+            const char* const end = text + count;
+            for (uint64_t* field : { &stats.hits, &stats.misses, &stats.bytes }) {
+                pos = std::from_chars(pos, end, *field).ptr;
+                pos += pos < end ? 1 : 0;
+            }
+        }
+        update(stats);
+        const std::string line = std::to_string(stats.hits) + " " + std::to_string(stats.misses) + " "
+            + std::to_string(stats.bytes) + "\n";
+        if (::pwrite(fd, line.data(), line.size(), 0) == static_cast<ssize_t>(line.size())) {
+            (void)::ftruncate(fd, static_cast<off_t>(line.size()));
+        }
+        ::close(fd);
+    }
+
+    // Deletes entries, least recently used first, until they fit in 90% of the
+    // limit, so the next few stores do not each trigger a scan. Also sweeps up
+    // stale temporary files. Returns the bytes left. Called with the stats
+    // lock held, which keeps evictions from running side by side.
+    uint64_t evict()
+    {
+        struct Entry {
+            std::string path;
+            timespec used;
+            uint64_t bytes;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        const std::unique_ptr<DIR, int (*)(DIR*)> dir(::opendir(m_dir.c_str()), ::closedir);
+        if (dir == nullptr) {
+            return 0;
+        }
+        const time_t now = ::time(nullptr);
+        while (const dirent* item = ::readdir(dir.get())) {
+            const std::string_view name = item->d_name;
+            const std::string path = m_dir + "/" + std::string(name);
+            struct stat st {};
+            if (name.size() < 32 || ::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            if (name.size() > 32) {
+                if (name.substr(32, 5) == ".tmp." && now - st.st_mtime > stale_temp_seconds) {
+                    ::unlink(path.c_str());
+                }
+                continue;
+            }
+            entries.push_back({ path, last_used(st), static_cast<uint64_t>(st.st_size) });
+            total += static_cast<uint64_t>(st.st_size);
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+        });
+        const uint64_t target = m_max_bytes / 10 * 9;
+        for (const Entry& entry : entries) {
+            if (total <= target) {
+                break;
+            }
+            if (::unlink(entry.path.c_str()) == 0) {
+                total -= entry.bytes;
+            }
+        }
+        return total;
+    }
+
+    const std::string m_dir;
+    const uint64_t m_max_bytes;
+    static inline std::atomic<uint64_t> s_temp_count { 0 };
+};
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+// A problem with the program being compiled, carrying the message the driver
+// prints. The passes throw it rather than exiting, so that in a batch one bad
+// file fails on its own and the rest still compile.
+class CompileError final : public std::runtime_error {
+public:
+    explicit CompileError(const std::string& message)
+        : std::runtime_error(message)
+    {
+    }
+};
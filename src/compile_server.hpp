@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cerrno>
+#include <charconv>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "passes.hpp"
+#include "target.hpp"
+
+// A long-lived compiler listening on a Unix domain socket, and the thin client
+// that talks to it. Each connection carries one request: the client sends it
+// and shuts down its side, and the server answers and closes. The client has
+// already parsed and checked its command line, so a request is just the
+// settings and absolute paths, as NUL-separated fields; the server reads the
+// source and writes the outputs itself, as a local compile would.
+struct CompileRequest {
+    Target target;
+    OptLevel level;
+    std::size_t peephole_window;
+    std::string source;
+    std::string assembly;
+    std::string object;
+    std::string executable;
+};
+
+// The answer: whether the compile succeeded, and if not, the error to print
+struct CompileReply {
+    bool ok;
+    std::string message;
+};
+
+namespace compile_server {
+
+constexpr std::string_view protocol = "microcompiler-1";
+
+// How long the server waits for more of a request before it gives up on the
+// client, so one that never shuts down its side cannot hold a worker
+constexpr time_t request_timeout_seconds = 5;
+
+inline std::string encode(const CompileRequest& request)
+{
+    const std::string target = std::to_string(static_cast<int>(request.target));
+    const std::string level = std::to_string(static_cast<int>(request.level));
+    const std::string window = std::to_string(request.peephole_window);
+    std::string bytes;
+    for (const std::string_view field : { protocol, std::string_view(target), std::string_view(level),
+             std::string_view(window), std::string_view(request.source), std::string_view(request.assembly),
+             std::string_view(request.object), std::string_view(request.executable) }) {
+        bytes.append(field);
+        bytes.push_back('\0');
+    }
+    return bytes;
+}
+
+inline std::optional<CompileRequest> decode(std::string_view bytes)
+{
+    std::vector<std::string_view> fields;
+    while (!bytes.empty()) {
+        const std::size_t end = bytes.find('\0');
+        if (end == std::string_view::npos) {
+            return {};
+        }
+        fields.push_back(bytes.substr(0, end));
+        bytes.remove_prefix(end + 1);
+    }
+    if (fields.size() != 8 || fields[0] != protocol) {
+        return {};
+    }
+    const auto number = [](const std::string_view text, std::size_t& value) {
+        return std::from_chars(text.data(), text.data() + text.size(), value).ptr == text.data() + text.size();
+    };
+    std::size_t target;
+    std::size_t level;
+    std::size_t window;
+    if (!number(fields[1], target) || target > static_cast<std::size_t>(Target::x86_64_linux)
+        || !number(fields[2], level) || level > static_cast<std::size_t>(OptLevel::o2) || !number(fields[3], window)
+        || window == 0) {
+        return {};
+    }
+    return CompileRequest { static_cast<Target>(target), static_cast<OptLevel>(level), window,
+        std::string(fields[4]), std::string(fields[5]), std::string(fields[6]), std::string(fields[7]) };
+}
+
+inline std::string encode(const CompileReply& reply)
+{
+    return (reply.ok ? "0" : "1") + reply.message;
+}
+
+inline CompileReply decode_reply(const std::string_view bytes)
+{
+    if (bytes.empty() || (bytes[0] != '0' && bytes[0] != '1')) {
+        return { false, "Invalid reply from compile server" };
+    }
+    return { bytes[0] == '0', std::string(bytes.substr(1)) };
+}
+
+// Fills in a Unix socket address. Returns false if `path` is too long for one.
+inline bool make_address(const std::string& path, sockaddr_un& address)
+{
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+    return true;
+}
+
+inline bool write_all(const int fd, const std::string_view bytes)
+{
+    for (std::size_t done = 0; done < bytes.size();) {
+        const ssize_t written = ::write(fd, bytes.data() + done, bytes.size() - done);
+        if (written <= 0) {
+            return false;
+        }
+        done += static_cast<std::size_t>(written);
+    }
+    return true;
+}
+
+// Reads until the other side shuts down its end. Fails on a read error,
+// including a receive timeout set on the socket.
+inline bool read_all(const int fd, std::string& bytes)
+{
+    char buffer[4096];
+    while (true) {
+        const ssize_t count = ::read(fd, buffer, sizeof(buffer));
+        if (count < 0) {
+            return false;
+        }
+        if (count == 0) {
+            return true;
+        }
+        bytes.append(buffer, static_cast<std::size_t>(count));
+    }
+}
+
+// Sends `request` to the server at `socket_path` and waits for its reply, or
+// returns nothing if there is no server to talk to
+inline std::optional<CompileReply> send(const std::string& socket_path, const CompileRequest& request)
+{
+    sockaddr_un address;
+    if (!make_address(socket_path, address)) {
+        return {};
+    }
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return {};
+    }
+    std::string reply;
+    const bool ok = ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0
+        && write_all(fd, encode(request)) && ::shutdown(fd, SHUT_WR) == 0 && read_all(fd, reply);
+    ::close(fd);
+    if (!ok) {
+        return {};
+    }
+    return decode_reply(reply);
+}
+
+// Listens at `socket_path`, replacing any socket a previous server left there,
+// and answers requests with `handle` on `workers` threads until killed. Each
+// worker accepts its own connections and calls handle(worker, request), so
+// state indexed by worker stays warm from one request to the next and is
+// never shared. Returns false only if the socket cannot be set up.
+template <typename Handler>
+bool serve(const std::string& socket_path, const unsigned workers, Handler&& handle)
+{
+    sockaddr_un address;
+    if (!make_address(socket_path, address)) {
+        return false;
+    }
+    const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return false;
+    }
+    ::unlink(socket_path.c_str());
+    // Only this user may connect, since the server writes wherever it is asked
+    const mode_t mask = ::umask(0077);
+    const bool bound = ::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    ::umask(mask);
+    if (!bound || ::listen(listener, SOMAXCONN) != 0) {
+        ::close(listener);
+        return false;
+    }
+    // A client that goes away before its reply must not take the server down
+    std::signal(SIGPIPE, SIG_IGN);
+
+    const auto work = [&](const unsigned worker) {
+        while (true) {
+            const int fd = ::accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            const timeval timeout { request_timeout_seconds, 0 };
+            (void)::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            std::string bytes;
+            CompileReply reply { false, "Invalid request" };
+            if (read_all(fd, bytes)) {
+                if (const std::optional<CompileRequest> request = decode(bytes)) {
+                    reply = handle(worker, request.value());
+                }
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                reply.message = "Timed out waiting for the request";
+            }
+            write_all(fd, encode(reply));
+            ::close(fd);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < workers; i++) {
+        pool.emplace_back(work, i);
+    }
+    work(0);
+    return true;
+}
+
+} // namespace compile_server
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Writes machine code out as a static Linux executable for `machine` (the ELF
+// e_machine). The file is the ELF header, one program header that maps the
+// whole file read+execute, and then the code, whose first instruction is the
+// entry point. There are no sections or symbols, since nothing links against
+// it. The code is a vector of whatever unit the encoder emits: 32-bit words
+// for ARM64, bytes for x86-64.
+template <typename Word>
+class ElfWriter {
+public:
+    static constexpr uint64_t base_address = 0x400000;
+    static constexpr uint64_t header_size = 64;
+    static constexpr uint64_t program_header_size = 56;
+    static constexpr uint64_t code_offset = header_size + program_header_size;
+
+    inline ElfWriter(const uint16_t machine, const std::vector<Word>& code)
+        : m_machine(machine)
+        , m_code(code)
+    {
+    }
+
+    // Returns false if the file could not be written. The header is built
+    // in place and goes out in the same writev as the code, which is never
+    // copied.
+    bool write(const std::string& path)
+    {
+        const uint64_t code_size = m_code.size() * sizeof(Word);
+        const uint64_t file_size = code_offset + code_size;
+        m_size = 0;
+
+        // ELF header: 64-bit, little-endian, current version, System V ABI
+        put_bytes({ 0x7f, 'E', 'L', 'F', 2, 1, 1, 0 });
+        put(0, 8);
+        put(2, 2); // ET_EXEC
+        put(m_machine, 2);
+        put(1, 4); // EV_CURRENT
+        put(base_address + code_offset, 8); // Entry point
+        put(header_size, 8); // Program headers follow this header
+        put(0, 8); // No section headers
+        put(0, 4); // Flags
+        put(header_size, 2);
+        put(program_header_size, 2);
+        put(1, 2); // One program header
+        put(0, 2);
+        put(0, 2);
+        put(0, 2);
+
+        // Program header: load the file at base_address, readable and executable
+        put(1, 4); // PT_LOAD
+        put(5, 4); // PF_R | PF_X
+        put(0, 8); // From the start of the file
+        put(base_address, 8);
+        put(base_address, 8);
+        put(file_size, 8);
+        put(file_size, 8);
+        put(0x10000, 8); // Alignment, the largest page size
+
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0755);
+        if (fd < 0) {
+            return false;
+        }
+        // The code is already in the file's byte order on little-endian hosts
+        iovec parts[2] = { { m_header.data(), code_offset },
+            { const_cast<Word*>(m_code.data()), static_cast<size_t>(code_size) } };
+        uint64_t remaining = file_size;
+        bool ok = true;
+        while (ok && remaining > 0) {
+            const ssize_t written = ::writev(fd, parts, 2);
+            ok = written > 0;
+            remaining -= ok ? static_cast<uint64_t>(written) : 0;
+            skip(parts, ok ? static_cast<size_t>(written) : 0);
+        }
+        // The mode passed to open is masked by the umask
+        ok = ok && ::fchmod(fd, 0755) == 0;
+        return ::close(fd) == 0 && ok;
+    }
+
+private:
+    // Little-endian, `size` bytes wide
+    void put(const uint64_t value, const size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            m_header[m_size++] = static_cast<uint8_t>(value >> (i * 8));
+        }
+    }
+
+    void put_bytes(std::initializer_list<uint8_t> bytes)
+    {
+        for (const uint8_t byte : bytes) {
+            m_header[m_size++] = byte;
+        }
+    }
+
+    // Moves `parts` past `bytes` already written, after a short writev
+    static void skip(iovec (&parts)[2], size_t bytes)
+    {
+        for (iovec& part : parts) {
+            const size_t step = std::min(bytes, part.iov_len);
+            part.iov_base = static_cast<uint8_t*>(part.iov_base) + step;
+            part.iov_len -= step;
+            bytes -= step;
+        }
+    }
+
+    const uint16_t m_machine;
+    const std::vector<Word>& m_code;
+    std::array<uint8_t, code_offset> m_header {};
+    size_t m_size = 0;
+};
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "arm64.hpp"
+#include "immediates.hpp"
+
+namespace arm64 {
+
+// Turns structured instructions into AArch64 machine code, so no assembler is
+// needed. Every instruction is one word, except labels and nops, which take
+// none, and conditional branches whose label is beyond their +-1 MiB reach.
+// Those are relaxed into the inverse branch over an unconditional b.
+class Encoder {
+public:
+    inline explicit Encoder(const std::vector<Inst>& code)
+        : m_code(code)
+        , m_long(code.size(), false)
+    {
+    }
+
+    [[nodiscard]] std::vector<uint32_t> encode()
+    {
+        // Lengthening one branch can only push others out of range, so this
+        // settles after a few rounds
+        while (layout()) { }
+        std::vector<uint32_t> words;
+        words.reserve(m_size);
+        for (size_t i = 0; i < m_code.size(); i++) {
+            encode_inst(words, i);
+        }
+        assert(words.size() == m_size);
+        return words;
+    }
+
+private:
+    static constexpr int64_t cond_branch_reach = int64_t { 1 } << 18;
+    static constexpr int64_t branch_reach = int64_t { 1 } << 25;
+
+    // Places every instruction and label with the current branch lengths, then
+    // lengthens the conditional branches that cannot reach. Returns whether
+    // any did, in which case the layout has to be redone.
+    bool layout()
+    {
+        m_offset.resize(m_code.size());
+        m_label_offset.clear();
+        m_size = 0;
+        for (size_t i = 0; i < m_code.size(); i++) {
+            const Inst& inst = m_code[i];
+            m_offset[i] = m_size;
+            if (inst.op == Opcode::label) {
+                if (inst.imm >= m_label_offset.size()) {
+                    m_label_offset.resize(inst.imm + 1, 0);
+                }
+                m_label_offset[inst.imm] = m_size;
+            }
+            else if (inst.op != Opcode::nop) {
+                m_size += m_long[i] ? 2 : 1;
+            }
+        }
+        bool lengthened = false;
+        for (size_t i = 0; i < m_code.size(); i++) {
+            const Opcode op = m_code[i].op;
+            if ((op == Opcode::beq || op == Opcode::cbz || op == Opcode::cbnz) && !m_long[i]
+                && !in_reach(distance(i), cond_branch_reach)) {
+                m_long[i] = true;
+                lengthened = true;
+            }
+        }
+        return lengthened;
+    }
+
+    // Words from instruction `i` to its branch target
+    [[nodiscard]] int64_t distance(const size_t i) const
+    {
+        return static_cast<int64_t>(m_label_offset[m_code[i].imm]) - static_cast<int64_t>(m_offset[i]);
+    }
+
+    static bool in_reach(const int64_t words, const int64_t reach)
+    {
+        return words >= -reach && words < reach;
+    }
+
+    static uint32_t reg(const Reg reg)
+    {
+        assert(reg <= xzr);
+        return reg == xzr ? 31 : reg;
+    }
+
+    static uint32_t rd_rn(const Inst& inst)
+    {
+        return reg(inst.rn) << 5 | reg(inst.rd);
+    }
+
+    static uint32_t rd_rn_rm(const Inst& inst)
+    {
+        return reg(inst.rm) << 16 | rd_rn(inst);
+    }
+
+    // add/sub immediate: imm12, shifted left by 12 when the low bits are clear
+    static uint32_t arith_imm(const uint64_t imm)
+    {
+        assert(is_arith_imm(imm));
+        return imm > 0xfff ? 1u << 22 | static_cast<uint32_t>(imm >> 12) << 10 : static_cast<uint32_t>(imm) << 10;
+    }
+
+    static uint32_t imm19(const int64_t words)
+    {
+        return (static_cast<uint32_t>(words) & 0x7ffff) << 5;
+    }
+
+    static uint32_t imm26(const int64_t words)
+    {
+        assert(in_reach(words, branch_reach));
+        return static_cast<uint32_t>(words) & 0x3ffffff;
+    }
+
+    void encode_inst(std::vector<uint32_t>& words, const size_t i) const
+    {
+        const Inst& inst = m_code[i];
+        switch (inst.op) {
+        case Opcode::mov:
+            if (inst.rd == sp || inst.rn == sp) {
+                // add rd, rn, #0; orr would read xzr in place of sp
+                words.push_back(0x91000000 | rd_rn(inst));
+            }
+            else {
+                // orr rd, xzr, rn
+                words.push_back(0xaa0003e0 | reg(inst.rn) << 16 | reg(inst.rd));
+            }
+            return;
+        case Opcode::mov_imm:
+        case Opcode::movz:
+        case Opcode::movk:
+        case Opcode::movn: {
+            assert(inst.imm <= 0xffff && inst.shift % 16 == 0 && inst.shift < 64);
+            const uint32_t base = inst.op == Opcode::movk ? 0xf2800000 : inst.op == Opcode::movn ? 0x92800000 : 0xd2800000;
+            words.push_back(base | uint32_t { inst.shift } / 16 << 21 | static_cast<uint32_t>(inst.imm) << 5
+                | reg(inst.rd));
+            return;
+        }
+        case Opcode::add:
+        case Opcode::sub: {
+            const bool is_sub = inst.op == Opcode::sub;
+            if (inst.rd == sp || inst.rn == sp) {
+                // The extended-register form, with uxtx, is the one that takes sp
+                words.push_back((is_sub ? 0xcb206000 : 0x8b206000) | rd_rn_rm(inst));
+            }
+            else {
+                words.push_back((is_sub ? 0xcb000000 : 0x8b000000) | rd_rn_rm(inst));
+            }
+            return;
+        }
+        case Opcode::mul:
+            // madd rd, rn, rm, xzr
+            words.push_back(0x9b007c00 | rd_rn_rm(inst));
+            return;
+        case Opcode::udiv:
+            words.push_back(0x9ac00800 | rd_rn_rm(inst));
+            return;
+        case Opcode::umulh:
+            words.push_back(0x9bc07c00 | rd_rn_rm(inst));
+            return;
+        case Opcode::add_imm:
+            words.push_back(0x91000000 | arith_imm(inst.imm) | rd_rn(inst));
+            return;
+        case Opcode::sub_imm:
+            words.push_back(0xd1000000 | arith_imm(inst.imm) | rd_rn(inst));
+            return;
+        case Opcode::orr_imm: {
+            const std::optional<uint16_t> bitmask = encode_logical_imm(inst.imm);
+            assert(bitmask.has_value());
+            words.push_back(0xb2000000 | uint32_t { *bitmask } << 10 | rd_rn(inst));
+            return;
+        }
+        case Opcode::lsl_imm:
+            // ubfm rd, rn, #(-shift mod 64), #(63 - shift)
+            assert(inst.imm < 64);
+            words.push_back(0xd3400000 | static_cast<uint32_t>((64 - inst.imm) % 64) << 16
+                | static_cast<uint32_t>(63 - inst.imm) << 10 | rd_rn(inst));
+            return;
+        case Opcode::lsr_imm:
+            // ubfm rd, rn, #shift, #63
+            assert(inst.imm < 64);
+            words.push_back(0xd340fc00 | static_cast<uint32_t>(inst.imm) << 16 | rd_rn(inst));
+            return;
+        case Opcode::add_lsl:
+        case Opcode::add_lsr:
+        case Opcode::sub_lsl: {
+            assert(inst.shift < 64);
+            const uint32_t base = inst.op == Opcode::sub_lsl ? 0xcb000000 : 0x8b000000;
+            const uint32_t shift_type = inst.op == Opcode::add_lsr ? 1u << 22 : 0;
+            words.push_back(base | shift_type | uint32_t { inst.shift } << 10 | rd_rn_rm(inst));
+            return;
+        }
+        case Opcode::neg:
+            // sub rd, xzr, rn
+            words.push_back(0xcb0003e0 | reg(inst.rn) << 16 | reg(inst.rd));
+            return;
+        case Opcode::ldr:
+        case Opcode::str: {
+            const bool is_load = inst.op == Opcode::ldr;
+            if (inst.rm != no_reg) {
+                words.push_back((is_load ? 0xf8606800 : 0xf8206800) | rd_rn_rm(inst));
+            }
+            else {
+                assert(inst.imm % 8 == 0 && inst.imm / 8 <= 0xfff);
+                words.push_back((is_load ? 0xf9400000 : 0xf9000000) | static_cast<uint32_t>(inst.imm / 8) << 10
+                    | rd_rn(inst));
+            }
+            return;
+        }
+        case Opcode::cmp_imm:
+            // subs xzr, rn, #imm
+            words.push_back(0xf100001f | arith_imm(inst.imm) | reg(inst.rn) << 5);
+            return;
+        case Opcode::b:
+            words.push_back(0x14000000 | imm26(distance(i)));
+            return;
+        case Opcode::beq:
+        case Opcode::cbz:
+        case Opcode::cbnz:
+            encode_cond_branch(words, i);
+            return;
+        case Opcode::svc:
+            words.push_back(0xd4000001 | static_cast<uint32_t>(inst.imm) << 5);
+            return;
+        case Opcode::label:
+        case Opcode::nop:
+            return;
+        }
+    }
+
+    void encode_cond_branch(std::vector<uint32_t>& words, const size_t i) const
+    {
+        const Inst& inst = m_code[i];
+        // b.eq is b.cond with cond 0; its inverse, b.ne, has cond 1
+        const auto branch = [&](const bool inverse, const int64_t words_away) -> uint32_t {
+            switch (inst.op) {
+            case Opcode::beq:
+                return 0x54000000 | imm19(words_away) | (inverse ? 1 : 0);
+            case Opcode::cbz:
+                return (inverse ? 0xb5000000 : 0xb4000000) | imm19(words_away) | reg(inst.rn);
+            default:
+                return (inverse ? 0xb4000000 : 0xb5000000) | imm19(words_away) | reg(inst.rn);
+            }
+        };
+        if (!m_long[i]) {
+            words.push_back(branch(false, distance(i)));
+            return;
+        }
+        // Skip the b when the condition fails
+        words.push_back(branch(true, 2));
+        words.push_back(0x14000000 | imm26(distance(i) - 1));
+    }
+
+    const std::vector<Inst>& m_code;
+    // Conditional branches that go through an unconditional b
+    std::vector<bool> m_long;
+    // Word offset of each instruction and each label
+    std::vector<size_t> m_offset {};
+    std::vector<size_t> m_label_offset {};
+    size_t m_size = 0;
+};
+
+} // namespace arm64
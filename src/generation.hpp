@@ -1,270 +1,409 @@
 #pragma once
 
 #include "parser.hpp"
+#include "symbols.hpp"
+#include "target.hpp"
+#include <algorithm>
 #include <cassert>
-#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
 
+// Emits machine code for `Backend` (see target.hpp) straight from the AST
+template <typename Backend>
 class Generator {
 public:
-    inline explicit Generator(NodeProg prog)
-        : m_prog(std::move(prog))
-    {
-    }
+    using Reg = typename Backend::Isa::Reg;
+    using Code = typename Backend::Code;
 
-    void gen_term(const NodeTerm* term)
+    // The backend's value registers hold expression temporaries, and
+    // scratch(1) holds strength-reduction constants
+    static constexpr uint32_t num_expr_regs = Backend::num_regs;
+
+    // Labels are numbered from `first_label`
+    inline explicit Generator(NodeProg prog, const uint64_t first_label = 0)
+        : m_prog(std::move(prog))
+        , m_label_count(first_label)
+        , m_vars(m_prog.symbols.size())
+        , m_need(m_prog.exprs.size())
     {
-        struct TermVisitor {
-            Generator& gen;
-            void operator()(const NodeTermIntLit* term_int_lit) const
-            {
-                gen.m_output << "    mov x0, #" << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("x0");
+        // Sethi-Ullman numbers: the registers needed to evaluate each subtree
+        // without spilling. Children precede their parent in the node array,
+        // so one forward pass sees every operand before its operator.
+        for (NodeIndex i = 0; i < m_prog.exprs.size(); i++) {
+            const NodeExpr& expr = m_prog.exprs[i];
+            if (expr.kind == ExprKind::int_lit || expr.kind == ExprKind::ident) {
+                m_need[i] = 1;
             }
-            void operator()(const NodeTermIdent* term_ident) const
-            {
-                auto it = std::find_if(gen.m_vars.cbegin(), 
-                    gen.m_vars.cend(),
-                    [&](const Var& var) { return var.name == term_ident->ident.value.value();});
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                std::stringstream offset;
-                offset << "[sp, #" << (gen.m_stack_size - (*it).stack_loc - 1) * 16 + 8 << "]";
-                gen.m_output << "    ldr x0, " << offset.str() << "\n";
-                gen.push("x0");
+            else if (const std::optional<NodeIndex> literal = literal_operand(expr)) {
+                // Only the other operand needs a register
+                m_need[i] = m_need[*literal == expr.rhs ? expr.lhs : expr.rhs];
             }
-            void operator()(const NodeTermParen* term_paren) const
-            {
-                gen.gen_expr(term_paren->expr);
+            else {
+                const uint32_t lhs = m_need[expr.lhs];
+                const uint32_t rhs = m_need[expr.rhs];
+                m_need[i] = lhs == rhs ? lhs + 1 : std::max(lhs, rhs);
             }
-        };
-        TermVisitor visitor({ .gen = *this });
-        std::visit(visitor, term->var);
+        }
     }
 
-    void gen_bin_expr(const NodeBinExpr* bin_expr)
+    // Evaluates the expression into reg(0). Registers are assigned by
+    // Sethi-Ullman numbering: each subtree is evaluated into reg(base) using
+    // only reg(base) and above, the operand that needs more registers goes
+    // first, and a value is spilled to the stack only when the other operand
+    // would not fit in the remaining registers. The walk uses an explicit
+    // work stack, so deeply nested expressions cannot exhaust the native call
+    // stack.
+    void gen_expr(const NodeIndex root)
     {
-        struct BinExprVisitor {
-            Generator& gen;
-            void operator()(const NodeBinExprSub* sub) const
-            {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("x0");
-                gen.pop("x1");
-                gen.m_output << "    sub x0, x0, x1\n";
-                gen.push("x0");
+        m_pending_exprs.clear();
+        m_pending_exprs.push_back({ PendingExpr::eval, root, 0, false });
+        while (!m_pending_exprs.empty()) {
+            const PendingExpr pending = m_pending_exprs.back();
+            m_pending_exprs.pop_back();
+            const NodeExpr& expr = m_prog.exprs[pending.index];
+            switch (pending.action) {
+            case PendingExpr::eval:
+                break;
+            case PendingExpr::spill:
+                store_slot(reg(pending.base), m_slot_count++);
+                continue;
+            case PendingExpr::reload:
+                load_slot(reg(pending.base + 1), --m_slot_count);
+                continue;
+            case PendingExpr::combine: {
+                // rhs_first says the rhs is in reg(base) and the lhs in reg(base + 1)
+                const Reg first = reg(pending.base);
+                const Reg second = reg(pending.base + 1);
+                const Reg lhs = pending.rhs_first ? second : first;
+                const Reg rhs = pending.rhs_first ? first : second;
+                Backend::binary(m_code, binary_op(expr.kind), first, lhs, rhs);
+                continue;
             }
-            void operator()(const NodeBinExprAdd* add) const
-            {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("x0");
-                gen.pop("x1");
-                gen.m_output << "    add x0, x0, x1\n";
-                gen.push("x0");
+            case PendingExpr::apply_literal: {
+                const Reg value = reg(pending.base);
+                const uint64_t literal = literal_value(pending.rhs_first ? expr.lhs : expr.rhs);
+                switch (expr.kind) {
+                case ExprKind::add:
+                    Backend::add_imm(m_code, value, value, literal);
+                    break;
+                case ExprKind::sub:
+                    Backend::add_imm(m_code, value, value, -literal);
+                    break;
+                case ExprKind::multi:
+                    Backend::mul_imm(m_code, value, value, literal, Backend::scratch(1));
+                    break;
+                default:
+                    Backend::udiv_imm(m_code, value, value, literal, Backend::scratch(1));
+                    break;
+                }
+                continue;
             }
-            void operator()(const NodeBinExprMulti* multi) const
-            {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("x0");
-                gen.pop("x1");
-                gen.m_output << "    mul x0, x0, x1\n";
-                gen.push("x0");
             }
-            void operator()(const NodeBinExprDiv* div) const
-            {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("x0");
-                gen.pop("x1");
-                gen.m_output << "    udiv x0, x0, x1\n";
-                gen.push("x0");
+            switch (expr.kind) {
+            case ExprKind::int_lit:
+                Backend::mov_imm(m_code, reg(pending.base), literal_value(pending.index));
+                break;
+            case ExprKind::ident: {
+                const Var* var = m_vars.lookup(expr.lhs);
+                assert(var != nullptr); // Checked by NameResolver
+                load_slot(reg(pending.base), var->slot);
+                break;
             }
-        };
-
-        BinExprVisitor visitor { .gen = *this };
-        std::visit(visitor, bin_expr->var);
+            case ExprKind::add:
+            case ExprKind::sub:
+            case ExprKind::multi:
+            case ExprKind::div: {
+                if (const std::optional<NodeIndex> literal = literal_operand(expr)) {
+                    const bool literal_lhs = *literal == expr.lhs;
+                    m_pending_exprs.push_back({ PendingExpr::apply_literal, pending.index, pending.base, literal_lhs });
+                    m_pending_exprs.push_back(
+                        { PendingExpr::eval, literal_lhs ? expr.rhs : expr.lhs, pending.base, false });
+                    break;
+                }
+                const bool rhs_first = m_need[expr.rhs] > m_need[expr.lhs];
+                const NodeIndex first = rhs_first ? expr.rhs : expr.lhs;
+                const NodeIndex second = rhs_first ? expr.lhs : expr.rhs;
+                const uint32_t base = pending.base;
+                // Pushed in reverse: the top of the stack runs next. A spilled
+                // first operand is reloaded into reg(base + 1), after the second
+                // has been evaluated into reg(base), so the registers swap roles.
+                const bool spill = m_need[second] >= num_expr_regs - base;
+                m_pending_exprs.push_back({ PendingExpr::combine, pending.index, base, rhs_first != spill });
+                if (!spill) {
+                    m_pending_exprs.push_back({ PendingExpr::eval, second, base + 1, false });
+                }
+                else {
+                    m_pending_exprs.push_back({ PendingExpr::reload, pending.index, base, false });
+                    m_pending_exprs.push_back({ PendingExpr::eval, second, base, false });
+                    m_pending_exprs.push_back({ PendingExpr::spill, pending.index, base, false });
+                }
+                m_pending_exprs.push_back({ PendingExpr::eval, first, base, false });
+                break;
+            }
+            }
+        }
     }
 
-    void gen_scope(const NodeScope* scope) {
+    void gen_scope(const NodeScope& scope) {
         begin_scope();
-        for (const NodeStmt* stmt : scope->stmts) {
-            gen_stmt(stmt);
+        for (NodeIndex i = 0; i < scope.count; i++) {
+            gen_stmt(m_prog.scope_stmts[scope.first + i]);
         }
         end_scope(); 
     }
 
-    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label) {
-        struct PredVisitor {
-            Generator& gen;
-            const std::string& end_label;
-
-            void operator()(const NodeIfPredElif* elif) const {
-                gen.gen_expr(elif->expr);
-                gen.pop("x0");
-                const std::string label = gen.create_label();
-                gen.m_output << "    cmp x0, #0\n";
-                gen.m_output << "    beq " << label << "\n";
-                gen.gen_scope(elif->scope);
-                gen.m_output << "    b " << end_label << "\n";
-                if (elif->pred.has_value()) {
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(elif->pred.value(), end_label);
-                }
-            }
-
-            void operator()(const NodeIfPredElse* else_) const {
-                gen.gen_scope(else_->scope);
-            }
-        };
-        PredVisitor visitor{ .gen = *this, .end_label = end_label };
-        std::visit(visitor, pred->var);
-    }
-
-
-
-    void gen_expr(const NodeExpr* expr)
-    {
-        struct ExprVisitor {
-            Generator& gen;
-            void operator()(const NodeTerm* term) const
-            {
-                gen.gen_term(term);
-            }
-            void operator()(const NodeBinExpr* bin_expr) const
-            {
-                gen.gen_bin_expr(bin_expr);
+    void gen_if_pred(const NodeIndex index, const uint64_t end_label) {
+        const NodeIfPred& pred = m_prog.preds[index];
+        switch (pred.kind) {
+        case IfPredKind::elif: {
+            gen_expr(pred.expr);
+            const uint64_t label = create_label();
+            Backend::branch_zero(m_code, reg(0), label);
+            gen_scope(m_prog.scopes[pred.scope]);
+            Backend::jump(m_code, end_label);
+            Backend::label(m_code, label);
+            if (pred.pred != no_node) {
+                gen_if_pred(pred.pred, end_label);
             }
-        };
-
-        ExprVisitor visitor { .gen = *this };
-        std::visit(visitor, expr->var);
+            return;
+        }
+        case IfPredKind::else_:
+            gen_scope(m_prog.scopes[pred.scope]);
+            return;
+        }
     }
 
-void gen_stmt(const NodeStmt* stmt) {
-    struct StmtVisitor {
-        Generator& gen;
-
-        void operator()(const NodeStmtExit* stmt_exit) const {
-            gen.gen_expr(stmt_exit->expr);
-            gen.m_output << "    mov x16, #1\n";
-            gen.pop("x0");
-            gen.m_output << "    svc #0x80\n";
+    void gen_stmt(const NodeIndex index) {
+        const NodeStmt& stmt = m_prog.stmts[index];
+        switch (stmt.kind) {
+        case StmtKind::exit: {
+            const NodeStmtExit& stmt_exit = m_prog.exits[stmt.index];
+            gen_expr(stmt_exit.expr);
+            Backend::exit(m_code);
+            return;
         }
-
-        void operator()(const NodeStmtVar* stmt_let) const {
-            auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(),
-                [&](const Var& var) { return var.name == stmt_let->ident.value.value(); });
-            if (it != gen.m_vars.cend()) {
-                std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
-            gen.gen_expr(stmt_let->expr);
-            gen.push("x0");
+        case StmtKind::var: {
+            const NodeStmtVar& stmt_let = m_prog.vars[stmt.index];
+            gen_expr(stmt_let.expr);
+            m_vars.declare(stmt_let.sym, { .slot = m_slot_count });
+            store_slot(reg(0), m_slot_count++);
+            return;
         }
+        case StmtKind::assign: {
+            const NodeStmtAssign& stmt_assign = m_prog.assigns[stmt.index];
+            const Var* var = m_vars.lookup(stmt_assign.sym);
+            assert(var != nullptr); // Checked by NameResolver
+            gen_expr(stmt_assign.expr);
+            store_slot(reg(0), var->slot);
+            return;
+        }
+        case StmtKind::scope:
+            gen_scope(m_prog.scopes[stmt.index]);
+            return;
+        case StmtKind::if_: {
+            const NodeStmtIf& stmt_if = m_prog.ifs[stmt.index];
+            gen_expr(stmt_if.expr);
+            const uint64_t label_if_false = create_label();
+            const uint64_t label_end_if = create_label();
+            Backend::branch_zero(m_code, reg(0), label_if_false);
+            gen_scope(m_prog.scopes[stmt_if.scope]);
+            Backend::jump(m_code, label_end_if);
+            Backend::label(m_code, label_if_false);
 
-        void operator() (const NodeStmtAssign* stmt_assign) const {
-            auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(),
-                [&](const Var& var) { return var.name == stmt_assign->ident.value.value(); });
-            if (it == gen.m_vars.cend()) {
-                std::cerr << "Identifier has not been declared: " << stmt_assign->ident.value.value() << std::endl;
-                exit(EXIT_FAILURE);
+            if (stmt_if.pred != no_node) {
+                gen_if_pred(stmt_if.pred, label_end_if);
             }
-            gen.gen_expr(stmt_assign->expr);
-            gen.pop("x0"); 
-            std::stringstream offset;
-            offset << "[sp, #" << (gen.m_stack_size - it->stack_loc - 1) * 16 + 8 << "]"; 
-            gen.m_output << "    str x0, " << offset.str() << "\n";
 
+            Backend::label(m_code, label_end_if);
+            return;
+        }
         }
+    }
 
-        void operator()(const NodeScope* scope) const {
-            gen.gen_scope(scope);
+    [[nodiscard]] Code gen_prog()
+    {
+        for (NodeIndex i = 0; i < m_prog.body.count; i++) {
+            gen_stmt(m_prog.scope_stmts[m_prog.body.first + i]);
         }
+        const Code epilogue = gen_epilogue();
+        m_code.insert(m_code.end(), epilogue.begin(), epilogue.end());
 
-        void operator()(const NodeStmtIf* stmt_if) const {
-            gen.gen_expr(stmt_if->expr);
-            gen.pop("x0");
-            const std::string label_if_false = gen.create_label();
-            const std::string label_end_if = gen.create_label();
-            gen.m_output << "    cmp x0, #0\n";
-            gen.m_output << "    beq " << label_if_false << "\n";
-            gen.gen_scope(stmt_if->scope);
-            gen.m_output << "    b " << label_end_if << "\n";
-            gen.m_output << label_if_false << ":\n";
+        // The frame is only known once the body has been generated
+        const Code prologue = gen_prologue(m_max_slots);
+        m_code.insert(m_code.begin(), prologue.begin(), prologue.end());
+        return std::move(m_code);
+    }
 
-            if (stmt_if->pred.has_value()) {
-                gen.gen_if_pred(stmt_if->pred.value(), label_end_if);
+    // Generates the body alone, as the code of one top-level statement of a
+    // program compiled a statement at a time (see incremental.hpp). The other
+    // statements declared `outer`, as (symbol, slot) pairs, and keep their
+    // vars below `slot_count`. A top-level var goes in `var_slot`.
+    [[nodiscard]] Code gen_body(const std::vector<std::pair<SymbolId, size_t>>& outer, const size_t slot_count,
+        const size_t var_slot)
+    {
+        for (const auto& [sym, slot] : outer) {
+            m_vars.declare(sym, { .slot = slot });
+        }
+        m_slot_count = slot_count;
+        for (NodeIndex i = 0; i < m_prog.body.count; i++) {
+            const NodeIndex index = m_prog.scope_stmts[m_prog.body.first + i];
+            const NodeStmt& stmt = m_prog.stmts[index];
+            if (stmt.kind == StmtKind::var) {
+                const NodeStmtVar& stmt_var = m_prog.vars[stmt.index];
+                gen_expr(stmt_var.expr);
+                m_vars.declare(stmt_var.sym, { .slot = var_slot });
+                store_slot(reg(0), var_slot);
+            }
+            else {
+                gen_stmt(index);
             }
-
-            gen.m_output << label_end_if << ":\n";
         }
-    };
-    StmtVisitor visitor{ .gen = *this };
-    std::visit(visitor, stmt->var);
-}
-    [[nodiscard]] std::string gen_prog()
+        return std::move(m_code);
+    }
+
+    // Most slots ever in use, which sizes the frame
+    [[nodiscard]] size_t max_slots() const
     {
-        m_output << ".global _start\n_start:\n";
+        return m_max_slots;
+    }
 
-        for (const NodeStmt* stmt : m_prog.stmts) {
-            gen_stmt(stmt);
-        }
+    // Reserves the frame for `max_slots` slots. It is reserved once, so sp
+    // stays put and every slot has a fixed offset.
+    [[nodiscard]] static Code gen_prologue(const size_t max_slots)
+    {
+        Code prologue;
+        Backend::reserve_frame(prologue, (max_slots * 8 + 15) / 16 * 16);
+        return prologue;
+    }
 
-        m_output << "    mov x0, #0\n";
-        m_output << "    mov x16, #1\n";
-        m_output << "    svc #0x80\n";
-        return m_output.str();
+    // Falling off the end of the program exits with 0
+    [[nodiscard]] static Code gen_epilogue()
+    {
+        Code epilogue;
+        Backend::mov_imm(epilogue, reg(0), 0);
+        Backend::exit(epilogue);
+        return epilogue;
     }
 
 private:
-    void push(const std::string& reg)
+    static Reg reg(const uint32_t index)
     {
-        m_output << "    sub sp, sp, #16\n";
-        m_output << "    str " << reg << ", [sp, #8]\n";
-        m_stack_size++;
+        return Backend::reg(index);
     }
 
-    void pop(const std::string& reg)
+    // Slots are 8 bytes, numbered up from sp
+    void load_slot(const Reg reg, const size_t slot)
     {
-        m_output << "    ldr " << reg << ", [sp, #8]\n";
-        m_output << "    add sp, sp, #16\n";
-        m_stack_size--;
+        Backend::load_slot(m_code, reg, slot);
     }
 
-    void begin_scope() {
-        m_scopes.push_back(m_vars.size());
+    void store_slot(const Reg reg, const size_t slot)
+    {
+        Backend::store_slot(m_code, reg, slot);
+        m_max_slots = std::max(m_max_slots, slot + 1);
+    }
 
+    void begin_scope() {
+        m_vars.begin_scope();
     }
 
+    // The scope's slots are free for whatever is declared next
     void end_scope() {
-        size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add sp, sp, #" << pop_count * 16 << "\n";
-        m_stack_size -= pop_count;
-        for (int i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
-        }
-        m_scopes.pop_back();
+        m_slot_count -= m_vars.end_scope();
     }
     
-    std::string create_label() {
-        std::string ret = "label" + std::to_string(m_label_count++);
-        return ret;
+    [[nodiscard]] uint64_t literal_value(const NodeIndex index) const
+    {
+        return static_cast<uint64_t>(m_prog.literals[m_prog.exprs[index].lhs]);
+    }
+
+    // The literal operand that is folded into the instructions for `expr`
+    // rather than evaluated into a register: an add or subtract immediate, or
+    // a strength-reduced multiply or divide. Only the rhs of a subtract or
+    // divide, since those don't commute.
+    [[nodiscard]] std::optional<NodeIndex> literal_operand(const NodeExpr& expr) const
+    {
+        const auto foldable = [&](const NodeIndex operand, const bool is_rhs) {
+            if (m_prog.exprs[operand].kind != ExprKind::int_lit) {
+                return false;
+            }
+            switch (expr.kind) {
+            case ExprKind::add:
+                return Backend::fits_add_imm(literal_value(operand));
+            case ExprKind::sub:
+                return is_rhs && Backend::fits_add_imm(-literal_value(operand));
+            case ExprKind::multi:
+                return true;
+            case ExprKind::div:
+                return is_rhs;
+            default:
+                return false;
+            }
+        };
+        if (foldable(expr.rhs, true)) {
+            return expr.rhs;
+        }
+        if (foldable(expr.lhs, false)) {
+            return expr.lhs;
+        }
+        return {};
+    }
+
+    static BinaryOp binary_op(const ExprKind kind)
+    {
+        switch (kind) {
+        case ExprKind::add:
+            return BinaryOp::add;
+        case ExprKind::sub:
+            return BinaryOp::sub;
+        case ExprKind::multi:
+            return BinaryOp::mul;
+        case ExprKind::div:
+            return BinaryOp::udiv;
+        default:
+            assert(false); // Unreachable
+            return BinaryOp::add;
+        }
+    }
+
+    uint64_t create_label() {
+        return m_label_count++;
     }
 
     struct Var {
-        std::string name;
-        size_t stack_loc;
+        size_t slot;
+    };
+
+    struct PendingExpr {
+        enum Action : uint8_t {
+            // Evaluate `index` into reg(base)
+            eval,
+            // Save reg(base) on the stack while the second operand of `index` runs
+            spill,
+            // Restore the spilled value into reg(base + 1)
+            reload,
+            // Apply the operator of `index` to reg(base) and reg(base + 1)
+            combine,
+            // Apply the operator of `index` to reg(base) and its literal
+            // operand, which is the lhs when rhs_first is set
+            apply_literal
+        };
+        Action action;
+        NodeIndex index;
+        uint32_t base;
+        bool rhs_first;
     };
 
     const NodeProg m_prog;
-    int m_label_count = 0 ;
-    std::stringstream m_output;
-    size_t m_stack_size = 0;
-    std::vector<Var> m_vars {};
-    std::vector<size_t> m_scopes {};
+    uint64_t m_label_count;
+    Code m_code {};
+    // Slots in use by variables in scope and spilled temporaries
+    size_t m_slot_count = 0;
+    // Most slots ever in use, which sizes the frame
+    size_t m_max_slots = 0;
+    ScopedSymbolTable<Var> m_vars;
+    // Sethi-Ullman number of each expression node
+    std::vector<uint32_t> m_need;
+    std::vector<PendingExpr> m_pending_exprs {};
 };
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include "arm64.hpp"
+
+// Which constants fit the immediate fields of ARM64 instructions, and the
+// shortest sequences that materialise the ones that do not
+namespace arm64 {
+
+// add/sub take a 12-bit immediate, optionally shifted left by 12
+inline bool is_arith_imm(const uint64_t value)
+{
+    return value <= 0xfff || ((value & 0xfff) == 0 && value >> 12 <= 0xfff);
+}
+
+// A run of ones, then zeros up to the top bit
+inline bool is_mask(const uint64_t value)
+{
+    return value != 0 && ((value + 1) & value) == 0;
+}
+
+// A single run of ones anywhere
+inline bool is_shifted_mask(const uint64_t value)
+{
+    return value != 0 && is_mask((value - 1) | value);
+}
+
+// The N:immr:imms field of a logical (and/orr/eor) immediate. Those are a
+// 2-, 4-, ..., or 64-bit element, repeated across the register, whose bits
+// are a rotated run of ones; all zeros and all ones are not encodable.
+inline std::optional<uint16_t> encode_logical_imm(uint64_t value)
+{
+    if (value == 0 || value == UINT64_MAX) {
+        return {};
+    }
+    // The smallest element that repeats to form the value
+    unsigned size = 64;
+    while (size > 2) {
+        const unsigned half = size / 2;
+        const uint64_t mask = (uint64_t { 1 } << half) - 1;
+        if ((value & mask) != ((value >> half) & mask)) {
+            break;
+        }
+        size = half;
+    }
+    const uint64_t mask = UINT64_MAX >> (64 - size);
+    value &= mask;
+    // Find the rotation that brings the run of ones down to bit 0
+    unsigned rotation;
+    unsigned ones;
+    if (is_shifted_mask(value)) {
+        rotation = static_cast<unsigned>(__builtin_ctzll(value));
+        ones = static_cast<unsigned>(__builtin_ctzll(~(value >> rotation)));
+    }
+    else {
+        // The ones wrap around the top of the element
+        value |= ~mask;
+        if (!is_shifted_mask(~value)) {
+            return {};
+        }
+        const unsigned leading_ones = static_cast<unsigned>(__builtin_clzll(~value));
+        rotation = 64 - leading_ones;
+        ones = leading_ones + static_cast<unsigned>(__builtin_ctzll(~value)) - (64 - size);
+    }
+    const unsigned immr = (size - rotation) & (size - 1);
+    // imms holds the element size in its leading ones, and the run length - 1
+    const uint64_t n_imms = ((~uint64_t { size - 1 } << 1) | (ones - 1)) & 0x7f;
+    const unsigned n = ((n_imms >> 6) & 1) ^ 1;
+    return static_cast<uint16_t>((n << 12) | (immr << 6) | (n_imms & 0x3f));
+}
+
+// Sets `reg` to any 64-bit value in as few instructions as possible: one
+// orr from xzr when the value is a logical immediate, otherwise movz then
+// movk for each 16-bit chunk that is not zero, or movn then movk for each
+// chunk that is not all ones, or an orr whose pattern is fixed up with one
+// movk, whichever is shortest.
+inline void emit_mov_imm(std::vector<Inst>& code, const Reg reg, const uint64_t value)
+{
+    if (value <= 0xffff) {
+        code.push_back({ Opcode::mov_imm, reg, no_reg, no_reg, 0, value });
+        return;
+    }
+    std::array<uint64_t, 4> chunks {};
+    size_t zero_chunks = 0;
+    size_t ones_chunks = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        chunks[i] = (value >> (i * 16)) & 0xffff;
+        zero_chunks += chunks[i] == 0 ? 1 : 0;
+        ones_chunks += chunks[i] == 0xffff ? 1 : 0;
+    }
+    const size_t movz_length = chunks.size() - zero_chunks;
+    const size_t movn_length = std::max<size_t>(chunks.size() - ones_chunks, 1);
+    if (std::min(movz_length, movn_length) > 1 && encode_logical_imm(value).has_value()) {
+        code.push_back({ Opcode::orr_imm, reg, xzr, no_reg, 0, value });
+        return;
+    }
+    if (std::min(movz_length, movn_length) > 2) {
+        // Replacing one chunk by another may give a repeating pattern
+        for (size_t i = 0; i < chunks.size(); i++) {
+            for (size_t j = 0; j < chunks.size(); j++) {
+                const uint64_t pattern = (value & ~(uint64_t { 0xffff } << (i * 16))) | (chunks[j] << (i * 16));
+                if (i != j && encode_logical_imm(pattern).has_value()) {
+                    code.push_back({ Opcode::orr_imm, reg, xzr, no_reg, 0, pattern });
+                    code.push_back({ Opcode::movk, reg, no_reg, no_reg, static_cast<uint8_t>(i * 16), chunks[i] });
+                    return;
+                }
+            }
+        }
+    }
+    const bool inverted = movn_length < movz_length;
+    const uint64_t skipped = inverted ? 0xffff : 0;
+    bool first = true;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        const auto shift = static_cast<uint8_t>(i * 16);
+        if (chunks[i] == skipped) {
+            continue;
+        }
+        if (first) {
+            code.push_back({ inverted ? Opcode::movn : Opcode::movz, reg, no_reg, no_reg, shift,
+                inverted ? ~chunks[i] & 0xffff : chunks[i] });
+            first = false;
+        }
+        else {
+            code.push_back({ Opcode::movk, reg, no_reg, no_reg, shift, chunks[i] });
+        }
+    }
+    if (first) {
+        // Every chunk is all ones
+        code.push_back({ Opcode::movn, reg, no_reg, no_reg, 0, 0 });
+    }
+}
+
+// Whether rd = rn + value takes one add or sub immediate
+inline bool fits_add_imm(const uint64_t value)
+{
+    return is_arith_imm(value) || is_arith_imm(-value);
+}
+
+// rd = rn + value, where fits_add_imm(value)
+inline void emit_add_imm(std::vector<Inst>& code, const Reg rd, const Reg rn, const uint64_t value)
+{
+    assert(fits_add_imm(value));
+    if (is_arith_imm(value)) {
+        code.push_back({ Opcode::add_imm, rd, rn, no_reg, 0, value });
+    }
+    else {
+        code.push_back({ Opcode::sub_imm, rd, rn, no_reg, 0, -value });
+    }
+}
+
+} // namespace arm64
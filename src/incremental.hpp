@@ -0,0 +1,547 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "generation.hpp"
+#include "optimisation.hpp"
+#include "output_buffer.hpp"
+#include "parser.hpp"
+#include "passes.hpp"
+#include "peephole.hpp"
+#include "resolution.hpp"
+#include "symbols.hpp"
+#include "tokenisation.hpp"
+
+// Compiles new versions of one file, -O0 or -O1, redoing only what an edit
+// touched. Each top-level statement of the last good compile is kept as a
+// record: where it is in the source, its machine code, and a fingerprint of
+// the context that code was generated in.
+//
+// A new version is compared byte for byte with the last one. The statements
+// that overlap the edited bytes are re-lexed and re-parsed from the end of
+// the statement before them; the parse has to come out at the start of the
+// unchanged statement after them, or the whole file is compiled again.
+//
+// The rest is reused unless it mentions a top-level var the edit declared or
+// took away, in which case it is resolved again, and compiled again if a name
+// now means something else. This holds because a statement's code depends on
+// nothing else: jumps are relative, macOS labels are numbered apart per
+// statement, and each top-level var keeps one slot from compile to compile,
+// in a block below the slots the statements use for their own scopes and
+// temporaries. The block grows by doubling, which moves every statement's
+// slots and so compiles the whole file again.
+//
+// Each statement is resolved, folded and peephole-optimised on its own, so at
+// -O1 nothing is folded or deleted across top-level statements. The errors
+// are those a full compile reports, in the same order. A failed compile
+// leaves the last good version in place.
+class IncrementalCompiler final {
+public:
+    // The unit a backend encodes into: 32-bit words or bytes
+    template <typename Backend>
+    using MachineCode = decltype(Backend::encode(std::declval<const typename Backend::Code&>()));
+
+    // What the last compile did
+    struct Stats {
+        // Statements re-lexed, re-parsed and compiled again
+        size_t parsed = 0;
+        // Statements whose code was reused
+        size_t reused = 0;
+    };
+
+    // Compiles `source` into `assembly` for a system_toolchain backend, or
+    // else into `machine_code`. `config` is everything besides the source
+    // that decides the output; the kept statements are dropped when it
+    // changes.
+    template <typename Backend>
+    void compile(const std::string_view source, const std::string& config, const OptLevel level,
+        const size_t peephole_window, OutputBuffer& assembly, MachineCode<Backend>& machine_code)
+    {
+        if (config != m_config) {
+            m_config = config;
+            m_source.clear();
+            m_stmts.clear();
+            m_bindings.clear();
+            m_free_slots.clear();
+            m_next_slot = 0;
+            m_var_slots = 0;
+        }
+        m_level = level;
+        m_peephole_window = peephole_window;
+        m_stats = {};
+
+        const std::string_view old_source = m_source;
+        const size_t prefix = common_prefix(old_source, source);
+        const size_t suffix = common_suffix(old_source.substr(prefix), source.substr(prefix));
+        const int64_t delta = static_cast<int64_t>(source.size()) - static_cast<int64_t>(old_source.size());
+        const size_t n = m_stmts.size();
+
+        // The statements [first, last) overlap the edit, and the one before
+        // `first` ends before it
+        size_t first = static_cast<size_t>(std::partition_point(m_stmts.begin(), m_stmts.end(),
+                           [&](const Stmt& stmt) { return stmt.end <= prefix; })
+            - m_stmts.begin());
+        size_t last = static_cast<size_t>(std::partition_point(m_stmts.begin(), m_stmts.end(),
+                          [&](const Stmt& stmt) { return stmt.begin < old_source.size() - suffix; })
+            - m_stmts.begin());
+        last = std::max(first, last);
+        // An else or elif there belongs to the if before it, so that if is
+        // parsed again with the new arm
+        if (first > 0 && continues_stmt(source, first)) {
+            first--;
+        }
+
+        std::vector<Stmt> parsed;
+        if (!parse_region(source, delta, first, last, parsed) || !allocate_slots(first, last, parsed)) {
+            first = 0;
+            last = n;
+            parsed.clear();
+            m_stats.parsed = 0;
+            parse_region(source, delta, first, last, parsed);
+            allocate_slots(first, last, parsed);
+        }
+        const size_t region_end = last < n ? m_stmts[last].begin : old_source.size();
+        const size_t new_region_end = static_cast<size_t>(static_cast<int64_t>(region_end) + delta);
+        const size_t region_begin = first > 0 ? m_stmts[first - 1].end : 0;
+        const int64_t line_delta = newlines(source.substr(region_begin, new_region_end - region_begin))
+            - newlines(old_source.substr(region_begin, region_end - region_begin));
+
+        // The new statements get keys between their neighbours'
+        uint64_t low = first > 0 ? m_stmts[first - 1].key : 0;
+        uint64_t high = last < n ? m_stmts[last].key : std::numeric_limits<uint64_t>::max();
+        if ((high - low) / (parsed.size() + 1) == 0) {
+            renumber();
+            low = first > 0 ? m_stmts[first - 1].key : 0;
+            high = last < n ? m_stmts[last].key : std::numeric_limits<uint64_t>::max();
+        }
+        const uint64_t step = (high - low) / (parsed.size() + 1);
+
+        // Parsed again to be compiled one at a time, which keeps only one
+        // statement's tree in memory
+        m_declared.clear();
+        Tokeniser region_tokens = region_tokeniser(source, first);
+        Parser region_parser(region_tokens);
+        for (size_t i = 0; i < parsed.size(); i++) {
+            Stmt& stmt = parsed[i];
+            stmt.key = low + step * (i + 1);
+            compile_stmt<Backend>(stmt, region_parser.parse_stmt_prog(), m_new_slots[i]);
+            if (stmt.declares != no_name) {
+                m_declared[stmt.declares] = m_new_slots[i];
+            }
+        }
+
+        // The names the rest of the file sees differently: declared by the
+        // statements the edit replaced and not by the new ones, or the other
+        // way round. Only statements mentioning one are looked at again.
+        m_changed.clear();
+        for (const uint32_t name : m_removed) {
+            if (m_declared.count(name) == 0) {
+                m_changed.insert(name);
+            }
+        }
+        for (const auto& [name, slot] : m_declared) {
+            if (m_removed.count(name) == 0) {
+                m_changed.insert(name);
+            }
+        }
+        std::vector<std::pair<size_t, Stmt>> redone;
+        for (size_t i = last; i < n && !m_changed.empty(); i++) {
+            const Stmt& old_stmt = m_stmts[i];
+            const std::vector<uint32_t>& uses = old_stmt.chunk->uses;
+            if (std::none_of(uses.begin(), uses.end(), [&](const uint32_t name) { return m_changed.count(name); })
+                || context(uses, old_stmt.key, var_slot(old_stmt)) == old_stmt.context) {
+                continue;
+            }
+            Stmt stmt = old_stmt;
+            stmt.shift(delta, line_delta);
+            Tokeniser tokeniser(source, stmt.begin, stmt.line);
+            Parser parser(tokeniser);
+            m_stats.parsed++;
+            compile_stmt<Backend>(stmt, parser.parse_stmt_prog(), var_slot(old_stmt));
+            redone.emplace_back(i, std::move(stmt));
+        }
+        m_stats.reused = first + (n - last) - redone.size();
+
+        // Nothing has failed, so the new version replaces the last one
+        m_free_slots.resize(m_free_slots.size() - m_free_taken);
+        m_next_slot = m_next_slot_after;
+        m_var_slots = m_var_slots_after;
+        for (const uint32_t name : m_removed) {
+            if (m_declared.count(name) == 0) {
+                m_free_slots.push_back(m_bindings[name].slot);
+                m_bindings.erase(name);
+            }
+        }
+        for (const Stmt& stmt : parsed) {
+            if (stmt.declares != no_name) {
+                m_bindings[stmt.declares] = { m_declared[stmt.declares], stmt.key };
+            }
+        }
+        for (size_t i = last; i < n; i++) {
+            m_stmts[i].shift(delta, line_delta);
+        }
+        for (auto& [i, stmt] : redone) {
+            m_stmts[i] = std::move(stmt);
+        }
+        const auto at = m_stmts.begin() + static_cast<std::ptrdiff_t>(first);
+        const size_t common = std::min(parsed.size(), last - first);
+        std::move(parsed.begin(), parsed.begin() + static_cast<std::ptrdiff_t>(common), at);
+        if (common < parsed.size()) {
+            m_stmts.insert(at + static_cast<std::ptrdiff_t>(common),
+                std::make_move_iterator(parsed.begin() + static_cast<std::ptrdiff_t>(common)),
+                std::make_move_iterator(parsed.end()));
+        }
+        else {
+            m_stmts.erase(at + static_cast<std::ptrdiff_t>(common), at + static_cast<std::ptrdiff_t>(last - first));
+        }
+        m_source.assign(source);
+
+        link<Backend>(assembly, machine_code);
+    }
+
+    [[nodiscard]] const Stats& stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    static constexpr uint32_t no_name = std::numeric_limits<uint32_t>::max();
+    static constexpr size_t block = 64;
+    static constexpr uint64_t key_gap = uint64_t { 1 } << 32;
+
+    // One statement's code: encoded machine code, or assembly text for a
+    // system_toolchain backend, and the names it mentions
+    struct Chunk {
+        std::vector<uint32_t> uses;
+        std::string code;
+        size_t max_slots = 0;
+    };
+
+    struct Stmt {
+        // Bytes [begin, end) of the source, from the first token to the end of
+        // the last, which is a ';' or '}', and the lines of those tokens
+        uint32_t begin = 0;
+        uint32_t end = 0;
+        uint32_t line = 1;
+        uint32_t end_line = 1;
+        // Increases through the file, and stays put when statements are
+        // added or taken away around it
+        uint64_t key = 0;
+        // The name a top-level var declares, or no_name
+        uint32_t declares = no_name;
+        // What its code was generated from besides its own text
+        uint64_t context = 0;
+        std::shared_ptr<const Chunk> chunk;
+
+        void shift(const int64_t delta, const int64_t line_delta)
+        {
+            begin = static_cast<uint32_t>(begin + delta);
+            end = static_cast<uint32_t>(end + delta);
+            line = static_cast<uint32_t>(line + line_delta);
+            end_line = static_cast<uint32_t>(end_line + line_delta);
+        }
+    };
+
+    // A top-level var of the last version: its slot, and the key of the
+    // statement that declares it
+    struct Binding {
+        uint32_t slot;
+        uint64_t key;
+    };
+
+    static uint64_t mix(const uint64_t hash, const uint64_t value)
+    {
+        uint64_t x = (hash ^ value) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 31)) * 0x94d049bb133111eb;
+        return x ^ (x >> 29);
+    }
+
+    static size_t common_prefix(const std::string_view a, const std::string_view b)
+    {
+        const size_t limit = std::min(a.size(), b.size());
+        size_t i = 0;
+        while (i + block <= limit && std::memcmp(a.data() + i, b.data() + i, block) == 0) {
+            i += block;
+        }
+        while (i < limit && a[i] == b[i]) {
+            i++;
+        }
+        return i;
+    }
+
+    static size_t common_suffix(const std::string_view a, const std::string_view b)
+    {
+        const size_t limit = std::min(a.size(), b.size());
+        size_t i = 0;
+        while (i + block <= limit
+            && std::memcmp(a.data() + a.size() - i - block, b.data() + b.size() - i - block, block) == 0) {
+            i += block;
+        }
+        while (i < limit && a[a.size() - i - 1] == b[b.size() - i - 1]) {
+            i++;
+        }
+        return i;
+    }
+
+    static int64_t newlines(const std::string_view text)
+    {
+        return static_cast<int64_t>(std::count(text.begin(), text.end(), '\n'));
+    }
+
+    // Lexes the new text from the end of statement `first` - 1
+    Tokeniser region_tokeniser(const std::string_view source, const size_t first) const
+    {
+        return first > 0 ? Tokeniser(source, m_stmts[first - 1].end, m_stmts[first - 1].end_line) : Tokeniser(source);
+    }
+
+    // Whether the new text after statement `first` - 1 starts with else or
+    // elif, which only an if can be followed by
+    bool continues_stmt(const std::string_view source, const size_t first) const
+    {
+        Tokeniser tokeniser = region_tokeniser(source, first);
+        const std::optional<Token> token = tokeniser.next();
+        return token.has_value() && (token->type == TokenType::else_ || token->type == TokenType::elif);
+    }
+
+    // Parses the new text between statements `first` and `last` into
+    // `parsed`: where each statement is, and the var it declares. Returns
+    // false if the statements do not end exactly where statement `last` now
+    // starts. Errors are thrown as a full parse would.
+    bool parse_region(const std::string_view source, const int64_t delta, const size_t first, const size_t last,
+        std::vector<Stmt>& parsed)
+    {
+        const bool at_end = last == m_stmts.size();
+        const size_t end = at_end ? source.size() : static_cast<size_t>(m_stmts[last].begin + delta);
+        Tokeniser tokeniser = region_tokeniser(source, first);
+        Parser parser(tokeniser);
+        std::optional<uint32_t> next = parser.next_offset();
+        while (next.has_value() && next.value() < end) {
+            Stmt& stmt = parsed.emplace_back();
+            stmt.begin = next.value();
+            stmt.line = parser.next_line();
+            const NodeProg prog = parser.parse_stmt_prog();
+            stmt.end = parser.last_offset() + 1;
+            stmt.end_line = parser.last_line();
+            const NodeStmt& top = prog.stmts[prog.scope_stmts[prog.body.first]];
+            if (top.kind == StmtKind::var) {
+                stmt.declares = name_id(prog.symbols.name(prog.vars[top.index].sym));
+            }
+            m_stats.parsed++;
+            next = parser.next_offset();
+        }
+        return at_end ? !next.has_value() : next == end;
+    }
+
+    // Picks the slots of the vars `parsed` declares in place of statements
+    // [first, last). A var the edit kept has its old slot, and a new one takes
+    // a free slot. Returns false if the block of var slots has to grow, which
+    // takes compiling every statement again.
+    bool allocate_slots(const size_t first, const size_t last, const std::vector<Stmt>& parsed)
+    {
+        m_removed.clear();
+        for (size_t i = first; i < last; i++) {
+            if (m_stmts[i].declares != no_name) {
+                m_removed.insert(m_stmts[i].declares);
+            }
+        }
+        m_new_slots.clear();
+        m_free_taken = 0;
+        m_next_slot_after = m_next_slot;
+        for (const Stmt& stmt : parsed) {
+            const uint32_t name = stmt.declares;
+            if (name == no_name) {
+                m_new_slots.push_back(0);
+            }
+            else if (m_removed.count(name) != 0) {
+                m_new_slots.push_back(m_bindings[name].slot);
+            }
+            else if (m_free_taken < m_free_slots.size()) {
+                m_new_slots.push_back(m_free_slots[m_free_slots.size() - ++m_free_taken]);
+            }
+            else {
+                m_new_slots.push_back(m_next_slot_after++);
+            }
+        }
+        if (m_next_slot_after <= m_var_slots) {
+            m_var_slots_after = m_var_slots;
+            return true;
+        }
+        m_var_slots_after = std::max<uint32_t>(16, 2 * m_next_slot_after);
+        return first == 0 && last == m_stmts.size();
+    }
+
+    // Spreads the keys out again once there is no room between two
+    void renumber()
+    {
+        for (size_t i = 0; i < m_stmts.size(); i++) {
+            m_stmts[i].key = (i + 1) * key_gap;
+            if (m_stmts[i].declares != no_name) {
+                m_bindings[m_stmts[i].declares].key = m_stmts[i].key;
+            }
+        }
+    }
+
+    // The statements' names get persistent ids, which outlive the source
+    uint32_t name_id(const std::string_view name)
+    {
+        return m_names.try_emplace(std::string(name), static_cast<uint32_t>(m_names.size())).first->second;
+    }
+
+    // The slot of the top-level var `name` if it is declared before the
+    // statement at `key`
+    [[nodiscard]] std::optional<uint32_t> lookup(const uint32_t name, const uint64_t key) const
+    {
+        if (const auto it = m_declared.find(name); it != m_declared.end()) {
+            return it->second;
+        }
+        if (const auto it = m_bindings.find(name);
+            it != m_bindings.end() && it->second.key < key && m_removed.count(name) == 0) {
+            return it->second.slot;
+        }
+        return {};
+    }
+
+    [[nodiscard]] uint32_t var_slot(const Stmt& stmt) const
+    {
+        return stmt.declares != no_name ? m_bindings.at(stmt.declares).slot : 0;
+    }
+
+    [[nodiscard]] uint64_t context(const std::vector<uint32_t>& uses, const uint64_t key, const uint32_t var_slot) const
+    {
+        uint64_t hash = mix(mix(0, m_var_slots_after), var_slot);
+        for (const uint32_t name : uses) {
+            const std::optional<uint32_t> slot = lookup(name, key);
+            hash = mix(hash, slot.has_value() ? slot.value() + 1 : 0);
+        }
+        return hash;
+    }
+
+    // Compiles `prog`, one top-level statement, as `stmt`, which has its key.
+    // A top-level var goes in `var_slot`.
+    template <typename Backend>
+    void compile_stmt(Stmt& stmt, NodeProg prog, const uint32_t var_slot)
+    {
+        auto chunk = std::make_shared<Chunk>();
+        std::vector<std::pair<SymbolId, size_t>> outer;
+        chunk->uses.reserve(prog.symbols.size());
+        for (SymbolId sym = 0; sym < prog.symbols.size(); sym++) {
+            chunk->uses.push_back(name_id(prog.symbols.name(sym)));
+            if (const std::optional<uint32_t> slot = lookup(chunk->uses.back(), stmt.key)) {
+                outer.emplace_back(sym, slot.value());
+            }
+        }
+        const NodeStmt& top = prog.stmts[prog.scope_stmts[prog.body.first]];
+        stmt.declares = top.kind == StmtKind::var ? chunk->uses[prog.vars[top.index].sym] : no_name;
+        stmt.context = context(chunk->uses, stmt.key, var_slot);
+
+        NameResolver resolver(prog);
+        for (const auto& [sym, slot] : outer) {
+            resolver.declare_outer(sym);
+        }
+        resolver.resolve_prog();
+        if (m_level == OptLevel::o1) {
+            ConstantFolder(prog).fold_prog();
+            DeadCodeEliminator(prog).eliminate_prog();
+        }
+        // Only macOS labels are seen outside a statement, by the assembler
+        const uint64_t first_label = Backend::system_toolchain ? m_next_label_base++ << 32 : 0;
+        Generator<Backend> generator(std::move(prog), first_label);
+        typename Backend::Code code = generator.gen_body(outer, m_var_slots_after, var_slot);
+        chunk->max_slots = generator.max_slots();
+        if (m_level == OptLevel::o1) {
+            PeepholeOptimiser<typename Backend::Isa>(m_peephole_window).optimise(code);
+        }
+        if constexpr (Backend::system_toolchain) {
+            m_text.clear();
+            Backend::print_insts(m_text, code);
+            chunk->code.assign(m_text.view());
+        }
+        else {
+            const MachineCode<Backend> words = Backend::encode(code);
+            chunk->code.assign(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(words[0]));
+        }
+        stmt.chunk = std::move(chunk);
+    }
+
+    // Puts the statements' code together between a prologue that reserves
+    // the largest frame any of them needs and the exit at the end
+    template <typename Backend>
+    void link(OutputBuffer& assembly, MachineCode<Backend>& machine_code)
+    {
+        size_t max_slots = 0;
+        size_t size = 0;
+        for (const Stmt& stmt : m_stmts) {
+            max_slots = std::max(max_slots, stmt.chunk->max_slots);
+            size += stmt.chunk->code.size();
+        }
+        typename Backend::Code prologue = Generator<Backend>::gen_prologue(max_slots);
+        typename Backend::Code epilogue = Generator<Backend>::gen_epilogue();
+        if (m_level == OptLevel::o1) {
+            PeepholeOptimiser<typename Backend::Isa> peephole(m_peephole_window);
+            peephole.optimise(prologue);
+            peephole.optimise(epilogue);
+        }
+        if constexpr (Backend::system_toolchain) {
+            assembly.clear();
+            assembly.reserve(size + 256);
+            Backend::print(assembly, prologue);
+            for (const Stmt& stmt : m_stmts) {
+                assembly.append(stmt.chunk->code);
+            }
+            Backend::print_insts(assembly, epilogue);
+        }
+        else {
+            using Word = typename MachineCode<Backend>::value_type;
+            const MachineCode<Backend> head = Backend::encode(prologue);
+            const MachineCode<Backend> tail = Backend::encode(epilogue);
+            machine_code.assign(head.begin(), head.end());
+            size_t at = machine_code.size();
+            machine_code.resize(at + size / sizeof(Word));
+            for (const Stmt& stmt : m_stmts) {
+                std::memcpy(machine_code.data() + at, stmt.chunk->code.data(), stmt.chunk->code.size());
+                at += stmt.chunk->code.size() / sizeof(Word);
+            }
+            machine_code.insert(machine_code.end(), tail.begin(), tail.end());
+        }
+    }
+
+    std::string m_config;
+    OptLevel m_level = OptLevel::o1;
+    size_t m_peephole_window = PeepholeRules::default_window;
+    // The last version compiled without errors, and its statements in order
+    std::string m_source;
+    std::vector<Stmt> m_stmts;
+    // Name spellings to persistent ids, and the top-level vars of the last
+    // version by id
+    std::unordered_map<std::string, uint32_t> m_names;
+    std::unordered_map<uint32_t, Binding> m_bindings;
+    // Slots [0, m_var_slots) are the block for top-level vars, of which those
+    // from m_next_slot on, and m_free_slots, are unused
+    uint32_t m_var_slots = 0;
+    uint32_t m_next_slot = 0;
+    std::vector<uint32_t> m_free_slots;
+    // While compiling: the vars of the statements the edit replaces, and of
+    // those replacing them; the slots picked for the latter, and the block
+    // and free slots once they have them; the names whose meaning changed
+    std::unordered_set<uint32_t> m_removed;
+    std::unordered_map<uint32_t, uint32_t> m_declared;
+    std::vector<uint32_t> m_new_slots;
+    uint32_t m_var_slots_after = 0;
+    uint32_t m_next_slot_after = 0;
+    size_t m_free_taken = 0;
+    std::unordered_set<uint32_t> m_changed;
+    uint64_t m_next_label_base = 0;
+    OutputBuffer m_text;
+    Stats m_stats;
+};
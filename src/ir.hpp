@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+// Typed SSA intermediate representation. A Function is a list of basic blocks;
+// each block holds phis first, then ordinary instructions, then exactly one
+// terminator. Every instruction is a Value, identified by its index in
+// Function::insts. Constants are Values too but belong to no block, so they
+// dominate every use and the backend can materialise them where needed.
+namespace ir {
+
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+
+// Marks an absent value or block
+constexpr uint32_t none = UINT32_MAX;
+
+enum class Type : uint8_t {
+    // Terminators produce nothing
+    none,
+    i64
+};
+
+enum class Op : uint8_t {
+    constant,
+    add,
+    sub,
+    mul,
+    udiv,
+    phi,
+    // Terminators
+    jmp,
+    br,
+    exit
+};
+
+inline const char* to_string(const Op op)
+{
+    switch (op) {
+    case Op::constant:
+        return "const";
+    case Op::add:
+        return "add";
+    case Op::sub:
+        return "sub";
+    case Op::mul:
+        return "mul";
+    case Op::udiv:
+        return "udiv";
+    case Op::phi:
+        return "phi";
+    case Op::jmp:
+        return "jmp";
+    case Op::br:
+        return "br";
+    case Op::exit:
+        return "exit";
+    }
+    return "";
+}
+
+inline bool is_binary(const Op op)
+{
+    return op == Op::add || op == Op::sub || op == Op::mul || op == Op::udiv;
+}
+
+inline bool is_terminator(const Op op)
+{
+    return op == Op::jmp || op == Op::br || op == Op::exit;
+}
+
+struct Inst {
+    Op op;
+    Type type;
+    // Block the instruction lives in, or none for constants
+    BlockId block;
+    // Operands, by op:
+    //   add/sub/mul/udiv  a, b: lhs and rhs values
+    //   phi               a, b: first and count of the incoming PhiArgs
+    //   jmp               a: target block
+    //   br                a: condition (taken if non-zero), b: then, c: else
+    //   exit              a: status value
+    uint32_t a = none;
+    uint32_t b = none;
+    uint32_t c = none;
+    // Value of a constant
+    uint64_t imm = 0;
+};
+
+struct PhiArg {
+    BlockId pred;
+    ValueId value;
+};
+
+struct Block {
+    std::vector<ValueId> insts {};
+    std::vector<BlockId> preds {};
+    // Unreachable blocks are unlinked but keep their id
+    bool dead = false;
+};
+
+struct Function {
+    std::vector<Inst> insts {};
+    std::vector<PhiArg> phi_args {};
+    std::vector<Block> blocks {};
+    // Blocks in emission order; block 0 is the entry and comes first. There
+    // are no loops, so every edge goes forward in this order.
+    std::vector<BlockId> layout {};
+    // Interned constants by value
+    std::unordered_map<uint64_t, ValueId> constants {};
+
+    ValueId constant(const uint64_t imm)
+    {
+        const auto [it, inserted] = constants.try_emplace(imm, static_cast<ValueId>(insts.size()));
+        if (inserted) {
+            insts.push_back({ Op::constant, Type::i64, none, none, none, none, imm });
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] const Inst& terminator(const BlockId block) const
+    {
+        return insts[blocks[block].insts.back()];
+    }
+
+    // Successors of a block, read from its terminator
+    template <typename Visit>
+    void for_each_succ(const BlockId block, Visit visit) const
+    {
+        const Inst& term = terminator(block);
+        if (term.op == Op::jmp) {
+            visit(term.a);
+        }
+        else if (term.op == Op::br) {
+            visit(term.b);
+            visit(term.c);
+        }
+    }
+};
+
+inline void dump_value(std::ostream& out, const Function& fn, const ValueId value)
+{
+    const Inst& inst = fn.insts[value];
+    if (inst.op == Op::constant) {
+        out << inst.imm;
+    }
+    else {
+        out << "v" << value;
+    }
+}
+
+// Textual form, one instruction per line, for tests and --emit-ir
+inline void dump(std::ostream& out, const Function& fn)
+{
+    out << "fn main {\n";
+    for (const BlockId block : fn.layout) {
+        const Block& b = fn.blocks[block];
+        out << "b" << block << ":";
+        if (!b.preds.empty()) {
+            out << "  ; preds";
+            for (const BlockId pred : b.preds) {
+                out << " b" << pred;
+            }
+        }
+        out << "\n";
+        for (const ValueId value : b.insts) {
+            const Inst& inst = fn.insts[value];
+            out << "    ";
+            if (inst.type != Type::none) {
+                out << "v" << value << " = ";
+            }
+            out << to_string(inst.op);
+            if (inst.type == Type::i64) {
+                out << " i64";
+            }
+            if (is_binary(inst.op)) {
+                out << " ";
+                dump_value(out, fn, inst.a);
+                out << ", ";
+                dump_value(out, fn, inst.b);
+            }
+            else if (inst.op == Op::phi) {
+                for (uint32_t i = 0; i < inst.b; i++) {
+                    const PhiArg& arg = fn.phi_args[inst.a + i];
+                    out << (i == 0 ? " [b" : ", [b") << arg.pred << ": ";
+                    dump_value(out, fn, arg.value);
+                    out << "]";
+                }
+            }
+            else if (inst.op == Op::jmp) {
+                out << " b" << inst.a;
+            }
+            else if (inst.op == Op::br) {
+                out << " ";
+                dump_value(out, fn, inst.a);
+                out << ", b" << inst.b << ", b" << inst.c;
+            }
+            else if (inst.op == Op::exit) {
+                out << " ";
+                dump_value(out, fn, inst.a);
+            }
+            out << "\n";
+        }
+    }
+    out << "}\n";
+}
+
+} // namespace ir
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "ir.hpp"
+#include "target.hpp"
+
+// Emits machine code for `Backend` (see target.hpp) from an SSA function.
+// Registers are assigned by linear scan: the CFG has no loops, so a value is
+// live at most from its definition to its last use in layout order, and that
+// range is its interval. When more intervals overlap than there are
+// registers, the one that ends last lives in its own 8-byte stack slot
+// instead. The frame is reserved once on entry.
+template <typename Backend>
+class IrGenerator {
+public:
+    using Reg = typename Backend::Isa::Reg;
+    using Code = typename Backend::Code;
+
+    // All but the last of the backend's registers hold values, and the last
+    // breaks cycles in phi moves. The scratch registers load spilled operands
+    // and constants.
+    static constexpr uint32_t num_value_regs = Backend::num_regs - 1;
+
+    inline explicit IrGenerator(const ir::Function& fn)
+        : m_fn(fn)
+        , m_location(fn.insts.size())
+    {
+    }
+
+    [[nodiscard]] Code gen_prog()
+    {
+        allocate_registers();
+        Backend::reserve_frame(m_code, (m_slot_count * 8 + 15) / 16 * 16);
+        for (size_t i = 0; i < m_fn.layout.size(); i++) {
+            const ir::BlockId next = i + 1 < m_fn.layout.size() ? m_fn.layout[i + 1] : ir::none;
+            gen_block(m_fn.layout[i], next);
+        }
+        return std::move(m_code);
+    }
+
+private:
+    static constexpr uint32_t cycle_reg = num_value_regs;
+
+    // Where a value lives for its whole interval
+    struct Location {
+        enum Kind : uint8_t {
+            // Unassigned, or a constant materialised at each use
+            none,
+            reg,
+            slot
+        };
+        Kind kind = none;
+        uint32_t index = 0;
+    };
+
+    struct Interval {
+        ir::ValueId value;
+        uint32_t start;
+        uint32_t end;
+    };
+
+    void allocate_registers()
+    {
+        // Number the instructions in layout order. Phis take effect together
+        // on entry to their block, so they share its first position.
+        std::vector<uint32_t> position(m_fn.insts.size(), 0);
+        std::vector<uint32_t> block_end(m_fn.blocks.size(), 0);
+        std::vector<Interval> intervals;
+        uint32_t pos = 0;
+        for (const ir::BlockId block : m_fn.layout) {
+            bool phis = false;
+            for (const ir::ValueId value : m_fn.blocks[block].insts) {
+                const ir::Inst& inst = m_fn.insts[value];
+                if (inst.op == ir::Op::phi) {
+                    phis = true;
+                    position[value] = pos;
+                }
+                else {
+                    pos += phis ? 1 : 0;
+                    phis = false;
+                    position[value] = pos++;
+                }
+                if (inst.type != ir::Type::none) {
+                    intervals.push_back({ value, position[value], position[value] });
+                }
+            }
+            block_end[block] = pos - 1;
+        }
+
+        // Each interval ends at its last use; a phi input is used by the move
+        // at the end of its predecessor
+        std::vector<uint32_t> end(m_fn.insts.size(), 0);
+        const auto use = [&](const ir::ValueId value, const uint32_t at) { end[value] = std::max(end[value], at); };
+        for (const ir::BlockId block : m_fn.layout) {
+            for (const ir::ValueId value : m_fn.blocks[block].insts) {
+                const ir::Inst& inst = m_fn.insts[value];
+                if (ir::is_binary(inst.op)) {
+                    use(inst.a, position[value]);
+                    use(inst.b, position[value]);
+                }
+                else if (inst.op == ir::Op::phi) {
+                    for (uint32_t i = 0; i < inst.b; i++) {
+                        const ir::PhiArg& arg = m_fn.phi_args[inst.a + i];
+                        use(arg.value, block_end[arg.pred]);
+                    }
+                }
+                else if (inst.op == ir::Op::br || inst.op == ir::Op::exit) {
+                    use(inst.a, position[value]);
+                }
+            }
+        }
+        for (Interval& interval : intervals) {
+            interval.end = std::max(interval.start, end[interval.value]);
+        }
+
+        // Active intervals, kept sorted by end
+        std::vector<Interval> active;
+        std::array<bool, num_value_regs> free {};
+        free.fill(true);
+        for (const Interval& interval : intervals) {
+            // A value whose last use is this instruction hands its register
+            // over, since an instruction reads its operands before writing
+            while (!active.empty() && active.front().end <= interval.start) {
+                free[m_location[active.front().value].index] = true;
+                active.erase(active.begin());
+            }
+            const auto reg = std::find(free.begin(), free.end(), true);
+            if (reg != free.end()) {
+                *reg = false;
+                m_location[interval.value] = { Location::reg, static_cast<uint32_t>(reg - free.begin()) };
+            }
+            else if (active.back().end > interval.end) {
+                // Spill whichever value stays live the longest
+                m_location[interval.value] = m_location[active.back().value];
+                m_location[active.back().value] = { Location::slot, m_slot_count++ };
+                active.pop_back();
+            }
+            else {
+                m_location[interval.value] = { Location::slot, m_slot_count++ };
+                continue;
+            }
+            active.insert(std::upper_bound(active.begin(), active.end(), interval,
+                              [](const Interval& lhs, const Interval& rhs) { return lhs.end < rhs.end; }),
+                interval);
+        }
+    }
+
+    void gen_block(const ir::BlockId block, const ir::BlockId next)
+    {
+        if (block != m_fn.layout.front()) {
+            Backend::label(m_code, block);
+        }
+        for (const ir::ValueId value : m_fn.blocks[block].insts) {
+            const ir::Inst& inst = m_fn.insts[value];
+            switch (inst.op) {
+            case ir::Op::constant:
+            case ir::Op::phi:
+                // Phis are written by the moves at the end of each predecessor
+                break;
+            case ir::Op::add:
+            case ir::Op::sub:
+            case ir::Op::mul:
+            case ir::Op::udiv:
+                gen_binary(value, inst);
+                break;
+            case ir::Op::jmp:
+                gen_phi_moves(block, inst.a);
+                if (inst.a != next) {
+                    Backend::jump(m_code, inst.a);
+                }
+                break;
+            case ir::Op::br: {
+                const Reg cond = use(inst.a, 0);
+                if (inst.b == next) {
+                    Backend::branch_zero(m_code, cond, inst.c);
+                }
+                else {
+                    Backend::branch_nonzero(m_code, cond, inst.b);
+                    if (inst.c != next) {
+                        Backend::jump(m_code, inst.c);
+                    }
+                }
+                break;
+            }
+            case ir::Op::exit:
+                move_to_reg(reg(0), inst.a);
+                Backend::exit(m_code);
+                break;
+            }
+        }
+    }
+
+    void gen_binary(const ir::ValueId value, const ir::Inst& inst)
+    {
+        const Location& dest = m_location[value];
+        const Reg rd = dest.kind == Location::reg ? reg(dest.index) : scratch(0);
+        const ir::Inst& lhs = m_fn.insts[inst.a];
+        const ir::Inst& rhs = m_fn.insts[inst.b];
+        // Constants that fit go into add and sub immediates. Multiplies and
+        // divides by a constant become shifts, adds and multiply-highs, with
+        // any wide constant in scratch(1).
+        if (inst.op == ir::Op::mul && rhs.op == ir::Op::constant) {
+            Backend::mul_imm(m_code, rd, use(inst.a, 0), rhs.imm, scratch(1));
+        }
+        else if (inst.op == ir::Op::mul && lhs.op == ir::Op::constant) {
+            Backend::mul_imm(m_code, rd, use(inst.b, 0), lhs.imm, scratch(1));
+        }
+        else if (inst.op == ir::Op::udiv && rhs.op == ir::Op::constant) {
+            Backend::udiv_imm(m_code, rd, use(inst.a, 0), rhs.imm, scratch(1));
+        }
+        else if (inst.op == ir::Op::add && rhs.op == ir::Op::constant && Backend::fits_add_imm(rhs.imm)) {
+            Backend::add_imm(m_code, rd, use(inst.a, 0), rhs.imm);
+        }
+        else if (inst.op == ir::Op::add && lhs.op == ir::Op::constant && Backend::fits_add_imm(lhs.imm)) {
+            Backend::add_imm(m_code, rd, use(inst.b, 0), lhs.imm);
+        }
+        else if (inst.op == ir::Op::sub && rhs.op == ir::Op::constant && Backend::fits_add_imm(-rhs.imm)) {
+            Backend::add_imm(m_code, rd, use(inst.a, 0), -rhs.imm);
+        }
+        else {
+            const Reg lhs_reg = use(inst.a, 0);
+            const Reg rhs_reg = use(inst.b, 1);
+            Backend::binary(m_code, binary_op(inst.op), rd, lhs_reg, rhs_reg);
+        }
+        if (dest.kind == Location::slot) {
+            Backend::store_slot(m_code, rd, dest.index);
+        }
+    }
+
+    // Register holding `value` for an instruction operand, loading it into
+    // scratch register `n` if it is not already in one
+    Reg use(const ir::ValueId value, const uint32_t n)
+    {
+        const Location& location = m_location[value];
+        if (location.kind == Location::reg) {
+            return reg(location.index);
+        }
+        move_to_reg(scratch(n), value);
+        return scratch(n);
+    }
+
+    void move_to_reg(const Reg dest, const ir::ValueId value)
+    {
+        const Location& location = m_location[value];
+        if (location.kind == Location::reg) {
+            if (dest != reg(location.index)) {
+                Backend::mov(m_code, dest, reg(location.index));
+            }
+        }
+        else if (location.kind == Location::slot) {
+            Backend::load_slot(m_code, dest, location.index);
+        }
+        else {
+            Backend::mov_imm(m_code, dest, m_fn.insts[value].imm);
+        }
+    }
+
+    // Parallel copy of the phi inputs from `block` into the phis of `target`.
+    // Stores come first, since they clobber no register, then register to
+    // register moves in an order that reads each register before it is
+    // overwritten, then loads and constants, which read no register.
+    void gen_phi_moves(const ir::BlockId block, const ir::BlockId target)
+    {
+        // (destination register, source register)
+        std::vector<std::pair<uint32_t, uint32_t>> reg_moves;
+        // (destination register, source value)
+        std::vector<std::pair<uint32_t, ir::ValueId>> other_moves;
+        for (const ir::ValueId value : m_fn.blocks[target].insts) {
+            const ir::Inst& phi = m_fn.insts[value];
+            if (phi.op != ir::Op::phi) {
+                break;
+            }
+            ir::ValueId source = ir::none;
+            for (uint32_t i = 0; i < phi.b; i++) {
+                if (m_fn.phi_args[phi.a + i].pred == block) {
+                    source = m_fn.phi_args[phi.a + i].value;
+                }
+            }
+            assert(source != ir::none);
+            const Location& dest = m_location[value];
+            const Location& from = m_location[source];
+            if (dest.kind == Location::slot) {
+                Backend::store_slot(m_code, use(source, 0), dest.index);
+            }
+            else if (from.kind == Location::reg) {
+                if (from.index != dest.index) {
+                    reg_moves.emplace_back(dest.index, from.index);
+                }
+            }
+            else {
+                other_moves.emplace_back(dest.index, source);
+            }
+        }
+
+        while (!reg_moves.empty()) {
+            // A move is safe once no pending move still reads its destination
+            const auto ready = std::find_if(reg_moves.begin(), reg_moves.end(), [&](const auto& move) {
+                return std::none_of(reg_moves.begin(), reg_moves.end(),
+                    [&](const auto& other) { return other.second == move.first; });
+            });
+            if (ready != reg_moves.end()) {
+                Backend::mov(m_code, reg(ready->first), reg(ready->second));
+                reg_moves.erase(ready);
+                continue;
+            }
+            // Only cycles are left: park one source and read it from there
+            const uint32_t parked = reg_moves.front().second;
+            Backend::mov(m_code, reg(cycle_reg), reg(parked));
+            for (auto& move : reg_moves) {
+                if (move.second == parked) {
+                    move.second = cycle_reg;
+                }
+            }
+        }
+        for (const auto& [dest, source] : other_moves) {
+            move_to_reg(reg(dest), source);
+        }
+    }
+
+    static BinaryOp binary_op(const ir::Op op)
+    {
+        switch (op) {
+        case ir::Op::add:
+            return BinaryOp::add;
+        case ir::Op::sub:
+            return BinaryOp::sub;
+        case ir::Op::mul:
+            return BinaryOp::mul;
+        case ir::Op::udiv:
+            return BinaryOp::udiv;
+        default:
+            assert(false); // Unreachable
+            return BinaryOp::add;
+        }
+    }
+
+    static Reg reg(const uint32_t index)
+    {
+        return Backend::reg(index);
+    }
+
+    static Reg scratch(const uint32_t n)
+    {
+        return Backend::scratch(n);
+    }
+
+    const ir::Function& m_fn;
+    Code m_code {};
+    std::vector<Location> m_location;
+    uint32_t m_slot_count = 0;
+};
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "ir.hpp"
+
+namespace ir {
+
+// Replacements of one value by another, collected during a pass and then
+// applied to every operand in one sweep
+class ValueReplacements {
+public:
+    inline explicit ValueReplacements(const size_t value_count)
+        : m_to(value_count, none)
+    {
+    }
+
+    void add(const ValueId from, const ValueId to)
+    {
+        m_to[from] = to;
+    }
+
+    // Values created after the pass started are never replaced
+    [[nodiscard]] ValueId resolve(ValueId value) const
+    {
+        while (value < m_to.size() && m_to[value] != none) {
+            value = m_to[value];
+        }
+        return value;
+    }
+
+    void apply(Function& fn) const
+    {
+        for (const BlockId block : fn.layout) {
+            for (const ValueId value : fn.blocks[block].insts) {
+                Inst& inst = fn.insts[value];
+                if (is_binary(inst.op)) {
+                    inst.a = resolve(inst.a);
+                    inst.b = resolve(inst.b);
+                }
+                else if (inst.op == Op::phi) {
+                    for (uint32_t i = 0; i < inst.b; i++) {
+                        PhiArg& arg = fn.phi_args[inst.a + i];
+                        arg.value = resolve(arg.value);
+                    }
+                }
+                else if (inst.op == Op::br || inst.op == Op::exit) {
+                    inst.a = resolve(inst.a);
+                }
+            }
+        }
+    }
+
+private:
+    std::vector<ValueId> m_to;
+};
+
+// Evaluates the target's arithmetic: 64-bit wrapping, and unsigned division
+// where x / 0 is 0 (as udiv gives)
+inline uint64_t evaluate(const Op op, const uint64_t lhs, const uint64_t rhs)
+{
+    switch (op) {
+    case Op::add:
+        return lhs + rhs;
+    case Op::sub:
+        return lhs - rhs;
+    case Op::mul:
+        return lhs * rhs;
+    case Op::udiv:
+        return rhs == 0 ? 0 : lhs / rhs;
+    default:
+        assert(false); // Unreachable
+        return 0;
+    }
+}
+
+// Conditional constant propagation. Blocks are visited in layout order, which
+// is topological because the CFG has no loops, so every operand and every
+// predecessor has been settled by the time it is needed. Only edges out of
+// reachable blocks count: a phi whose live incoming values agree becomes that
+// value, and a branch on a constant becomes a jump. Unlinking the blocks this
+// leaves unreachable is left to CfgSimplifier.
+class IrConstantFolder {
+public:
+    inline explicit IrConstantFolder(Function& fn)
+        : m_fn(fn)
+        , m_replacements(fn.insts.size())
+        , m_reachable(fn.blocks.size(), false)
+    {
+    }
+
+    void fold()
+    {
+        m_reachable[m_fn.layout.front()] = true;
+        for (const BlockId block : m_fn.layout) {
+            if (m_reachable[block]) {
+                fold_block(block);
+                m_fn.for_each_succ(block, [&](const BlockId succ) { m_reachable[succ] = true; });
+            }
+        }
+        m_replacements.apply(m_fn);
+    }
+
+private:
+    void fold_block(const BlockId block)
+    {
+        std::vector<ValueId>& insts = m_fn.blocks[block].insts;
+        size_t kept = 0;
+        for (const ValueId value : insts) {
+            if (!fold_inst(block, value)) {
+                insts[kept++] = value;
+            }
+        }
+        insts.resize(kept);
+    }
+
+    // Returns whether the instruction was replaced and can be dropped
+    bool fold_inst(const BlockId block, const ValueId value)
+    {
+        // Copied, since interning a constant may grow `insts`
+        Inst inst = m_fn.insts[value];
+        if (is_binary(inst.op)) {
+            inst.a = m_replacements.resolve(inst.a);
+            inst.b = m_replacements.resolve(inst.b);
+            m_fn.insts[value] = inst;
+            const Inst& lhs = m_fn.insts[inst.a];
+            const Inst& rhs = m_fn.insts[inst.b];
+            if (lhs.op != Op::constant || rhs.op != Op::constant) {
+                return false;
+            }
+            m_replacements.add(value, m_fn.constant(evaluate(inst.op, lhs.imm, rhs.imm)));
+            return true;
+        }
+        if (inst.op == Op::phi) {
+            ValueId same = none;
+            bool agree = true;
+            for (uint32_t i = 0; i < inst.b; i++) {
+                const PhiArg& arg = m_fn.phi_args[inst.a + i];
+                if (!edge_live(arg.pred, block)) {
+                    continue;
+                }
+                const ValueId incoming = m_replacements.resolve(arg.value);
+                agree = agree && (same == none || same == incoming);
+                same = incoming;
+            }
+            if (!agree) {
+                return false;
+            }
+            m_replacements.add(value, same);
+            return true;
+        }
+        if (inst.op == Op::br) {
+            const Inst& cond = m_fn.insts[m_replacements.resolve(inst.a)];
+            if (cond.op == Op::constant) {
+                m_fn.insts[value] = { Op::jmp, Type::none, block, cond.imm != 0 ? inst.b : inst.c };
+            }
+        }
+        return false;
+    }
+
+    [[nodiscard]] bool edge_live(const BlockId pred, const BlockId block) const
+    {
+        if (!m_reachable[pred]) {
+            return false;
+        }
+        bool live = false;
+        m_fn.for_each_succ(pred, [&](const BlockId succ) { live = live || succ == block; });
+        return live;
+    }
+
+    Function& m_fn;
+    ValueReplacements m_replacements;
+    std::vector<bool> m_reachable;
+};
+
+// Unlinks unreachable blocks, drops the phi inputs that came from them, and
+// merges each block into its predecessor when that is its only predecessor
+// and it is the predecessor's only successor
+class CfgSimplifier {
+public:
+    inline explicit CfgSimplifier(Function& fn)
+        : m_fn(fn)
+        , m_replacements(fn.insts.size())
+    {
+    }
+
+    void simplify()
+    {
+        remove_unreachable();
+        prune_phis();
+        merge_blocks();
+        m_replacements.apply(m_fn);
+    }
+
+private:
+    void remove_unreachable()
+    {
+        std::vector<bool> reachable(m_fn.blocks.size(), false);
+        reachable[m_fn.layout.front()] = true;
+        for (const BlockId block : m_fn.layout) {
+            if (reachable[block]) {
+                m_fn.for_each_succ(block, [&](const BlockId succ) { reachable[succ] = true; });
+            }
+            else {
+                m_fn.blocks[block].dead = true;
+            }
+        }
+        unlink_dead();
+
+        // Predecessor lists are rebuilt in layout order from the live terminators
+        for (const BlockId block : m_fn.layout) {
+            m_fn.blocks[block].preds.clear();
+        }
+        for (const BlockId block : m_fn.layout) {
+            m_fn.for_each_succ(block, [&](const BlockId succ) { m_fn.blocks[succ].preds.push_back(block); });
+        }
+    }
+
+    // Keeps only the inputs from live predecessors; a phi left with a single
+    // incoming value is replaced by it
+    void prune_phis()
+    {
+        for (const BlockId block : m_fn.layout) {
+            Block& b = m_fn.blocks[block];
+            size_t kept = 0;
+            for (const ValueId value : b.insts) {
+                Inst& inst = m_fn.insts[value];
+                if (inst.op != Op::phi) {
+                    b.insts[kept++] = value;
+                    continue;
+                }
+                PhiArg* args = &m_fn.phi_args[inst.a];
+                const PhiArg* last = std::remove_if(args, args + inst.b, [&](const PhiArg& arg) {
+                    return std::find(b.preds.begin(), b.preds.end(), arg.pred) == b.preds.end();
+                });
+                inst.b = static_cast<uint32_t>(last - args);
+                const ValueId first = m_replacements.resolve(args[0].value);
+                const bool agree = std::all_of(args, args + inst.b,
+                    [&](const PhiArg& arg) { return m_replacements.resolve(arg.value) == first; });
+                if (agree) {
+                    m_replacements.add(value, first);
+                }
+                else {
+                    b.insts[kept++] = value;
+                }
+            }
+            b.insts.resize(kept);
+        }
+    }
+
+    void merge_blocks()
+    {
+        for (const BlockId block : m_fn.layout) {
+            Block& b = m_fn.blocks[block];
+            if (b.preds.size() != 1) {
+                continue;
+            }
+            const BlockId pred = b.preds.front();
+            Block& p = m_fn.blocks[pred];
+            if (m_fn.terminator(pred).op != Op::jmp) {
+                continue;
+            }
+            // A sole predecessor means no phis are left here
+            p.insts.pop_back();
+            for (const ValueId value : b.insts) {
+                m_fn.insts[value].block = pred;
+                p.insts.push_back(value);
+            }
+            b.insts.clear();
+            b.dead = true;
+            m_fn.for_each_succ(pred, [&](const BlockId succ) { retarget_pred(succ, block, pred); });
+        }
+        unlink_dead();
+    }
+
+    // The edge from `from` into `block` now leaves from `to`
+    void retarget_pred(const BlockId block, const BlockId from, const BlockId to)
+    {
+        Block& b = m_fn.blocks[block];
+        std::replace(b.preds.begin(), b.preds.end(), from, to);
+        for (const ValueId value : b.insts) {
+            const Inst& inst = m_fn.insts[value];
+            if (inst.op != Op::phi) {
+                break;
+            }
+            for (uint32_t i = 0; i < inst.b; i++) {
+                PhiArg& arg = m_fn.phi_args[inst.a + i];
+                if (arg.pred == from) {
+                    arg.pred = to;
+                }
+            }
+        }
+    }
+
+    void unlink_dead()
+    {
+        m_fn.layout.erase(std::remove_if(m_fn.layout.begin(), m_fn.layout.end(),
+                              [&](const BlockId block) { return m_fn.blocks[block].dead; }),
+            m_fn.layout.end());
+    }
+
+    Function& m_fn;
+    ValueReplacements m_replacements;
+};
+
+// Deletes instructions whose values are never used. Visiting blocks and
+// instructions backwards sees every use before its definition, so values
+// that only fed deleted instructions go in the same sweep.
+class IrDeadCodeEliminator {
+public:
+    inline explicit IrDeadCodeEliminator(Function& fn)
+        : m_fn(fn)
+        , m_uses(fn.insts.size(), 0)
+    {
+    }
+
+    void eliminate()
+    {
+        for (const BlockId block : m_fn.layout) {
+            for (const ValueId value : m_fn.blocks[block].insts) {
+                for_each_operand(value, [&](const ValueId operand) { m_uses[operand]++; });
+            }
+        }
+        for (auto block = m_fn.layout.rbegin(); block != m_fn.layout.rend(); ++block) {
+            std::vector<ValueId>& insts = m_fn.blocks[*block].insts;
+            std::vector<ValueId>::iterator kept = insts.end();
+            for (auto value = insts.rbegin(); value != insts.rend(); ++value) {
+                if (m_uses[*value] == 0 && !is_terminator(m_fn.insts[*value].op)) {
+                    for_each_operand(*value, [&](const ValueId operand) { m_uses[operand]--; });
+                    continue;
+                }
+                *--kept = *value;
+            }
+            insts.erase(insts.begin(), kept);
+        }
+    }
+
+private:
+    template <typename Visit>
+    void for_each_operand(const ValueId value, Visit visit) const
+    {
+        const Inst& inst = m_fn.insts[value];
+        if (is_binary(inst.op)) {
+            visit(inst.a);
+            visit(inst.b);
+        }
+        else if (inst.op == Op::phi) {
+            for (uint32_t i = 0; i < inst.b; i++) {
+                visit(m_fn.phi_args[inst.a + i].value);
+            }
+        }
+        else if (inst.op == Op::br || inst.op == Op::exit) {
+            visit(inst.a);
+        }
+    }
+
+    Function& m_fn;
+    std::vector<uint32_t> m_uses;
+};
+
+} // namespace ir
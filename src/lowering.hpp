@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "ir.hpp"
+#include "parser.hpp"
+#include "symbols.hpp"
+
+// Lowers a resolved NodeProg to SSA form. Variables become SSA values: each
+// var or assignment rebinds the symbol to the value just computed, and where
+// the arms of an if rejoin, a phi merges the values they left behind. The
+// language has no loops, so every predecessor of a join is lowered before the
+// join itself and the phis can be placed directly, without a later fix-up.
+class IrBuilder {
+public:
+    inline explicit IrBuilder(const NodeProg& prog)
+        : m_prog(prog)
+        , m_vars(prog.symbols.size())
+    {
+    }
+
+    ir::Function build_prog()
+    {
+        start_block(new_block());
+        lower_stmts(m_prog.body);
+        if (m_current != ir::none) {
+            append({ ir::Op::exit, ir::Type::none, m_current, m_fn.constant(0) });
+        }
+        return std::move(m_fn);
+    }
+
+private:
+    ir::BlockId new_block()
+    {
+        m_fn.blocks.emplace_back();
+        return static_cast<ir::BlockId>(m_fn.blocks.size() - 1);
+    }
+
+    void start_block(const ir::BlockId block)
+    {
+        m_current = block;
+        m_fn.layout.push_back(block);
+    }
+
+    ir::ValueId append(const ir::Inst& inst)
+    {
+        const auto value = static_cast<ir::ValueId>(m_fn.insts.size());
+        m_fn.insts.push_back(inst);
+        m_fn.blocks[m_current].insts.push_back(value);
+        return value;
+    }
+
+    void jump(const ir::BlockId target)
+    {
+        append({ ir::Op::jmp, ir::Type::none, m_current, target });
+        m_fn.blocks[target].preds.push_back(m_current);
+    }
+
+    void lower_stmts(const NodeScope& scope)
+    {
+        // Nothing after an exit is reachable, so lowering stops there
+        for (NodeIndex i = 0; i < scope.count && m_current != ir::none; i++) {
+            lower_stmt(m_prog.scope_stmts[scope.first + i]);
+        }
+    }
+
+    void lower_scope(const NodeScope& scope)
+    {
+        m_vars.begin_scope();
+        lower_stmts(scope);
+        m_vars.end_scope();
+    }
+
+    void lower_stmt(const NodeIndex index)
+    {
+        const NodeStmt& stmt = m_prog.stmts[index];
+        switch (stmt.kind) {
+        case StmtKind::exit: {
+            const ir::ValueId status = lower_expr(m_prog.exits[stmt.index].expr);
+            append({ ir::Op::exit, ir::Type::none, m_current, status });
+            m_current = ir::none;
+            return;
+        }
+        case StmtKind::var: {
+            const NodeStmtVar& stmt_var = m_prog.vars[stmt.index];
+            m_vars.declare(stmt_var.sym, lower_expr(stmt_var.expr));
+            return;
+        }
+        case StmtKind::assign: {
+            const NodeStmtAssign& stmt_assign = m_prog.assigns[stmt.index];
+            assign(stmt_assign.sym, lower_expr(stmt_assign.expr));
+            return;
+        }
+        case StmtKind::scope:
+            lower_scope(m_prog.scopes[stmt.index]);
+            return;
+        case StmtKind::if_:
+            lower_if(m_prog.ifs[stmt.index]);
+            return;
+        }
+    }
+
+    // Each conditional arm gets its own block, and a missing else gets an
+    // empty one, so no branch ever targets a block with phis directly
+    void lower_if(const NodeStmtIf& stmt_if)
+    {
+        const ir::BlockId join = new_block();
+        // Blocks that end an arm by jumping to the join
+        std::vector<ir::BlockId> arms;
+        // (symbol, arm, value at the end of the arm) for everything an arm assigned
+        std::vector<std::tuple<SymbolId, uint32_t, ir::ValueId>> assigned;
+
+        NodeIndex expr = stmt_if.expr;
+        NodeIndex scope = stmt_if.scope;
+        NodeIndex pred = stmt_if.pred;
+        while (true) {
+            const ir::ValueId cond = lower_expr(expr);
+            const ir::BlockId then_block = new_block();
+            const ir::BlockId else_block = new_block();
+            append({ ir::Op::br, ir::Type::none, m_current, cond, then_block, else_block });
+            m_fn.blocks[then_block].preds.push_back(m_current);
+            m_fn.blocks[else_block].preds.push_back(m_current);
+            start_block(then_block);
+            lower_arm(&m_prog.scopes[scope], join, arms, assigned);
+            start_block(else_block);
+            if (pred == no_node) {
+                lower_arm(nullptr, join, arms, assigned);
+                break;
+            }
+            const NodeIfPred& if_pred = m_prog.preds[pred];
+            if (if_pred.kind == IfPredKind::else_) {
+                lower_arm(&m_prog.scopes[if_pred.scope], join, arms, assigned);
+                break;
+            }
+            expr = if_pred.expr;
+            scope = if_pred.scope;
+            pred = if_pred.pred;
+        }
+
+        if (arms.empty()) {
+            m_fn.blocks[join].dead = true;
+            m_current = ir::none;
+            return;
+        }
+        start_block(join);
+        std::sort(assigned.begin(), assigned.end());
+        std::vector<ir::ValueId> incoming(arms.size());
+        for (size_t first = 0; first < assigned.size();) {
+            const SymbolId sym = std::get<0>(assigned[first]);
+            const ir::ValueId* before = m_vars.lookup(sym);
+            std::fill(incoming.begin(), incoming.end(), before != nullptr ? *before : ir::none);
+            size_t last = first;
+            for (; last < assigned.size() && std::get<0>(assigned[last]) == sym; last++) {
+                incoming[std::get<1>(assigned[last])] = std::get<2>(assigned[last]);
+            }
+            first = last;
+            if (before == nullptr) {
+                continue;
+            }
+            if (std::all_of(incoming.begin(), incoming.end(), [&](const ir::ValueId v) { return v == incoming[0]; })) {
+                assign(sym, incoming[0]);
+                continue;
+            }
+            const auto first_arg = static_cast<uint32_t>(m_fn.phi_args.size());
+            for (size_t i = 0; i < arms.size(); i++) {
+                m_fn.phi_args.push_back({ arms[i], incoming[i] });
+            }
+            assign(sym,
+                append({ ir::Op::phi, ir::Type::i64, m_current, first_arg, static_cast<uint32_t>(arms.size()) }));
+        }
+    }
+
+    // Lowers one arm (or an empty else when `scope` is null) into the current
+    // block and jumps to `join`. The arm's assignments are then undone, since
+    // the next arm starts from the values before the if.
+    void lower_arm(const NodeScope* scope, const ir::BlockId join, std::vector<ir::BlockId>& arms,
+        std::vector<std::tuple<SymbolId, uint32_t, ir::ValueId>>& assigned)
+    {
+        const size_t mark = m_assign_log.size();
+        if (scope != nullptr) {
+            lower_scope(*scope);
+        }
+        if (m_current != ir::none) {
+            const auto arm = static_cast<uint32_t>(arms.size());
+            for (size_t i = mark; i < m_assign_log.size(); i++) {
+                const SymbolId sym = m_assign_log[i].first;
+                // Symbols declared inside the arm are out of scope again
+                if (const ir::ValueId* value = m_vars.lookup(sym)) {
+                    assigned.emplace_back(sym, arm, *value);
+                }
+            }
+            arms.push_back(m_current);
+            jump(join);
+        }
+        while (m_assign_log.size() > mark) {
+            const auto [sym, previous] = m_assign_log.back();
+            m_assign_log.pop_back();
+            if (ir::ValueId* value = m_vars.lookup(sym)) {
+                *value = previous;
+            }
+        }
+    }
+
+    void assign(const SymbolId sym, const ir::ValueId value)
+    {
+        if (ir::ValueId* binding = m_vars.lookup(sym)) {
+            m_assign_log.emplace_back(sym, *binding);
+            *binding = value;
+        }
+    }
+
+    // Post-order over an explicit stack, like the Generator
+    ir::ValueId lower_expr(const NodeIndex root)
+    {
+        m_pending.clear();
+        m_values.clear();
+        m_pending.emplace_back(root, false);
+        while (!m_pending.empty()) {
+            const auto [index, operands_done] = m_pending.back();
+            m_pending.pop_back();
+            const NodeExpr& expr = m_prog.exprs[index];
+            switch (expr.kind) {
+            case ExprKind::int_lit:
+                m_values.push_back(m_fn.constant(static_cast<uint64_t>(m_prog.literals[expr.lhs])));
+                break;
+            case ExprKind::ident: {
+                const ir::ValueId* value = m_vars.lookup(expr.lhs);
+                assert(value != nullptr); // Checked by NameResolver
+                m_values.push_back(*value);
+                break;
+            }
+            case ExprKind::add:
+            case ExprKind::sub:
+            case ExprKind::multi:
+            case ExprKind::div:
+                if (!operands_done) {
+                    m_pending.emplace_back(index, true);
+                    m_pending.emplace_back(expr.rhs, false);
+                    m_pending.emplace_back(expr.lhs, false);
+                    break;
+                }
+                const ir::ValueId rhs = m_values.back();
+                m_values.pop_back();
+                const ir::ValueId lhs = m_values.back();
+                m_values.back() = append({ binary_op(expr.kind), ir::Type::i64, m_current, lhs, rhs });
+                break;
+            }
+        }
+        return m_values.back();
+    }
+
+    static ir::Op binary_op(const ExprKind kind)
+    {
+        switch (kind) {
+        case ExprKind::add:
+            return ir::Op::add;
+        case ExprKind::sub:
+            return ir::Op::sub;
+        case ExprKind::multi:
+            return ir::Op::mul;
+        case ExprKind::div:
+            return ir::Op::udiv;
+        default:
+            assert(false); // Unreachable
+            return ir::Op::add;
+        }
+    }
+
+    const NodeProg& m_prog;
+    ir::Function m_fn {};
+    // Block being appended to, or none after an exit
+    ir::BlockId m_current = ir::none;
+    // Current SSA value of each variable in scope
+    ScopedSymbolTable<ir::ValueId> m_vars;
+    // (symbol, value before the assignment) for every assignment so far
+    std::vector<std::pair<SymbolId, ir::ValueId>> m_assign_log {};
+    std::vector<std::pair<NodeIndex, bool>> m_pending {};
+    std::vector<ir::ValueId> m_values {};
+};
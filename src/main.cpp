@@ -1,62 +1,750 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <initializer_list>
+#include <iomanip>
 #include <iostream>
-#include <fstream>
-#include <sstream>
-#include "arena.hpp"
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "mapped_file.hpp"
 #include "tokenisation.hpp"
 #include "parser.hpp"
+#include "resolution.hpp"
+#include "optimisation.hpp"
 #include "generation.hpp"
+#include "lowering.hpp"
+#include "ir_optimisation.hpp"
+#include "ir_generation.hpp"
+#include "peephole.hpp"
+#include "passes.hpp"
+#include "target.hpp"
+#include "arm64_backend.hpp"
+#include "x86_64_backend.hpp"
+#include "elf_writer.hpp"
+#include "output_buffer.hpp"
+#include "compile_error.hpp"
+#include "work_stealing.hpp"
+#include "compile_cache.hpp"
+#include "compile_server.hpp"
+#include "bytecode.hpp"
+#include "vm.hpp"
+#include "incremental.hpp"
 using namespace std;
 
-int main(int argc, char *argv[]) {
+extern char** environ;
 
-    if (argc != 2) {
-        cerr << "Incorrect number of arguments" << endl;
-        exit(EXIT_FAILURE);
-    }
-    
-    string contents ;
-    {
-        stringstream contents_stream;
-        fstream input(argv[1], ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
-    } 
+struct Options {
+    OptLevel level = OptLevel::o1;
+    bool emit_ir = false;
+    bool time_passes = false;
+    bool print_stats = false;
+    size_t peephole_window = PeepholeRules::default_window;
+    bool print_peephole_stats = false;
+};
 
-    Tokeniser tokeniser(std::move(contents));
-    vector<Token> tokens = tokeniser.tokenise(contents);
+// Where one compilation writes its files: out.asm, out.o and out in the
+// working directory for a single file, or beside each input in a batch
+struct OutputPaths {
+    string assembly = "out.asm";
+    string object = "out.o";
+    string executable = "out";
+};
 
-    Parser parser(std::move(tokens));
-    optional<NodeProg> prog = parser.parse_prog();
+// Runs a tool without a shell, which unlike system() is safe from several
+// threads at once and needs no quoting of paths. Returns its exit status, or
+// 127 if it could not be started or did not exit normally.
+int run_tool(initializer_list<const char*> args)
+{
+    vector<char*> argv;
+    for (const char* arg : args) {
+        argv.push_back(const_cast<char*>(arg));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+        return 127;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return 127;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 127;
+}
 
+// Lexes and parses a whole source file. The parser pulls tokens on demand, so
+// the token array is never materialised.
+NodeProg parse_source(const string_view source)
+{
+    Tokeniser tokeniser(source);
+    Parser parser(tokeniser);
+    optional<NodeProg> prog = parser.parse_prog();
     if (!prog.has_value()) {
-        cerr << "Invalid program" << endl;
-        exit(EXIT_FAILURE);
+        throw CompileError("Invalid program");
     }
+    return std::move(prog.value());
+}
+
+// Turns what the machine passes produced into the executable at `paths`:
+// `assembly` through as and ld for a system_toolchain backend, or else
+// `machine_code` written out as ELF
+template <typename Backend, typename MachineCode>
+void write_executable(const OutputPaths& paths, const OutputBuffer& assembly, const MachineCode& machine_code) {
+    if constexpr (Backend::system_toolchain) {
+        if (!assembly.write_to(paths.assembly.c_str())) {
+            throw CompileError("Could not write assembly: " + paths.assembly);
+        }
 
-    Generator generator(prog.value());
+        int status = run_tool({ "as", "-o", paths.object.c_str(), paths.assembly.c_str() });
+        if (status != 0) {
+            throw CompileError("Assembly failed with exit status: " + to_string(status));
+        }
 
-    {
-        fstream output_file("out.asm", ios::out);
-        output_file << generator.gen_prog();
+        status = run_tool({ "ld", "-macos_version_min", "14.0", "-e", "_start", "-o", paths.executable.c_str(),
+            paths.object.c_str() });
+        if (status != 0) {
+            throw CompileError("Linking failed with exit status: " + to_string(status));
+        }
+    }
+    else if (!ElfWriter(Backend::elf_machine, machine_code).write(paths.executable)) {
+        throw CompileError("Could not write executable: " + paths.executable);
     }
+}
 
-    int ret = system("as -o out.o out.asm");
-    if (WIFEXITED(ret) && WEXITSTATUS(ret) != 0) {
-        cerr << "Assembly failed with exit status: " << WEXITSTATUS(ret) << endl;
-        exit(EXIT_FAILURE);
+// Runs the passes from the resolved AST to an executable at `paths`, or to the
+// IR dump for --emit-ir, with every instruction emitted through `Backend`.
+// `assembly` is the caller's, so a batch worker reuses it from file to file.
+template <typename Backend>
+void compile(NodeProg prog, const Options& options, const OutputPaths& paths, OutputBuffer& assembly) {
+    using Code = typename Backend::Code;
+    const OptLevel level = options.level;
+    const bool emit_ir = options.emit_ir;
+
+    // -O0 and -O1 generate from the AST; -O2 and --emit-ir go through the IR
+    const bool use_ir = level == OptLevel::o2 || emit_ir;
+    size_t removed_stmts = 0;
+    PassManager<NodeProg> ast_passes;
+    ast_passes.add("resolve", [](NodeProg& p) { NameResolver(p).resolve_prog(); });
+    if (level == OptLevel::o1 && !use_ir) {
+        ast_passes.add("fold", [](NodeProg& p) { ConstantFolder(p).fold_prog(); });
+        ast_passes.add("dce", [&](NodeProg& p) { removed_stmts = DeadCodeEliminator(p).eliminate_prog(); });
+    }
+    ir::Function fn;
+    Code code;
+    if (use_ir) {
+        ast_passes.add("lower", [&](NodeProg& p) { fn = IrBuilder(p).build_prog(); });
     }
+    else {
+        ast_passes.add("codegen", [&](NodeProg& p) { code = Generator<Backend>(std::move(p)).gen_prog(); });
+    }
+    ast_passes.run(prog);
 
-    ret = system("ld -macos_version_min 14.0 -e _start -o out out.o");
-    if (WIFEXITED(ret) && WEXITSTATUS(ret) != 0) {
-        cerr << "Linking failed with exit status: " << WEXITSTATUS(ret) << endl;
-        exit(EXIT_FAILURE);
+    PassManager<ir::Function> ir_passes;
+    if (level == OptLevel::o2) {
+        ir_passes.add("constfold", [](ir::Function& f) { ir::IrConstantFolder(f).fold(); });
+        ir_passes.add("simplifycfg", [](ir::Function& f) { ir::CfgSimplifier(f).simplify(); });
+        ir_passes.add("dce", [](ir::Function& f) { ir::IrDeadCodeEliminator(f).eliminate(); });
+    }
+    if (use_ir && !emit_ir) {
+        ir_passes.add("codegen", [&](ir::Function& f) { code = IrGenerator<Backend>(f).gen_prog(); });
+    }
+    if (use_ir) {
+        ir_passes.run(fn);
+    }
+
+    PassManager<Code> machine_passes;
+    PeepholeOptimiser<typename Backend::Isa> peephole(options.peephole_window);
+    if (level != OptLevel::o0 && !emit_ir) {
+        machine_passes.add("peephole", [&](Code& c) { peephole.optimise(c); });
+    }
+    decltype(Backend::encode(code)) machine_code;
+    assembly.clear();
+    if constexpr (Backend::system_toolchain) {
+        if (!emit_ir) {
+            machine_passes.add("print", [&](Code& c) { Backend::print(assembly, c); });
+        }
+    }
+    else if (!emit_ir) {
+        machine_passes.add("encode", [&](Code& c) { machine_code = Backend::encode(c); });
     }
+    machine_passes.run(code);
 
-    ret = system("./out");
+    if (options.time_passes) {
+        print_timings(cerr, ast_passes.timings());
+        print_timings(cerr, ir_passes.timings());
+        print_timings(cerr, machine_passes.timings());
+    }
+    if (options.print_stats) {
+        cerr << "Removed " << removed_stmts << " unreachable statements" << endl;
+    }
+    if (options.print_peephole_stats) {
+        for (uint8_t rule = 0; rule < PeepholeRules::rule_count; rule++) {
+            cerr << "peephole " << PeepholeRules::rule_name(static_cast<PeepholeRules::Rule>(rule)) << ": "
+                 << peephole.hits()[rule] << endl;
+        }
+    }
+    if (emit_ir) {
+        ir::dump(cout, fn);
+        exit(EXIT_SUCCESS);
+    }
+
+    write_executable<Backend>(paths, assembly, machine_code);
+}
+
+// Calls fn(backend) with a value of the backend for `target`, which the callee
+// names as decltype(backend): the one switch over targets
+template <typename Fn>
+void with_backend(const Target target, Fn&& fn) {
+    switch (target) {
+    case Target::arm64_macos:
+        fn(arm64::Backend<arm64::Os::macos> {});
+        return;
+    case Target::arm64_linux:
+        fn(arm64::Backend<arm64::Os::linux_gnu> {});
+        return;
+    case Target::x86_64_linux:
+        fn(x86_64::Backend {});
+        return;
+    }
+}
+
+// Everything besides the source that decides what `compile` writes, for the
+// cache key. The build time stands in for a version, so any rebuild of the
+// compiler starts a fresh set of entries.
+string cache_config(const Target target, const Options& options)
+{
+    return "microcompiler " __DATE__ " " __TIME__ " target " + to_string(static_cast<int>(target)) + " -O"
+        + to_string(static_cast<int>(options.level)) + " peephole window " + to_string(options.peephole_window);
+}
+
+// Compiles `source` to `paths`, unless `cache` (which may be null) already
+// holds its executable under `config`. Returns whether it came from the cache.
+template <typename Backend>
+bool compile_source(const string_view source, const Options& options, const OutputPaths& paths,
+    OutputBuffer& assembly, CompileCache* cache, const string& config) {
+    if (cache == nullptr) {
+        compile<Backend>(parse_source(source), options, paths, assembly);
+        return false;
+    }
+    const CompileCache::Key key = CompileCache::key(source, config);
+    if (cache->fetch(key, paths.executable)) {
+        return true;
+    }
+    compile<Backend>(parse_source(source), options, paths, assembly);
+    cache->store(key, paths.executable);
+    return false;
+}
+
+// Compiles `source` as compile_source does, but through `incremental`, which
+// holds what the last compile of the same file left behind (see
+// incremental.hpp). -O2 optimises across statements, so it always compiles
+// the whole file.
+template <typename Backend>
+bool compile_incremental(IncrementalCompiler& incremental, const string_view source, const Options& options,
+    const OutputPaths& paths, OutputBuffer& assembly, CompileCache* cache, const string& config) {
+    if (options.level == OptLevel::o2) {
+        return compile_source<Backend>(source, options, paths, assembly, cache, config);
+    }
+    optional<CompileCache::Key> key;
+    if (cache != nullptr) {
+        key = CompileCache::key(source, config);
+        if (cache->fetch(key.value(), paths.executable)) {
+            return true;
+        }
+    }
+    IncrementalCompiler::MachineCode<Backend> machine_code;
+    incremental.compile<Backend>(source, config, options.level, options.peephole_window, assembly, machine_code);
+    write_executable<Backend>(paths, assembly, machine_code);
+    if (key.has_value()) {
+        cache->store(key.value(), paths.executable);
+    }
+    return false;
+}
+
+void print_cache_stats(CompileCache& cache)
+{
+    const CompileCache::Stats stats = cache.stats();
+    cerr << "Cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.bytes << " bytes" << endl;
+}
+
+// A batch writes each input's files beside it, named after the input without
+// its .micro extension: foo.micro gives foo.asm, foo.o and foo.out
+OutputPaths batch_paths(const string& input)
+{
+    const string_view extension = ".micro";
+    const bool has_extension = input.size() > extension.size()
+        && string_view(input).substr(input.size() - extension.size()) == extension;
+    const string stem = has_extension ? input.substr(0, input.size() - extension.size()) : input;
+    return { stem + ".asm", stem + ".o", stem + ".out" };
+}
+
+// Compiles every input on `jobs` threads and prints a throughput summary, and
+// each failure prefixed by its file. Nothing is run. Workers keep their own
+// assembly buffer across files, and a file's errors stay with that file.
+template <typename Backend>
+bool compile_batch(const vector<string>& inputs, const Options& options, const unsigned jobs, CompileCache* cache,
+    const string& config) {
+    struct Result {
+        size_t lines = 0;
+        bool cached = false;
+        string error;
+    };
+    vector<Result> results(inputs.size());
+    const unsigned threads = static_cast<unsigned>(min<size_t>(jobs, max<size_t>(inputs.size(), 1)));
+    vector<OutputBuffer> buffers(threads);
+
+    const auto start = chrono::steady_clock::now();
+    run_work_stealing(inputs.size(), threads, [&](const unsigned worker, const size_t index) {
+        Result& result = results[index];
+        const MappedFile source(inputs[index].c_str());
+        if (!source.is_open()) {
+            result.error = "Could not open file: " + inputs[index];
+            return;
+        }
+        const string_view text = source.view();
+        result.lines = static_cast<size_t>(count(text.begin(), text.end(), '\n'))
+            + (!text.empty() && text.back() != '\n' ? 1 : 0);
+        try {
+            result.cached
+                = compile_source<Backend>(text, options, batch_paths(inputs[index]), buffers[worker], cache, config);
+        }
+        catch (const CompileError& error) {
+            result.error = error.what();
+        }
+    });
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0;
+    size_t cached = 0;
+    size_t lines = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        lines += results[i].lines;
+        cached += results[i].cached ? 1 : 0;
+        if (!results[i].error.empty()) {
+            cerr << inputs[i] << ": " << results[i].error << endl;
+            failed++;
+        }
+    }
+    cout << "Compiled " << inputs.size() - failed << " of " << inputs.size() << " files (" << lines << " lines) in "
+         << fixed << setprecision(1) << seconds * 1e3 << " ms on " << threads
+         << (threads == 1 ? " thread: " : " threads: ") << setprecision(0) << inputs.size() / seconds << " files/s, "
+         << lines / seconds << " lines/s";
+    if (cache != nullptr) {
+        cout << ", " << cached << " from the cache";
+    }
+    cout << endl;
+    return failed == 0;
+}
+
+// Runs the program just written to ./out, reports how it exited, and exits
+[[noreturn]] void run_out() {
+    const int ret = system("./out");
     if (WIFEXITED(ret)) {
         cout << "Program exited with status: " << WEXITSTATUS(ret) << endl;
     } else {
         cerr << "Program did not exit normally" << endl;
     }
     exit(EXIT_SUCCESS);
+}
+
+// Runs the program in-process instead of building ./out: the AST passes for
+// the level, then bytecode for the VM, whose run is timed as a pass of its
+// own. Nothing is written, so this works on any host. Reports how the program
+// exited, as run_out does, and exits.
+[[noreturn]] void run_in_process(NodeProg prog, const Options& options) {
+    size_t removed_stmts = 0;
+    PassManager<NodeProg> ast_passes;
+    ast_passes.add("resolve", [](NodeProg& p) { NameResolver(p).resolve_prog(); });
+    // The IR only feeds the native backends, so -O2 gets the -O1 passes here
+    if (options.level != OptLevel::o0) {
+        ast_passes.add("fold", [](NodeProg& p) { ConstantFolder(p).fold_prog(); });
+        ast_passes.add("dce", [&](NodeProg& p) { removed_stmts = DeadCodeEliminator(p).eliminate_prog(); });
+    }
+    bytecode::Program program;
+    ast_passes.add("bytecode", [&](NodeProg& p) { program = bytecode::Compiler(std::move(p)).compile_prog(); });
+    ast_passes.run(prog);
+
+    uint64_t value = 0;
+    PassManager<bytecode::Program> vm_passes;
+    vm_passes.add("execute", [&](bytecode::Program& p) { value = bytecode::run(p); });
+    vm_passes.run(program);
+
+    if (options.time_passes) {
+        print_timings(cerr, ast_passes.timings());
+        print_timings(cerr, vm_passes.timings());
+    }
+    if (options.print_stats) {
+        cerr << "Removed " << removed_stmts << " unreachable statements" << endl;
+    }
+    // A process exit status keeps only the low 8 bits
+    cout << "Program exited with status: " << (value & 0xff) << endl;
+    exit(EXIT_SUCCESS);
+}
+
+// The value of a flag such as --jobs=N: all of `text` as a decimal number from
+// 1 to `max`, or nothing if it is anything else
+template <typename T>
+optional<T> parse_count(const string_view text, const T max)
+{
+    T value {};
+    const auto [end, error] = from_chars(text.data(), text.data() + text.size(), value);
+    if (error != errc {} || end != text.data() + text.size() || value == 0 || value > max) {
+        return {};
+    }
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+
+    // microcompiler [-O0|-O1|-O2] [--emit-ir] [--time-passes] [--stats]
+    //               [--peephole-window=N] [--peephole-stats]
+    //               [--target=macos|linux|x86_64-linux] <file>
+    // microcompiler [options] [--jobs=N] [--manifest=<list>] <file>...
+    //               [--cache=<dir>] [--cache-size=MiB] [--cache-stats]
+    // microcompiler --serve=<socket> [--jobs=N] [--cache=<dir>] [--cache-size=MiB]
+    //               [--incremental]
+    // microcompiler --client=<socket> [options] <file>
+    // microcompiler --run [-O0|-O1|-O2] [--time-passes] [--stats] <file>
+    //
+    // One file is compiled to ./out and run. Several, or a manifest of paths
+    // one per line, are compiled as a batch and not run. With --cache, an
+    // executable already built from the same source and flags is reused.
+    // --serve stays up answering compiles on a Unix socket; --client hands
+    // its compile to that server and then runs ./out as usual. With
+    // --incremental the server keeps the statements of the 64 files it
+    // compiled last between compiles, and redoes only the ones an edit
+    // touched. --run interprets the program in-process and builds nothing.
+    vector<string> inputs;
+    const char* manifest = nullptr;
+    unsigned jobs = max(1u, thread::hardware_concurrency());
+    const char* cache_dir = nullptr;
+    uint64_t cache_mib = 512;
+    bool print_cache_stats_after = false;
+    const char* serve_socket = nullptr;
+    const char* client_socket = nullptr;
+    bool run_bytecode = false;
+    bool incremental = false;
+    Options options;
+    // Programs run natively by default: macOS goes through as and ld, and
+    // Linux gets an ELF executable written directly
+#if defined(__APPLE__)
+    Target target = Target::arm64_macos;
+#elif defined(__x86_64__)
+    Target target = Target::x86_64_linux;
+#else
+    Target target = Target::arm64_linux;
+#endif
+    for (int i = 1; i < argc; i++) {
+        const string_view arg = argv[i];
+        if (arg == "-O0" || arg == "-O1" || arg == "-O2") {
+            options.level = static_cast<OptLevel>(arg[2] - '0');
+        }
+        else if (arg == "--emit-ir") {
+            options.emit_ir = true;
+        }
+        else if (arg == "--time-passes") {
+            options.time_passes = true;
+        }
+        else if (arg == "--run") {
+            run_bytecode = true;
+        }
+        else if (arg == "--stats") {
+            options.print_stats = true;
+        }
+        else if (arg.substr(0, 18) == "--peephole-window=") {
+            const string_view value = arg.substr(18);
+            const optional<size_t> window = parse_count<size_t>(value, 999999);
+            if (!window) {
+                cerr << "Invalid peephole window: " << value << endl;
+                exit(EXIT_FAILURE);
+            }
+            options.peephole_window = *window;
+        }
+        else if (arg.substr(0, 7) == "--jobs=") {
+            const string_view value = arg.substr(7);
+            const optional<unsigned> count = parse_count<unsigned>(value, 9999);
+            if (!count) {
+                cerr << "Invalid job count: " << value << endl;
+                exit(EXIT_FAILURE);
+            }
+            jobs = *count;
+        }
+        else if (arg.substr(0, 13) == "--cache-size=") {
+            const string_view value = arg.substr(13);
+            const optional<uint64_t> mib = parse_count<uint64_t>(value, 9999999);
+            if (!mib) {
+                cerr << "Invalid cache size: " << value << endl;
+                exit(EXIT_FAILURE);
+            }
+            cache_mib = *mib;
+        }
+        else if (arg == "--cache-stats") {
+            print_cache_stats_after = true;
+        }
+        else if (arg.substr(0, 8) == "--cache=") {
+            cache_dir = argv[i] + 8;
+        }
+        else if (arg.substr(0, 8) == "--serve=") {
+            serve_socket = argv[i] + 8;
+        }
+        else if (arg == "--incremental") {
+            incremental = true;
+        }
+        else if (arg.substr(0, 9) == "--client=") {
+            client_socket = argv[i] + 9;
+        }
+        else if (arg.substr(0, 11) == "--manifest=") {
+            manifest = argv[i] + 11;
+        }
+        else if (arg == "--peephole-stats") {
+            options.print_peephole_stats = true;
+        }
+        else if (arg == "--target=macos") {
+            target = Target::arm64_macos;
+        }
+        else if (arg == "--target=linux") {
+            target = Target::arm64_linux;
+        }
+        else if (arg == "--target=x86_64-linux") {
+            target = Target::x86_64_linux;
+        }
+        else if (arg.substr(0, 9) == "--target=") {
+            cerr << "Unknown target: " << arg.substr(9) << endl;
+            exit(EXIT_FAILURE);
+        }
+        else if (arg.size() > 1 && arg.front() == '-') {
+            cerr << "Unknown option: " << arg << endl;
+            exit(EXIT_FAILURE);
+        }
+        else {
+            inputs.emplace_back(arg);
+        }
+    }
+    if (manifest != nullptr) {
+        const MappedFile list(manifest);
+        if (!list.is_open()) {
+            cerr << "Could not open manifest: " << manifest << endl;
+            exit(EXIT_FAILURE);
+        }
+        string_view rest = list.view();
+        while (!rest.empty()) {
+            const size_t end = min(rest.find('\n'), rest.size());
+            if (end > 0) {
+                inputs.emplace_back(rest.substr(0, end));
+            }
+            rest.remove_prefix(min(end + 1, rest.size()));
+        }
+    }
+
+    if (run_bytecode
+        && (manifest != nullptr || inputs.size() > 1 || serve_socket != nullptr || client_socket != nullptr
+            || cache_dir != nullptr || options.emit_ir || options.print_peephole_stats)) {
+        cerr << "--run takes a single file and no --serve, --client, --cache, --emit-ir or --peephole-stats" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // The diagnostic options report on passes, which a cache hit never runs
+    const bool diagnostics = options.emit_ir || options.time_passes || options.print_stats
+        || options.print_peephole_stats;
+    optional<CompileCache> cache;
+    if (cache_dir != nullptr && !diagnostics) {
+        cache.emplace(cache_dir, cache_mib << 20);
+        if (!cache->open()) {
+            cerr << "Could not use cache directory: " << cache_dir << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    const string config = cache_config(target, options);
+    CompileCache* const cache_ptr = cache.has_value() ? &cache.value() : nullptr;
+
+    if (incremental && serve_socket == nullptr) {
+        cerr << "--incremental applies only to --serve" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (serve_socket != nullptr) {
+        if (!inputs.empty() || manifest != nullptr || client_socket != nullptr || diagnostics) {
+            cerr << "--serve takes no files and no per-compile options" << endl;
+            exit(EXIT_FAILURE);
+        }
+        // Each worker keeps its assembly buffer warm across requests
+        vector<OutputBuffer> buffers(jobs);
+        // With --incremental, the state of each source file by its settings
+        // and path, so compiling one file two ways keeps both. Compiles of
+        // the same file take turns; other files go ahead in parallel. Only
+        // the most recently compiled max_incremental_files are kept, and a
+        // file that was dropped starts again with a full compile.
+        struct IncrementalFile {
+            mutex lock;
+            IncrementalCompiler compiler;
+            // When it was last asked for, under files_lock
+            uint64_t last_used = 0;
+        };
+        constexpr size_t max_incremental_files = 64;
+        mutex files_lock;
+        unordered_map<string, shared_ptr<IncrementalFile>> files;
+        uint64_t file_requests = 0;
+        const auto handle = [&](const unsigned worker, const CompileRequest& request) -> CompileReply {
+            Options request_options;
+            request_options.level = request.level;
+            request_options.peephole_window = request.peephole_window;
+            const OutputPaths paths { request.assembly, request.object, request.executable };
+            const MappedFile source(request.source.c_str());
+            if (!source.is_open()) {
+                return { false, "Could not open file: " + request.source };
+            }
+            try {
+                const string request_config = cache_config(request.target, request_options);
+                if (incremental) {
+                    // Shared, so a file dropped while it compiles lives until it is done
+                    shared_ptr<IncrementalFile> file;
+                    {
+                        const lock_guard<mutex> guard(files_lock);
+                        shared_ptr<IncrementalFile>& entry = files[request_config + '\0' + request.source];
+                        if (entry == nullptr) {
+                            entry = make_shared<IncrementalFile>();
+                        }
+                        entry->last_used = ++file_requests;
+                        file = entry;
+                        if (files.size() > max_incremental_files) {
+                            files.erase(min_element(files.begin(), files.end(), [](const auto& a, const auto& b) {
+                                return a.second->last_used < b.second->last_used;
+                            }));
+                        }
+                    }
+                    const lock_guard<mutex> guard(file->lock);
+                    with_backend(request.target, [&](auto backend) {
+                        compile_incremental<decltype(backend)>(file->compiler, source.view(), request_options, paths,
+                            buffers[worker], cache_ptr, request_config);
+                    });
+                }
+                else {
+                    with_backend(request.target, [&](auto backend) {
+                        compile_source<decltype(backend)>(source.view(), request_options, paths, buffers[worker],
+                            cache_ptr, request_config);
+                    });
+                }
+            }
+            catch (const CompileError& error) {
+                return { false, error.what() };
+            }
+            return { true, "" };
+        };
+        if (!compile_server::serve(serve_socket, jobs, handle)) {
+            cerr << "Could not listen on socket: " << serve_socket << endl;
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    if (manifest != nullptr || inputs.size() > 1) {
+        if (client_socket != nullptr) {
+            cerr << "--client takes a single file" << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (diagnostics) {
+            cerr << "--emit-ir, --time-passes, --stats and --peephole-stats take a single file" << endl;
+            exit(EXIT_FAILURE);
+        }
+        // Two inputs writing the same outputs would overwrite each other
+        vector<string> executables;
+        for (const string& input : inputs) {
+            executables.push_back(batch_paths(input).executable);
+        }
+        sort(executables.begin(), executables.end());
+        const auto clash = adjacent_find(executables.begin(), executables.end());
+        if (clash != executables.end()) {
+            cerr << "Inputs would share the output: " << *clash << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        bool ok = false;
+        with_backend(target, [&](auto backend) {
+            ok = compile_batch<decltype(backend)>(inputs, options, jobs, cache_ptr, config);
+        });
+        if (cache.has_value() && print_cache_stats_after) {
+            print_cache_stats(cache.value());
+        }
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (inputs.size() != 1) {
+        cerr << "Incorrect number of arguments" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (run_bytecode) {
+        const MappedFile source(inputs.front().c_str());
+        if (!source.is_open()) {
+            cerr << "Could not open file: " << inputs.front() << endl;
+            exit(EXIT_FAILURE);
+        }
+        try {
+            run_in_process(parse_source(source.view()), options);
+        }
+        catch (const CompileError& error) {
+            cerr << error.what() << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (client_socket != nullptr) {
+        if (diagnostics || cache_dir != nullptr) {
+            cerr << "--client passes on only the target and optimisation options" << endl;
+            exit(EXIT_FAILURE);
+        }
+        // The server may run anywhere, so every path it is given is absolute
+        const unique_ptr<char, void (*)(void*)> cwd(getcwd(nullptr, 0), free);
+        if (cwd == nullptr) {
+            cerr << "Could not find the working directory" << endl;
+            exit(EXIT_FAILURE);
+        }
+        const string dir = string(cwd.get()) + "/";
+        const string& input = inputs.front();
+        const OutputPaths paths;
+        const CompileRequest request { target, options.level, options.peephole_window,
+            input.front() == '/' ? input : dir + input, dir + paths.assembly, dir + paths.object,
+            dir + paths.executable };
+        const optional<CompileReply> reply = compile_server::send(client_socket, request);
+        if (!reply.has_value()) {
+            cerr << "Could not reach the compile server at: " << client_socket << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!reply->ok) {
+            cerr << reply->message << endl;
+            exit(EXIT_FAILURE);
+        }
+        run_out();
+    }
+
+    // Tokens and AST nodes point into this mapping, so it lives for the whole compilation.
+    const MappedFile source(inputs.front().c_str());
+    if (!source.is_open()) {
+        cerr << "Could not open file: " << inputs.front() << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    OutputBuffer assembly;
+    try {
+        with_backend(target, [&](auto backend) {
+            compile_source<decltype(backend)>(source.view(), options, {}, assembly, cache_ptr, config);
+        });
+    }
+    catch (const CompileError& error) {
+        cerr << error.what() << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (cache.has_value() && print_cache_stats_after) {
+        print_cache_stats(cache.value());
+    }
+
+    run_out();
 }
\ No newline at end of file
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a source file. Tokens hold string_views into
+// this mapping, so it must outlive every Token, AST node and the Generator.
+class MappedFile final {
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const char* path)
+    {
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st {};
+        if (::fstat(fd, &st) == 0) {
+            m_size = static_cast<std::size_t>(st.st_size);
+            m_open = true;
+            // mmap rejects zero-length mappings; an empty file is just an empty view
+            if (m_size > 0) {
+                void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    m_size = 0;
+                    m_open = false;
+                }
+                else {
+                    m_data = static_cast<const char*>(data);
+                    ::madvise(data, m_size, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        ::close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+        : m_data { std::exchange(other.m_data, nullptr) }
+        , m_size { std::exchange(other.m_size, 0) }
+        , m_open { std::exchange(other.m_open, false) }
+    {
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_open, other.m_open);
+        return *this;
+    }
+
+    [[nodiscard]] bool is_open() const
+    {
+        return m_open;
+    }
+
+    [[nodiscard]] std::string_view view() const
+    {
+        return { m_data, m_size };
+    }
+
+    ~MappedFile()
+    {
+        if (m_data != nullptr) {
+            ::munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+
+private:
+    const char* m_data = nullptr;
+    std::size_t m_size = 0;
+    bool m_open = false;
+};
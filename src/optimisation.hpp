@@ -0,0 +1,369 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "parser.hpp"
+#include "symbols.hpp"
+
+// Folds constant subexpressions in place and propagates the values of
+// variables through `var` and assignment statements for as long as they are
+// known. Arithmetic is the target's: 64-bit wrapping, with unsigned division
+// where x / 0 is 0 (as udiv gives).
+//
+// Runs after NameResolver, so every name it sees is declared.
+class ConstantFolder {
+public:
+    inline explicit ConstantFolder(NodeProg& prog)
+        : m_prog(prog)
+        , m_values(prog.symbols.size())
+    {
+    }
+
+    void fold_prog()
+    {
+        fold_stmts(m_prog.body);
+    }
+
+private:
+    struct Value {
+        bool known;
+        uint64_t value;
+    };
+
+    void fold_stmts(const NodeScope& scope)
+    {
+        for (NodeIndex i = 0; i < scope.count; i++) {
+            fold_stmt(m_prog.scope_stmts[scope.first + i]);
+        }
+    }
+
+    void fold_scope(const NodeScope& scope)
+    {
+        m_values.begin_scope();
+        fold_stmts(scope);
+        m_values.end_scope();
+    }
+
+    // Runs one arm of an if, then puts back the values it assigned, since the
+    // next arm starts from the state before the if. The symbols it assigned
+    // are appended to `assigned`.
+    void fold_arm(const NodeScope& scope, std::vector<SymbolId>& assigned)
+    {
+        const size_t mark = m_assign_log.size();
+        fold_scope(scope);
+        while (m_assign_log.size() > mark) {
+            const auto [sym, previous] = m_assign_log.back();
+            m_assign_log.pop_back();
+            if (Value* value = m_values.lookup(sym)) {
+                *value = previous;
+                assigned.push_back(sym);
+            }
+        }
+    }
+
+    void fold_stmt(const NodeIndex index)
+    {
+        const NodeStmt& stmt = m_prog.stmts[index];
+        switch (stmt.kind) {
+        case StmtKind::exit:
+            fold_expr(m_prog.exits[stmt.index].expr);
+            return;
+        case StmtKind::var: {
+            const NodeStmtVar& stmt_var = m_prog.vars[stmt.index];
+            m_values.declare(stmt_var.sym, fold_expr(stmt_var.expr));
+            return;
+        }
+        case StmtKind::assign: {
+            const NodeStmtAssign& stmt_assign = m_prog.assigns[stmt.index];
+            const Value result = fold_expr(stmt_assign.expr);
+            assign(stmt_assign.sym, result);
+            return;
+        }
+        case StmtKind::scope:
+            fold_scope(m_prog.scopes[stmt.index]);
+            return;
+        case StmtKind::if_: {
+            const NodeStmtIf& stmt_if = m_prog.ifs[stmt.index];
+            std::vector<SymbolId> assigned;
+            fold_expr(stmt_if.expr);
+            fold_arm(m_prog.scopes[stmt_if.scope], assigned);
+            for (NodeIndex pred = stmt_if.pred; pred != no_node; pred = m_prog.preds[pred].pred) {
+                const NodeIfPred& if_pred = m_prog.preds[pred];
+                if (if_pred.kind == IfPredKind::elif) {
+                    fold_expr(if_pred.expr);
+                }
+                fold_arm(m_prog.scopes[if_pred.scope], assigned);
+            }
+            // Which arm ran is not known, so anything an arm assigned is not either
+            for (const SymbolId sym : assigned) {
+                assign(sym, { false, 0 });
+            }
+            return;
+        }
+        }
+    }
+
+    void assign(const SymbolId sym, const Value result)
+    {
+        if (Value* value = m_values.lookup(sym)) {
+            m_assign_log.emplace_back(sym, *value);
+            *value = result;
+        }
+    }
+
+    // Folds the expression rooted at `root` and returns its value if it is
+    // now a literal. Post-order over an explicit stack, like the Generator.
+    Value fold_expr(const NodeIndex root)
+    {
+        m_pending.clear();
+        m_pending.emplace_back(root, false);
+        while (!m_pending.empty()) {
+            const auto [index, operands_done] = m_pending.back();
+            m_pending.pop_back();
+            NodeExpr& expr = m_prog.exprs[index];
+            switch (expr.kind) {
+            case ExprKind::int_lit:
+                break;
+            case ExprKind::ident:
+                if (const Value* value = m_values.lookup(expr.lhs); value != nullptr && value->known) {
+                    expr = make_literal(value->value);
+                }
+                break;
+            case ExprKind::add:
+            case ExprKind::sub:
+            case ExprKind::multi:
+            case ExprKind::div:
+                if (!operands_done) {
+                    m_pending.emplace_back(index, true);
+                    m_pending.emplace_back(expr.lhs, false);
+                    m_pending.emplace_back(expr.rhs, false);
+                }
+                else if (const NodeExpr &lhs = m_prog.exprs[expr.lhs], &rhs = m_prog.exprs[expr.rhs];
+                         lhs.kind == ExprKind::int_lit && rhs.kind == ExprKind::int_lit) {
+                    // The operands are now unreachable, so the lhs literal slot is reused
+                    const NodeIndex slot = lhs.lhs;
+                    m_prog.literals[slot] = static_cast<int64_t>(apply(expr.kind, literal(lhs), literal(rhs)));
+                    expr = { ExprKind::int_lit, slot, no_node };
+                }
+                break;
+            }
+        }
+        const NodeExpr& result = m_prog.exprs[root];
+        if (result.kind == ExprKind::int_lit) {
+            return { true, literal(result) };
+        }
+        return { false, 0 };
+    }
+
+    static uint64_t apply(const ExprKind kind, const uint64_t lhs, const uint64_t rhs)
+    {
+        switch (kind) {
+        case ExprKind::add:
+            return lhs + rhs;
+        case ExprKind::sub:
+            return lhs - rhs;
+        case ExprKind::multi:
+            return lhs * rhs;
+        case ExprKind::div:
+            return rhs == 0 ? 0 : lhs / rhs;
+        default:
+            assert(false); // Unreachable
+            return 0;
+        }
+    }
+
+    [[nodiscard]] uint64_t literal(const NodeExpr& expr) const
+    {
+        return static_cast<uint64_t>(m_prog.literals[expr.lhs]);
+    }
+
+    NodeExpr make_literal(const uint64_t value)
+    {
+        m_prog.literals.push_back(static_cast<int64_t>(value));
+        return { ExprKind::int_lit, static_cast<NodeIndex>(m_prog.literals.size() - 1), no_node };
+    }
+
+    NodeProg& m_prog;
+    ScopedSymbolTable<Value> m_values;
+    // (symbol, value before the assignment) for every assignment so far
+    std::vector<std::pair<SymbolId, Value>> m_assign_log {};
+    std::vector<std::pair<NodeIndex, bool>> m_pending {};
+};
+
+// Removes code that can never run, after ConstantFolder has turned whatever
+// predicates it could into literals:
+//   - if/elif arms whose predicate is 0 are dropped, and an arm whose
+//     predicate is non-zero becomes the last one, taken unconditionally;
+//   - an if left with only an unconditional arm becomes a plain scope, and
+//     one left with no arms disappears;
+//   - statements after an exit, or after anything every path of which exits,
+//     are dropped up to the end of their scope.
+// Scope lists are compacted in place; dropped nodes are simply left behind.
+class DeadCodeEliminator {
+public:
+    inline explicit DeadCodeEliminator(NodeProg& prog)
+        : m_prog(prog)
+    {
+    }
+
+    // Returns how many statements were removed, counting the statements
+    // nested inside removed ones
+    size_t eliminate_prog()
+    {
+        eliminate_stmts(m_prog.body);
+        return m_removed;
+    }
+
+private:
+    // Returns whether the scope always exits
+    bool eliminate_stmts(NodeScope& scope)
+    {
+        NodeIndex kept = 0;
+        bool exits = false;
+        for (NodeIndex i = 0; i < scope.count; i++) {
+            const NodeIndex stmt = m_prog.scope_stmts[scope.first + i];
+            if (exits) {
+                m_removed += count_stmts(stmt);
+                continue;
+            }
+            const std::optional<bool> stmt_exits = eliminate_stmt(stmt);
+            if (!stmt_exits.has_value()) {
+                continue;
+            }
+            m_prog.scope_stmts[scope.first + kept++] = stmt;
+            exits = stmt_exits.value();
+        }
+        scope.count = kept;
+        return exits;
+    }
+
+    // Simplifies the statement in place. Returns whether it always exits, or
+    // nothing if the statement itself is gone.
+    std::optional<bool> eliminate_stmt(const NodeIndex index)
+    {
+        NodeStmt& stmt = m_prog.stmts[index];
+        switch (stmt.kind) {
+        case StmtKind::exit:
+            return true;
+        case StmtKind::var:
+        case StmtKind::assign:
+            return false;
+        case StmtKind::scope:
+            return eliminate_stmts(m_prog.scopes[stmt.index]);
+        case StmtKind::if_:
+            return eliminate_if(stmt);
+        }
+        return false;
+    }
+
+    struct Arm {
+        // Predicate, or no_node if the arm is taken unconditionally
+        NodeIndex expr;
+        NodeIndex scope;
+        // The elif/else node the arm came from, or no_node for the if itself
+        NodeIndex pred;
+    };
+
+    std::optional<bool> eliminate_if(NodeStmt& stmt)
+    {
+        NodeStmtIf& stmt_if = m_prog.ifs[stmt.index];
+        // Arms that can still run, in order; only the last may be unconditional
+        std::vector<Arm> arms;
+        bool pruning = false;
+        auto add_arm = [&](const NodeIndex expr, const NodeIndex scope, const NodeIndex pred) {
+            if (pruning) {
+                m_removed += count_scope(m_prog.scopes[scope]);
+                return;
+            }
+            const std::optional<uint64_t> value = expr == no_node ? std::optional<uint64_t>(1) : literal_value(expr);
+            if (value == 0) {
+                m_removed += count_scope(m_prog.scopes[scope]);
+                return;
+            }
+            arms.push_back({ value.has_value() ? no_node : expr, scope, pred });
+            pruning = value.has_value();
+        };
+        add_arm(stmt_if.expr, stmt_if.scope, no_node);
+        for (NodeIndex pred = stmt_if.pred; pred != no_node; pred = m_prog.preds[pred].pred) {
+            const NodeIfPred& if_pred = m_prog.preds[pred];
+            add_arm(if_pred.kind == IfPredKind::elif ? if_pred.expr : no_node, if_pred.scope, pred);
+        }
+
+        if (arms.empty()) {
+            m_removed++;
+            return {};
+        }
+        bool exits = true;
+        for (const Arm& arm : arms) {
+            exits = eliminate_stmts(m_prog.scopes[arm.scope]) && exits;
+        }
+        // Without an unconditional arm, control can fall through the if
+        exits = exits && arms.back().expr == no_node;
+
+        if (arms.front().expr == no_node) {
+            stmt = { StmtKind::scope, arms.front().scope };
+            return exits;
+        }
+        // Relink the surviving arms: the first one is the if itself, the rest
+        // reuse their own elif/else nodes
+        stmt_if.expr = arms.front().expr;
+        stmt_if.scope = arms.front().scope;
+        NodeIndex* link = &stmt_if.pred;
+        for (size_t i = 1; i < arms.size(); i++) {
+            NodeIfPred& if_pred = m_prog.preds[arms[i].pred];
+            if_pred.kind = arms[i].expr == no_node ? IfPredKind::else_ : IfPredKind::elif;
+            if_pred.expr = arms[i].expr;
+            *link = arms[i].pred;
+            link = &if_pred.pred;
+        }
+        *link = no_node;
+        return exits;
+    }
+
+    [[nodiscard]] std::optional<uint64_t> literal_value(const NodeIndex expr) const
+    {
+        const NodeExpr& node = m_prog.exprs[expr];
+        if (node.kind != ExprKind::int_lit) {
+            return {};
+        }
+        return static_cast<uint64_t>(m_prog.literals[node.lhs]);
+    }
+
+    [[nodiscard]] size_t count_scope(const NodeScope& scope) const
+    {
+        size_t count = 0;
+        for (NodeIndex i = 0; i < scope.count; i++) {
+            count += count_stmts(m_prog.scope_stmts[scope.first + i]);
+        }
+        return count;
+    }
+
+    // The statement plus everything nested in it
+    [[nodiscard]] size_t count_stmts(const NodeIndex index) const
+    {
+        const NodeStmt& stmt = m_prog.stmts[index];
+        switch (stmt.kind) {
+        case StmtKind::exit:
+        case StmtKind::var:
+        case StmtKind::assign:
+            return 1;
+        case StmtKind::scope:
+            return 1 + count_scope(m_prog.scopes[stmt.index]);
+        case StmtKind::if_: {
+            const NodeStmtIf& stmt_if = m_prog.ifs[stmt.index];
+            size_t count = 1 + count_scope(m_prog.scopes[stmt_if.scope]);
+            for (NodeIndex pred = stmt_if.pred; pred != no_node; pred = m_prog.preds[pred].pred) {
+                count += count_scope(m_prog.scopes[m_prog.preds[pred].scope]);
+            }
+            return count;
+        }
+        }
+        return 0;
+    }
+
+    NodeProg& m_prog;
+    size_t m_removed = 0;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Append-only byte buffer for generated text. It grows by doubling from a
+// caller's size estimate, formats integers in place with std::to_chars, and
+// goes to its file in one write, with no stream or locale in between.
+class OutputBuffer final {
+public:
+    explicit OutputBuffer(const std::size_t capacity = 0)
+    {
+        reserve(capacity);
+    }
+
+    void reserve(const std::size_t capacity)
+    {
+        if (capacity <= m_capacity) {
+            return;
+        }
+        std::unique_ptr<char[]> data(new char[capacity]);
+        if (m_size > 0) {
+            std::memcpy(data.get(), m_data.get(), m_size);
+        }
+        m_data = std::move(data);
+        m_capacity = capacity;
+    }
+
+    // Empties the buffer but keeps its memory for the next use
+    void clear()
+    {
+        m_size = 0;
+    }
+
+    void append(const std::string_view text)
+    {
+        make_room(text.size());
+        std::memcpy(m_data.get() + m_size, text.data(), text.size());
+        m_size += text.size();
+    }
+
+    void append(const char c)
+    {
+        make_room(1);
+        m_data[m_size++] = c;
+    }
+
+    void append_uint(const uint64_t value)
+    {
+        // The widest uint64_t is 20 digits
+        make_room(20);
+        const std::to_chars_result result = std::to_chars(m_data.get() + m_size, m_data.get() + m_capacity, value);
+        m_size = static_cast<std::size_t>(result.ptr - m_data.get());
+    }
+
+    void append_hex(const uint64_t value)
+    {
+        make_room(16);
+        const std::to_chars_result result
+            = std::to_chars(m_data.get() + m_size, m_data.get() + m_capacity, value, 16);
+        m_size = static_cast<std::size_t>(result.ptr - m_data.get());
+    }
+
+    [[nodiscard]] std::string_view view() const
+    {
+        return { m_data.get(), m_size };
+    }
+
+    [[nodiscard]] std::size_t size() const
+    {
+        return m_size;
+    }
+
+    // Replaces the file at `path` with the contents. Returns false if it
+    // could not be written.
+    bool write_to(const char* path) const
+    {
+        const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = true;
+        for (std::size_t done = 0; ok && done < m_size;) {
+            const ssize_t written = ::write(fd, m_data.get() + done, m_size - done);
+            ok = written > 0;
+            done += ok ? static_cast<std::size_t>(written) : 0;
+        }
+        return ::close(fd) == 0 && ok;
+    }
+
+private:
+    void make_room(const std::size_t bytes)
+    {
+        if (m_size + bytes > m_capacity) {
+            reserve(std::max(m_capacity * 2, m_size + bytes));
+        }
+    }
+
+    std::unique_ptr<char[]> m_data {};
+    std::size_t m_size = 0;
+    std::size_t m_capacity = 0;
+};
@@ -1,351 +1,306 @@
 #pragma once
 
 #include <vector> 
-#include <variant>
 #include <cassert>
+#include "compile_error.hpp"
 #include "tokenisation.hpp" 
-#include "arena.hpp"
-
-struct NodeTermIntLit {
-    Token int_lit;
-};
-
-struct NodeTermIdent {
-    Token ident;
-};
-
-struct NodeExpr;
-
-struct NodeTermParen {
-    NodeExpr* expr;
-};
-
-struct NodeBinExprAdd {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-struct NodeBinExprMulti {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-struct NodeBinExprSub {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
+#include "symbols.hpp"
+
+// The AST is a set of flat, typed node arrays owned by NodeProg. Nodes refer to
+// each other by 32-bit index instead of by pointer, and each statement or
+// expression starts with a one-byte tag saying which array (or operator) it is.
+using NodeIndex = uint32_t;
+
+// Marks an absent optional child
+constexpr NodeIndex no_node = UINT32_MAX;
+
+enum class ExprKind : uint8_t {
+    int_lit,
+    ident,
+    add,
+    sub,
+    multi,
+    div
 };
 
-struct NodeBinExprDiv {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprMulti*, NodeBinExprSub*, NodeBinExprDiv*> var;
-};
-
-struct NodeTerm {
-    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*> var;
+// Parentheses only group, so they leave no node behind.
+struct NodeExpr {
+    ExprKind kind;
+    // add/sub/multi/div: the operand expressions.
+    // int_lit: lhs indexes NodeProg::literals. ident: lhs is the SymbolId.
+    NodeIndex lhs;
+    NodeIndex rhs;
 };
 
-struct NodeExpr {
-    std::variant<NodeTerm*, NodeBinExpr*> var;
+// A run of statements, stored contiguously in NodeProg::scope_stmts
+struct NodeScope {
+    NodeIndex first;
+    NodeIndex count;
 };
 
 struct NodeStmtExit {
-    NodeExpr* expr;
+    NodeIndex expr;
 };
 
 struct NodeStmtVar {
-    Token ident;
-    NodeExpr* expr;
-};
-
-struct NodeStmt;
-
-struct NodeScope {
-    std::vector<NodeStmt*> stmts;
+    SymbolId sym;
+    NodeIndex expr;
 };
 
-struct NodeIfPred;
-
-struct NodeIfPredElif {
-    NodeExpr* expr{};
-    NodeScope* scope;
-    std::optional<NodeIfPred*> pred;
+struct NodeStmtAssign {
+    SymbolId sym;
+    NodeIndex expr;
 };
 
-struct NodeIfPredElse {
-    NodeScope* scope;
+enum class IfPredKind : uint8_t {
+    elif,
+    else_
 };
 
 struct NodeIfPred {
-    std::variant<NodeIfPredElif*, NodeIfPredElse*> var;
+    IfPredKind kind;
+    // Condition of an elif; unused for else
+    NodeIndex expr;
+    NodeIndex scope;
+    // The elif/else that follows an elif, or no_node
+    NodeIndex pred;
 };
 
 struct NodeStmtIf {
-    NodeExpr* expr;
-    NodeScope* scope;
-    std::optional<NodeIfPred*> pred;
+    NodeIndex expr;
+    NodeIndex scope;
+    // First elif/else, or no_node
+    NodeIndex pred;
 };
 
-struct NodeStmtAssign {
-    Token ident;
-    NodeExpr* expr{};
+enum class StmtKind : uint8_t {
+    exit,
+    var,
+    scope,
+    if_,
+    assign
 };
 
+// Tag plus index into the array for that kind of statement
 struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtVar*, NodeScope*, NodeStmtIf*, NodeStmtAssign*> var;
+    StmtKind kind;
+    NodeIndex index;
 };
 
+// Each node array is a plain vector: growing one reallocates and frees its old
+// buffer, which an arena bump allocator cannot do once several arrays interleave.
+// The nodes are trivially destructible, so dropping a NodeProg is one free per
+// array however large the program is.
 struct NodeProg {
-    std::vector<NodeStmt*> stmts;
+    // Top-level statements
+    NodeScope body {};
+
+    std::vector<NodeExpr> exprs;
+    std::vector<int64_t> literals;
+    std::vector<NodeStmt> stmts;
+    std::vector<NodeIndex> scope_stmts;
+    std::vector<NodeScope> scopes;
+    std::vector<NodeStmtExit> exits;
+    std::vector<NodeStmtVar> vars;
+    std::vector<NodeStmtAssign> assigns;
+    std::vector<NodeStmtIf> ifs;
+    std::vector<NodeIfPred> preds;
+
+    // Spellings of every SymbolId in the tree
+    Interner symbols;
 };
 
 class Parser {
 public:
-    inline explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens))
-        , m_allocator(1024 * 1024 * 4)
+    inline Parser(TokenBuffer tokens, const std::string_view src)
+        : m_tokens(std::move(tokens), src)
+    {
+    }
+
+    // Streaming mode: tokens are pulled from the tokeniser as the parser needs
+    // them instead of being materialised up front
+    inline explicit Parser(Tokeniser& tokeniser)
+        : m_tokens(tokeniser)
     {
     }
 
     void error_expected(const std::string& msg) {
-        std::cerr << "[Parser Error] Expected " << msg << " on line " << peek(-1).value().line << std::endl;
-        exit(EXIT_FAILURE);
+        throw CompileError("[Parser Error] Expected " + msg + " on line "
+            + std::to_string(m_index > 0 ? m_tokens.line(m_index - 1) : 1));
     }
 
-    std::optional<NodeTerm*> parse_term()
+    std::optional<NodeIndex> parse_term()
     {
         if (auto int_lit = try_consume(TokenType::int_lit)) {
-            auto term_int_lit = m_allocator.alloc<NodeTermIntLit>();
-            term_int_lit->int_lit = int_lit.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_int_lit;
-            return term;
+            const auto literal = static_cast<NodeIndex>(m_prog.literals.size());
+            m_prog.literals.push_back(m_tokens.value(int_lit.value()));
+            return add_expr({ ExprKind::int_lit, literal, no_node });
         }
         else if (auto ident = try_consume(TokenType::ident)) {
-            auto expr_ident = m_allocator.alloc<NodeTermIdent>();
-            expr_ident->ident = ident.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = expr_ident;
-            return term;
-        }
-        else if (auto open_paren = try_consume(TokenType::open_paren)) {
-            auto expr = parse_expr();
-            if (!expr.has_value()) {
-                error_expected("expression");
-            }
-            try_consume_err(TokenType::close_paren);
-            auto term_paren = m_allocator.alloc<NodeTermParen>();
-            term_paren->expr = expr.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_paren;
-            return term;
+            const SymbolId sym = m_prog.symbols.intern(m_tokens.text(ident.value()));
+            return add_expr({ ExprKind::ident, sym, no_node });
         }
         else {
             return {};
         }
     }
 
-    std::optional<NodeExpr*> parse_expr(int min_prec = 0)
+    // Precedence climbing over explicit operand and operator stacks rather than
+    // the native call stack, so nesting depth is bounded only by heap memory
+    std::optional<NodeIndex> parse_expr()
     {
-        std::optional<NodeTerm*> term_lhs = parse_term();
-        if (!term_lhs.has_value()) {
-            return {};
-        }
-        auto expr_lhs = m_allocator.alloc<NodeExpr>();
-        expr_lhs->var = term_lhs.value();
-
+        m_operands.clear();
+        m_operators.clear();
         while (true) {
-            std::optional<Token> curr_tok = peek();
-            std::optional<int> prec;
-            if (curr_tok.has_value()) {
-                prec = bin_prec(curr_tok->type);
-                if (!prec.has_value() || prec < min_prec) {
-                    break;
-                }
+            while (try_consume(TokenType::open_paren)) {
+                m_operators.push_back({ ExprKind {}, open_paren_prec });
             }
-            else {
-                break;
-            }
-            const auto [type, line, value] = consume();
-            const int next_min_prec = prec.value() + 1;
-            auto expr_rhs = parse_expr(next_min_prec);
-            if (!expr_rhs.has_value()) {
-                error_expected("expression");
+            if (const auto term = parse_term()) {
+                m_operands.push_back(term.value());
             }
-            auto expr = m_allocator.alloc<NodeBinExpr>();
-            auto expr_lhs2 = m_allocator.alloc<NodeExpr>();
-            if (type == TokenType::plus) {
-                auto add = m_allocator.alloc<NodeBinExprAdd>();
-                expr_lhs2->var = expr_lhs->var;
-                add->lhs = expr_lhs2;
-                add->rhs = expr_rhs.value();
-                expr->var = add;
-            }
-            else if (type == TokenType::star) {
-                auto multi = m_allocator.alloc<NodeBinExprMulti>();
-                expr_lhs2->var = expr_lhs->var;
-                multi->lhs = expr_lhs2;
-                multi->rhs = expr_rhs.value();
-                expr->var = multi;
-            }
-            else if (type == TokenType::sub) {
-                auto sub = m_allocator.alloc<NodeBinExprSub>();
-                expr_lhs2->var = expr_lhs->var;
-                sub->lhs = expr_lhs2;
-                sub->rhs = expr_rhs.value();
-                expr->var = sub;
-            }
-            else if (type == TokenType::div) {
-                auto div = m_allocator.alloc<NodeBinExprDiv>();
-                expr_lhs2->var = expr_lhs->var;
-                div->lhs = expr_lhs2;
-                div->rhs = expr_rhs.value();
-                expr->var = div;
+            else if (m_operators.empty()) {
+                return {};
             }
             else {
-                assert(false); // Unreachable;
+                error_expected("expression");
+            }
+
+            // After an operand: either an operator follows, or the innermost
+            // parenthesis (or the whole expression) ends here
+            while (true) {
+                const std::optional<TokenType> curr_tok = peek();
+                const std::optional<int> prec = curr_tok.has_value() ? bin_prec(curr_tok.value()) : std::nullopt;
+                if (prec.has_value()) {
+                    // Operators are left-associative, so reduce equal precedence too
+                    reduce_operators(prec.value());
+                    m_operators.push_back({ bin_expr_kind(m_tokens.type(consume())), prec.value() });
+                    break;
+                }
+                reduce_operators(open_paren_prec + 1);
+                if (m_operators.empty()) {
+                    return m_operands.back();
+                }
+                m_operators.pop_back();
+                try_consume_err(TokenType::close_paren);
             }
-            expr_lhs->var = expr;
         }
-        return expr_lhs;
     }
-    std::optional<NodeScope*> parse_scope() {
+
+    std::optional<NodeIndex> parse_scope() {
         if (!try_consume(TokenType::open_brace).has_value()) {
             return {};
         }
-        auto scope = m_allocator.alloc<NodeScope>();
+        const size_t mark = m_stmt_stack.size();
         while (auto stmt = parse_stmt()) {
-            scope->stmts.push_back(stmt.value());
+            m_stmt_stack.push_back(stmt.value());
         }
         try_consume_err(TokenType::close_brace);
+        const auto scope = static_cast<NodeIndex>(m_prog.scopes.size());
+        m_prog.scopes.push_back(pop_stmts(mark));
         return scope;
     }
 
-    std::optional<NodeIfPred*> parse_if_pred() {
+    std::optional<NodeIndex> parse_if_pred() {
         if (try_consume(TokenType::elif)) {
             try_consume_err(TokenType::open_paren);
-            const auto elif = m_allocator.alloc<NodeIfPredElif>();
+            NodeIfPred elif { IfPredKind::elif, no_node, no_node, no_node };
             if (const auto expr = parse_expr()) {
-                elif->expr = expr.value();
+                elif.expr = expr.value();
             }
             else {
                 error_expected("expression");
             }
             try_consume_err(TokenType::close_paren);
             if (const auto scope = parse_scope()) {
-                elif->scope = scope.value();
+                elif.scope = scope.value();
             }
             else {
                 error_expected("scope");
             }
-            elif->pred = parse_if_pred();
-            auto pred = m_allocator.emplace<NodeIfPred>(elif);
-            return pred;
+            elif.pred = parse_if_pred().value_or(no_node);
+            return add(m_prog.preds, elif);
         }
         if (try_consume(TokenType::else_)) {
-            auto else_ = m_allocator.alloc<NodeIfPredElse>();
+            NodeIfPred else_ { IfPredKind::else_, no_node, no_node, no_node };
             if (const auto scope = parse_scope()) {
-                else_->scope = scope.value();
+                else_.scope = scope.value();
             }
             else {
                 error_expected("scope");
             }
-            auto pred = m_allocator.emplace<NodeIfPred>(else_);
-            return pred;
+            return add(m_prog.preds, else_);
         }
         return {};
         
     }
 
-    std::optional<NodeStmt*> parse_stmt()
+    std::optional<NodeIndex> parse_stmt()
     {
-        if (peek().has_value() && peek().value().type == TokenType::_exit && peek(1).has_value()
-            && peek(1).value().type == TokenType::open_paren) {
+        if (peek() == TokenType::_exit && peek(1) == TokenType::open_paren) {
             consume();
             consume();
-            auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
+            NodeStmtExit stmt_exit {};
             if (auto node_expr = parse_expr()) {
-                stmt_exit->expr = node_expr.value();
+                stmt_exit.expr = node_expr.value();
             }
             else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid expression");
             }
             try_consume_err(TokenType::close_paren);
             try_consume_err(TokenType::semi);
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_exit;
-            return stmt;
+            return add_stmt(StmtKind::exit, add(m_prog.exits, stmt_exit));
         }
-        if (
-            peek().has_value() && peek().value().type == TokenType::var && peek(1).has_value()
-            && peek(1).value().type == TokenType::ident && peek(2).has_value()
-            && peek(2).value().type == TokenType::eq) {
+        if (peek() == TokenType::var && peek(1) == TokenType::ident && peek(2) == TokenType::eq) {
             consume();
-            auto stmt_var  = m_allocator.alloc<NodeStmtVar>();
-            stmt_var->ident = consume();
+            NodeStmtVar stmt_var {};
+            stmt_var.sym = m_prog.symbols.intern(m_tokens.text(consume()));
             consume();
             if (auto expr = parse_expr()) {
-                stmt_var->expr = expr.value();
+                stmt_var.expr = expr.value();
             }
             else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid expression");
             }
             try_consume_err(TokenType::semi);
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = stmt_var;
-            return stmt;
+            return add_stmt(StmtKind::var, add(m_prog.vars, stmt_var));
         }
-        if (peek().has_value() && peek().value().type == TokenType::ident
-         && peek(1).has_value() && peek(1).value().type == TokenType::eq) {
+        if (peek() == TokenType::ident && peek(1) == TokenType::eq) {
 
-            const auto assign = m_allocator.alloc<NodeStmtAssign>();
-            assign->ident = consume();
+            NodeStmtAssign assign {};
+            assign.sym = m_prog.symbols.intern(m_tokens.text(consume()));
             consume();
             if (const auto expr = parse_expr()) {
-                assign->expr = expr.value();
+                assign.expr = expr.value();
             } else {
                 error_expected("expression");
             }
             try_consume_err(TokenType::semi);
-            auto stmt = m_allocator.emplace<NodeStmt>(assign);
-            return stmt;
+            return add_stmt(StmtKind::assign, add(m_prog.assigns, assign));
         }
-        if (peek().has_value() && peek().value().type == TokenType::open_brace) {
+        if (peek() == TokenType::open_brace) {
             if (auto scope = parse_scope()) {
-                auto stmt = m_allocator.alloc<NodeStmt>(); 
-                stmt->var = scope.value();
-                return stmt;
+                return add_stmt(StmtKind::scope, scope.value());
             } else {
-                std::cerr << "Invalid scope" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid scope");
             }
 
         }
         if (auto if_ = try_consume(TokenType::if_)) {
             try_consume_err(TokenType::open_paren);
-            auto stmt_if = m_allocator.alloc<NodeStmtIf>();
+            NodeStmtIf stmt_if {};
             if (auto expr = parse_expr()) {
-                stmt_if->expr = expr.value();
+                stmt_if.expr = expr.value();
             } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid expression");
             }
             try_consume_err(TokenType::close_paren);
             if (auto scope = parse_scope()) {
-                stmt_if->scope = scope.value();
+                stmt_if.scope = scope.value();
             } else {
-                std::cerr << "Invalid scope" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid scope");
             }
-            stmt_if->pred = parse_if_pred();
-            auto stmt = m_allocator.alloc<NodeStmt>(); 
-            stmt->var = stmt_if;
-            return stmt;
+            stmt_if.pred = parse_if_pred().value_or(no_node);
+            return add_stmt(StmtKind::if_, add(m_prog.ifs, stmt_if));
         } else {
             return {};
         }
@@ -353,47 +308,149 @@ public:
 
     std::optional<NodeProg> parse_prog()
     {
-        NodeProg prog;
         while (peek().has_value()) {
             if (auto stmt = parse_stmt()) {
-                prog.stmts.push_back(stmt.value());
+                m_stmt_stack.push_back(stmt.value());
             }
             else {
-                std::cerr << "Invalid statement" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid statement");
             }
         }
-        return prog;
+        m_prog.body = pop_stmts(0);
+        return std::move(m_prog);
+    }
+
+    // Parses the next top-level statement as a program of its own, with its own
+    // symbols, for compiling statements separately (see incremental.hpp)
+    NodeProg parse_stmt_prog()
+    {
+        m_prog = {};
+        if (auto stmt = parse_stmt()) {
+            m_stmt_stack.push_back(stmt.value());
+        }
+        else {
+            throw CompileError("Invalid statement");
+        }
+        m_prog.body = pop_stmts(0);
+        return std::move(m_prog);
+    }
+
+    // Where the next token starts, or nothing at the end of the tokens
+    [[nodiscard]] std::optional<uint32_t> next_offset()
+    {
+        if (!m_tokens.has(m_index)) {
+            return {};
+        }
+        return m_tokens.offset(m_index);
+    }
+
+    [[nodiscard]] uint32_t next_line() const
+    {
+        return m_tokens.line(m_index);
+    }
+
+    // Where the last consumed token starts, and its line. Every statement
+    // ends in a one-byte ';' or '}'.
+    [[nodiscard]] uint32_t last_offset() const
+    {
+        return m_tokens.offset(m_index - 1);
+    }
+
+    [[nodiscard]] uint32_t last_line() const
+    {
+        return m_tokens.line(m_index - 1);
     }
 
 private:
-    [[nodiscard]] inline std::optional<Token> peek(int offset = 0) const
+    template <typename Node>
+    static NodeIndex add(std::vector<Node>& nodes, const Node& node)
+    {
+        nodes.push_back(node);
+        return static_cast<NodeIndex>(nodes.size() - 1);
+    }
+
+    NodeIndex add_expr(const NodeExpr& expr)
+    {
+        return add(m_prog.exprs, expr);
+    }
+
+    static ExprKind bin_expr_kind(const TokenType type)
+    {
+        switch (type) {
+        case TokenType::plus:
+            return ExprKind::add;
+        case TokenType::star:
+            return ExprKind::multi;
+        case TokenType::sub:
+            return ExprKind::sub;
+        case TokenType::div:
+            return ExprKind::div;
+        default:
+            assert(false); // Unreachable
+            return ExprKind::add;
+        }
+    }
+
+    // Folds pending operators of precedence `min_prec` or higher into nodes.
+    // An open parenthesis has the lowest precedence, so this never passes one.
+    void reduce_operators(const int min_prec)
+    {
+        while (!m_operators.empty() && m_operators.back().prec >= min_prec) {
+            const NodeIndex rhs = m_operands.back();
+            m_operands.pop_back();
+            const NodeIndex lhs = m_operands.back();
+            m_operands.back() = add_expr({ m_operators.back().kind, lhs, rhs });
+            m_operators.pop_back();
+        }
+    }
+
+    NodeIndex add_stmt(const StmtKind kind, const NodeIndex index)
+    {
+        return add(m_prog.stmts, { kind, index });
+    }
+
+    // Moves the statements pushed since `mark` into one contiguous run of
+    // scope_stmts. Nested scopes finish first, so their runs never interleave.
+    NodeScope pop_stmts(const size_t mark)
+    {
+        const NodeScope scope { static_cast<NodeIndex>(m_prog.scope_stmts.size()),
+            static_cast<NodeIndex>(m_stmt_stack.size() - mark) };
+        m_prog.scope_stmts.insert(m_prog.scope_stmts.end(), m_stmt_stack.begin() + static_cast<std::ptrdiff_t>(mark),
+            m_stmt_stack.end());
+        m_stmt_stack.resize(mark);
+        return scope;
+    }
+
+    // Type of the token `offset` places ahead, or nothing past the end. Only
+    // the 1-byte type is read; the token itself stays in the stream.
+    [[nodiscard]] inline std::optional<TokenType> peek(size_t offset = 0)
     {
-        if (m_index + offset >= m_tokens.size()) {
+        if (!m_tokens.has(m_index + offset)) {
             return {};
         }
         else {
-            return m_tokens.at(m_index + offset);
+            return m_tokens.type(m_index + offset);
         }
     }
 
-    inline Token consume()
+    // Consumes the current token and returns its index in the stream
+    inline size_t consume()
     {
-        return m_tokens.at(m_index++);
+        return m_index++;
     }
 
-    inline Token try_consume_err(TokenType type)
+    inline size_t try_consume_err(TokenType type)
     {
-        if (peek().has_value() && peek().value().type == type) {
+        if (peek() == type) {
             return consume();
         }
         error_expected(to_string(type));
         return {};
     }
 
-    inline std::optional<Token> try_consume(TokenType type)
+    inline std::optional<size_t> try_consume(TokenType type)
     {
-        if (peek().has_value() && peek().value().type == type) {
+        if (peek() == type) {
             return consume();
         }
         else {
@@ -401,7 +458,19 @@ private:
         }
     }
 
-    const std::vector<Token> m_tokens;
+    TokenStream m_tokens;
     size_t m_index = 0;
-    ArenaAllocator m_allocator;
+    NodeProg m_prog;
+    // Statements of the scopes currently being parsed, innermost last
+    std::vector<NodeIndex> m_stmt_stack {};
+
+    struct PendingOperator {
+        ExprKind kind;
+        int prec;
+    };
+    static constexpr int open_paren_prec = 0;
+
+    // Working stacks of parse_expr(), kept to reuse their capacity
+    std::vector<NodeIndex> m_operands {};
+    std::vector<PendingOperator> m_operators {};
 };
\ No newline at end of file
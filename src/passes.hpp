@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// -O0 generates straight from the AST, -O1 folds and prunes the AST first,
+// and -O2 lowers to SSA and optimises the IR before emitting code from it
+enum class OptLevel : uint8_t {
+    o0,
+    o1,
+    o2
+};
+
+// Runs an ordered list of named passes over a unit of code (the AST or an IR
+// function) and records how long each one took
+template <typename Unit>
+class PassManager {
+public:
+    struct Timing {
+        std::string name;
+        std::chrono::nanoseconds elapsed;
+    };
+
+    void add(std::string name, std::function<void(Unit&)> pass)
+    {
+        m_passes.push_back({ std::move(name), std::move(pass) });
+    }
+
+    void run(Unit& unit)
+    {
+        for (const Pass& pass : m_passes) {
+            const auto start = std::chrono::steady_clock::now();
+            pass.run(unit);
+            m_timings.push_back({ pass.name, std::chrono::steady_clock::now() - start });
+        }
+    }
+
+    [[nodiscard]] const std::vector<Timing>& timings() const
+    {
+        return m_timings;
+    }
+
+private:
+    struct Pass {
+        std::string name;
+        std::function<void(Unit&)> run;
+    };
+
+    std::vector<Pass> m_passes {};
+    std::vector<Timing> m_timings {};
+};
+
+// One line per pass, in microseconds, for --time-passes
+template <typename Timing>
+void print_timings(std::ostream& out, const std::vector<Timing>& timings)
+{
+    for (const Timing& timing : timings) {
+        out << "pass " << timing.name << ": "
+            << std::chrono::duration_cast<std::chrono::microseconds>(timing.elapsed).count() << " us\n";
+    }
+}
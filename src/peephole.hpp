@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The rewrites the peephole optimiser knows, which are the same for every
+// instruction set
+struct PeepholeRules {
+    enum Rule : uint8_t {
+        // str xA, [m] ... ldr xB, [m]  ->  str xA, [m] ... mov xB, xA
+        store_load,
+        // ldr xA, [m] ... ldr xB, [m]  ->  ldr xA, [m] ... mov xB, xA
+        load_load,
+        // str xA, [m] ... str xB, [m]  ->  str xB, [m], when [m] is not read between
+        dead_store,
+        // mov xA, #k ... mov xB, xA  ->  mov xA, #k ... mov xB, #k
+        copy_constant,
+        // mov xA, xA  ->  nothing
+        self_move,
+        // add/sub sp, sp, #0  ->  nothing
+        zero_sp_adjust,
+        // sub sp, sp, #n; add sp, sp, #n  ->  nothing
+        cancel_sp_adjust,
+        // cmp xA, #0; beq L  ->  cbz xA, L (test and je on x86-64)
+        compare_branch,
+        // b L; L:  ->  L:
+        branch_to_next,
+        rule_count
+    };
+
+    static constexpr size_t default_window = 8;
+
+    static const char* rule_name(const Rule rule)
+    {
+        switch (rule) {
+        case store_load:
+            return "store-load";
+        case load_load:
+            return "load-load";
+        case dead_store:
+            return "dead-store";
+        case copy_constant:
+            return "copy-constant";
+        case self_move:
+            return "self-move";
+        case zero_sp_adjust:
+            return "zero-sp-adjust";
+        case cancel_sp_adjust:
+            return "cancel-sp-adjust";
+        case compare_branch:
+            return "compare-branch";
+        case branch_to_next:
+            return "branch-to-next";
+        case rule_count:
+            break;
+        }
+        return "";
+    }
+};
+
+// Rewrites short runs of generated instructions into cheaper equivalents.
+// Each rule looks at a window of up to `window` live instructions starting at
+// one position. The optimiser slides the window over the code, and after a
+// rewrite steps back a window's length, since the change may complete an
+// earlier pattern. Deleted instructions become nops until the end. Rules
+// only reason about stack slots addressed as [sp, #imm]: sp is fixed after
+// the prologue, so equal offsets mean the same slot and different offsets
+// never overlap. `Isa` names the instruction set's opcodes for each role (see
+// arm64::Isa).
+template <typename Isa>
+class PeepholeOptimiser : public PeepholeRules {
+public:
+    using Inst = typename Isa::Inst;
+    using Reg = typename Isa::Reg;
+
+    inline explicit PeepholeOptimiser(const size_t window = default_window)
+        : m_window(std::max<size_t>(window, 2))
+    {
+    }
+
+    void optimise(std::vector<Inst>& code)
+    {
+        size_t i = 0;
+        while (i < code.size()) {
+            if (code[i].op == Isa::nop || !fill_window(code, i)) {
+                i++;
+                continue;
+            }
+            bool fired = false;
+            for (uint8_t rule = 0; rule < rule_count && !fired; rule++) {
+                if (apply(static_cast<Rule>(rule), code)) {
+                    m_hits[rule]++;
+                    fired = true;
+                }
+            }
+            if (!fired) {
+                i++;
+                continue;
+            }
+            // The rewrite may complete a pattern that starts up to a window
+            // earlier, so step back that far and look again
+            for (size_t back = 1; back < m_window && i > 0;) {
+                i--;
+                back += code[i].op != Isa::nop ? 1 : 0;
+            }
+        }
+        code.erase(std::remove_if(code.begin(), code.end(),
+                       [](const Inst& inst) { return inst.op == Isa::nop; }),
+            code.end());
+    }
+
+    // Times each rule has fired, indexed by Rule
+    [[nodiscard]] const std::array<size_t, rule_count>& hits() const
+    {
+        return m_hits;
+    }
+
+private:
+    // Collects the window starting at `i`, unless no rule can start with the
+    // instruction there
+    bool fill_window(const std::vector<Inst>& code, size_t i)
+    {
+        switch (code[i].op) {
+        case Isa::store:
+        case Isa::load:
+        case Isa::mov:
+        case Isa::mov_imm:
+        case Isa::add_imm:
+        case Isa::sub_imm:
+        case Isa::cmp_imm:
+        case Isa::jump:
+            break;
+        default:
+            return false;
+        }
+        m_indices.clear();
+        for (; i < code.size() && m_indices.size() < m_window; i++) {
+            if (code[i].op != Isa::nop) {
+                m_indices.push_back(i);
+            }
+        }
+        return true;
+    }
+
+    bool apply(const Rule rule, std::vector<Inst>& code) const
+    {
+        Inst& first = code[m_indices[0]];
+        Inst* second = m_indices.size() > 1 ? &code[m_indices[1]] : nullptr;
+        switch (rule) {
+        case store_load:
+            return first.op == Isa::store && forward(code, first.rd, first.imm);
+        case load_load:
+            return first.op == Isa::load && forward(code, first.rd, first.imm);
+        case dead_store:
+            return first.op == Isa::store && is_slot(first) && kill_store(code, first);
+        case copy_constant:
+            return first.op == Isa::mov_imm && copy_constant_forward(code, first);
+        case self_move:
+            if (first.op == Isa::mov && first.rd == first.rn) {
+                first.op = Isa::nop;
+                return true;
+            }
+            return false;
+        case zero_sp_adjust:
+            if ((first.op == Isa::add_imm || first.op == Isa::sub_imm) && first.rd == Isa::sp
+                && first.imm == 0) {
+                first.op = Isa::nop;
+                return true;
+            }
+            return false;
+        case cancel_sp_adjust:
+            if (second != nullptr && is_sp_adjust(first) && is_sp_adjust(*second) && first.op != second->op
+                && first.imm == second->imm) {
+                first.op = Isa::nop;
+                second->op = Isa::nop;
+                return true;
+            }
+            return false;
+        case compare_branch:
+            if (second != nullptr && first.op == Isa::cmp_imm && first.imm == 0
+                && second->op == Isa::branch_eq) {
+                *second = { Isa::branch_zero, Isa::no_reg, first.rn, Isa::no_reg, 0, second->imm };
+                first.op = Isa::nop;
+                return true;
+            }
+            return false;
+        case branch_to_next:
+            if (first.op != Isa::jump) {
+                return false;
+            }
+            for (size_t k = 1; k < m_indices.size() && code[m_indices[k]].op == Isa::label; k++) {
+                if (code[m_indices[k]].imm == first.imm) {
+                    first.op = Isa::nop;
+                    return true;
+                }
+            }
+            return false;
+        case rule_count:
+            break;
+        }
+        return false;
+    }
+
+    static bool is_slot(const Inst& inst)
+    {
+        return inst.rn == Isa::sp && inst.rm == Isa::no_reg;
+    }
+
+    static bool is_sp_adjust(const Inst& inst)
+    {
+        return (inst.op == Isa::add_imm || inst.op == Isa::sub_imm) && inst.rd == Isa::sp
+            && inst.rn == Isa::sp;
+    }
+
+    // What is known about registers and memory ends with the block
+    static bool ends_block(const Inst& inst)
+    {
+        return Isa::ends_block(inst);
+    }
+
+    // Whether the instruction may write the slot at `offset`
+    static bool may_store(const Inst& inst, const uint64_t offset)
+    {
+        return inst.op == Isa::store && (!is_slot(inst) || inst.imm == offset);
+    }
+
+    // The window starts with an access that leaves slot [sp, #offset] in
+    // `reg`. The first later load of that slot becomes a move from `reg`, as
+    // long as neither the register nor the slot changes first.
+    bool forward(std::vector<Inst>& code, const Reg reg, const uint64_t offset) const
+    {
+        if (!is_slot(code[m_indices[0]])) {
+            return false;
+        }
+        for (size_t k = 1; k < m_indices.size(); k++) {
+            Inst& inst = code[m_indices[k]];
+            if (inst.op == Isa::load && is_slot(inst) && inst.imm == offset) {
+                if (inst.rd == reg) {
+                    inst.op = Isa::nop;
+                }
+                else {
+                    inst = { Isa::mov, inst.rd, reg };
+                }
+                return true;
+            }
+            if (ends_block(inst) || Isa::def(inst) == reg || may_store(inst, offset)) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Deletes the store at the start of the window if the slot is stored to
+    // again before anything could read it
+    bool kill_store(std::vector<Inst>& code, Inst& store) const
+    {
+        for (size_t k = 1; k < m_indices.size(); k++) {
+            const Inst& inst = code[m_indices[k]];
+            if (inst.op == Isa::store && is_slot(inst) && inst.imm == store.imm) {
+                store.op = Isa::nop;
+                return true;
+            }
+            if (ends_block(inst) || (inst.op == Isa::load && (!is_slot(inst) || inst.imm == store.imm))) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // A copy of a register that still holds a small constant becomes a fresh
+    // mov of the constant, so the copy no longer depends on the register
+    bool copy_constant_forward(std::vector<Inst>& code, const Inst& constant) const
+    {
+        for (size_t k = 1; k < m_indices.size(); k++) {
+            Inst& inst = code[m_indices[k]];
+            if (inst.op == Isa::mov && inst.rn == constant.rd) {
+                inst = { Isa::mov_imm, inst.rd, Isa::no_reg, Isa::no_reg, 0, constant.imm };
+                return true;
+            }
+            if (ends_block(inst) || Isa::def(inst) == constant.rd) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    size_t m_window;
+    std::array<size_t, rule_count> m_hits {};
+    std::vector<size_t> m_indices {};
+};
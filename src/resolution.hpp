@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "compile_error.hpp"
+#include "parser.hpp"
+#include "symbols.hpp"
+
+// Checks that every name is declared where it is used and declared only once,
+// before any pass is allowed to drop code. Reports the first problem in the
+// order the Generator emits code: statements in source order, the operands of
+// an operator rhs before lhs.
+class NameResolver {
+public:
+    inline explicit NameResolver(const NodeProg& prog)
+        : m_prog(prog)
+        , m_declared(prog.symbols.size())
+    {
+    }
+
+    // Declares `sym` as if by an earlier statement, for a program that is one
+    // statement compiled on its own
+    void declare_outer(const SymbolId sym)
+    {
+        m_declared.declare(sym, true);
+    }
+
+    void resolve_prog()
+    {
+        resolve_stmts(m_prog.body);
+    }
+
+private:
+    void resolve_stmts(const NodeScope& scope)
+    {
+        for (NodeIndex i = 0; i < scope.count; i++) {
+            resolve_stmt(m_prog.scope_stmts[scope.first + i]);
+        }
+    }
+
+    void resolve_scope(const NodeScope& scope)
+    {
+        m_declared.begin_scope();
+        resolve_stmts(scope);
+        m_declared.end_scope();
+    }
+
+    void resolve_stmt(const NodeIndex index)
+    {
+        const NodeStmt& stmt = m_prog.stmts[index];
+        switch (stmt.kind) {
+        case StmtKind::exit:
+            resolve_expr(m_prog.exits[stmt.index].expr);
+            return;
+        case StmtKind::var: {
+            const NodeStmtVar& stmt_var = m_prog.vars[stmt.index];
+            if (m_declared.lookup(stmt_var.sym) != nullptr) {
+                throw CompileError("Identifier already used: "
+                    + std::string(m_prog.symbols.name(stmt_var.sym)));
+            }
+            // In scope only after its initialiser, so `var x = x;` is undeclared
+            resolve_expr(stmt_var.expr);
+            m_declared.declare(stmt_var.sym, true);
+            return;
+        }
+        case StmtKind::assign: {
+            const NodeStmtAssign& stmt_assign = m_prog.assigns[stmt.index];
+            if (m_declared.lookup(stmt_assign.sym) == nullptr) {
+                throw CompileError("Identifier has not been declared: "
+                    + std::string(m_prog.symbols.name(stmt_assign.sym)));
+            }
+            resolve_expr(stmt_assign.expr);
+            return;
+        }
+        case StmtKind::scope:
+            resolve_scope(m_prog.scopes[stmt.index]);
+            return;
+        case StmtKind::if_: {
+            const NodeStmtIf& stmt_if = m_prog.ifs[stmt.index];
+            resolve_expr(stmt_if.expr);
+            resolve_scope(m_prog.scopes[stmt_if.scope]);
+            for (NodeIndex pred = stmt_if.pred; pred != no_node; pred = m_prog.preds[pred].pred) {
+                const NodeIfPred& if_pred = m_prog.preds[pred];
+                if (if_pred.kind == IfPredKind::elif) {
+                    resolve_expr(if_pred.expr);
+                }
+                resolve_scope(m_prog.scopes[if_pred.scope]);
+            }
+            return;
+        }
+        }
+    }
+
+    void resolve_expr(const NodeIndex root)
+    {
+        m_pending.clear();
+        m_pending.push_back(root);
+        while (!m_pending.empty()) {
+            const NodeExpr& expr = m_prog.exprs[m_pending.back()];
+            m_pending.pop_back();
+            if (expr.kind == ExprKind::ident) {
+                if (m_declared.lookup(expr.lhs) == nullptr) {
+                    throw CompileError("Undeclared identifier: "
+                        + std::string(m_prog.symbols.name(expr.lhs)));
+                }
+            }
+            else if (expr.kind != ExprKind::int_lit) {
+                m_pending.push_back(expr.lhs);
+                m_pending.push_back(expr.rhs);
+            }
+        }
+    }
+
+    const NodeProg& m_prog;
+    ScopedSymbolTable<bool> m_declared;
+    std::vector<NodeIndex> m_pending {};
+};
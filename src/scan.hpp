@@ -0,0 +1,232 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#define MICRO_SCAN_SIMD 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MICRO_SCAN_SIMD 1
+#else
+#define MICRO_SCAN_SIMD 0
+#endif
+
+// Byte-scanning kernels used by the Tokeniser to skip whitespace, comments and
+// digit runs a whole vector at a time. Each kernel takes a [p, end) range and
+// returns the first position that stops the scan; kernels that may cross line
+// breaks add the number of '\n' bytes they skipped to `lines`.
+namespace scan {
+
+namespace detail {
+
+#if defined(__AVX2__)
+
+constexpr std::size_t width = 32;
+constexpr int bits_per_byte = 1;
+using Mask = std::uint32_t;
+using Block = __m256i;
+
+inline Block load(const char* p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+inline Mask eq(const Block b, const char c)
+{
+    return static_cast<Mask>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, _mm256_set1_epi8(c))));
+}
+
+// Bytes in [lo, hi]; both bounds must be ASCII so the signed compare is exact
+inline Mask in_range(const Block b, const char lo, const char hi)
+{
+    const __m256i above = _mm256_cmpgt_epi8(b, _mm256_set1_epi8(static_cast<char>(lo - 1)));
+    const __m256i below = _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi + 1)), b);
+    return static_cast<Mask>(_mm256_movemask_epi8(_mm256_and_si256(above, below)));
+}
+
+#elif defined(__SSE2__)
+
+constexpr std::size_t width = 16;
+constexpr int bits_per_byte = 1;
+using Mask = std::uint32_t;
+using Block = __m128i;
+
+inline Block load(const char* p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+inline Mask eq(const Block b, const char c)
+{
+    return static_cast<Mask>(_mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_set1_epi8(c))));
+}
+
+inline Mask in_range(const Block b, const char lo, const char hi)
+{
+    const __m128i above = _mm_cmpgt_epi8(b, _mm_set1_epi8(static_cast<char>(lo - 1)));
+    const __m128i below = _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(hi + 1)), b);
+    return static_cast<Mask>(_mm_movemask_epi8(_mm_and_si128(above, below)));
+}
+
+#elif defined(__ARM_NEON)
+
+// NEON has no movemask; narrowing the compare result by 4 bits per byte gives
+// a 64-bit mask with one nibble per input byte.
+constexpr std::size_t width = 16;
+constexpr int bits_per_byte = 4;
+using Mask = std::uint64_t;
+using Block = uint8x16_t;
+
+inline Block load(const char* p)
+{
+    return vld1q_u8(reinterpret_cast<const std::uint8_t*>(p));
+}
+
+inline Mask to_mask(const uint8x16_t m)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+inline Mask eq(const Block b, const char c)
+{
+    return to_mask(vceqq_u8(b, vdupq_n_u8(static_cast<std::uint8_t>(c))));
+}
+
+inline Mask in_range(const Block b, const char lo, const char hi)
+{
+    const uint8x16_t offset = vsubq_u8(b, vdupq_n_u8(static_cast<std::uint8_t>(lo)));
+    return to_mask(vcleq_u8(offset, vdupq_n_u8(static_cast<std::uint8_t>(hi - lo))));
+}
+
+#endif
+
+#if MICRO_SCAN_SIMD
+
+constexpr Mask full = static_cast<Mask>(~Mask { 0 });
+
+// Mask bits that correspond to a byte of the block (SSE2 fills only 16 of 32)
+constexpr Mask lanes = width * bits_per_byte >= sizeof(Mask) * 8 ? full : (Mask { 1 } << (width * bits_per_byte)) - 1;
+
+inline int first_index(const Mask m)
+{
+    return __builtin_ctzll(m) / bits_per_byte;
+}
+
+inline int count(const Mask m)
+{
+    return __builtin_popcountll(m) / bits_per_byte;
+}
+
+// Mask covering the first n bytes of a block
+inline Mask prefix(const int n)
+{
+    return n * bits_per_byte >= static_cast<int>(sizeof(Mask) * 8) ? full : (Mask { 1 } << (n * bits_per_byte)) - 1;
+}
+
+inline Mask spaces(const Block b)
+{
+    return eq(b, ' ') | in_range(b, '\t', '\r');
+}
+
+#endif
+
+inline bool is_space(const char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+inline bool is_digit(const char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+} // namespace detail
+
+// First '\n' or '\r' in [p, end), or end
+inline const char* find_line_end(const char* p, const char* end)
+{
+#if MICRO_SCAN_SIMD
+    for (; end - p >= static_cast<std::ptrdiff_t>(detail::width); p += detail::width) {
+        const auto block = detail::load(p);
+        const auto m = detail::eq(block, '\n') | detail::eq(block, '\r');
+        if (m != 0) {
+            return p + detail::first_index(m);
+        }
+    }
+#endif
+    while (p < end && *p != '\n' && *p != '\r') {
+        ++p;
+    }
+    return p;
+}
+
+// First non-whitespace byte in [p, end), or end
+inline const char* skip_spaces(const char* p, const char* end, std::uint32_t& lines)
+{
+#if MICRO_SCAN_SIMD
+    for (; end - p >= static_cast<std::ptrdiff_t>(detail::width); p += detail::width) {
+        const auto block = detail::load(p);
+        const auto other = ~detail::spaces(block) & detail::lanes;
+        const auto newlines = detail::eq(block, '\n');
+        if (other != 0) {
+            const int i = detail::first_index(other);
+            lines += detail::count(newlines & detail::prefix(i));
+            return p + i;
+        }
+        lines += detail::count(newlines);
+    }
+#endif
+    while (p < end && detail::is_space(*p)) {
+        lines += *p == '\n';
+        ++p;
+    }
+    return p;
+}
+
+// First non-digit byte in [p, end), or end
+inline const char* skip_digits(const char* p, const char* end)
+{
+#if MICRO_SCAN_SIMD
+    for (; end - p >= static_cast<std::ptrdiff_t>(detail::width); p += detail::width) {
+        const auto other = ~detail::in_range(detail::load(p), '0', '9') & detail::lanes;
+        if (other != 0) {
+            return p + detail::first_index(other);
+        }
+    }
+#endif
+    while (p < end && detail::is_digit(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// Position just past the next "*/" in [p, end), or end for an unterminated comment
+inline const char* skip_block_comment(const char* p, const char* end, std::uint32_t& lines)
+{
+#if MICRO_SCAN_SIMD
+    // The second load reads one byte ahead, so leave room for it
+    for (; end - p > static_cast<std::ptrdiff_t>(detail::width); p += detail::width) {
+        const auto block = detail::load(p);
+        const auto closes = detail::eq(block, '*') & detail::eq(detail::load(p + 1), '/');
+        const auto newlines = detail::eq(block, '\n');
+        if (closes != 0) {
+            const int i = detail::first_index(closes);
+            lines += detail::count(newlines & detail::prefix(i));
+            return p + i + 2;
+        }
+        lines += detail::count(newlines);
+    }
+#endif
+    while (p < end) {
+        if (*p == '*' && p + 1 < end && p[1] == '/') {
+            return p + 2;
+        }
+        lines += *p == '\n';
+        ++p;
+    }
+    return p;
+}
+
+} // namespace scan
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "immediates.hpp"
+
+// Replaces multiplies and unsigned divides by a constant with cheaper
+// sequences that give exactly the same 64-bit result. Both generators call
+// these, through the backend, when one operand is a known constant. The
+// arithmetic is the same on every target; the sequences here are ARM64's.
+
+inline uint8_t floor_log2(const uint64_t value)
+{
+    return static_cast<uint8_t>(63 - __builtin_clzll(value));
+}
+
+inline bool is_power_of_two(const uint64_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// Multiplier for dividing by a constant that is not a power of two: the
+// quotient is umulh(n, magic) >> shift. When the exact multiplier needs 65
+// bits, `magic` holds its low 64 bits and `add` says the top bit is added
+// back as ((n - q) >> 1) + q before shifting.
+struct DivisionMagic {
+    uint64_t magic;
+    uint8_t shift;
+    bool add;
+};
+
+inline DivisionMagic division_magic(const uint64_t divisor)
+{
+    const uint8_t log = floor_log2(divisor);
+    const unsigned __int128 numerator = static_cast<unsigned __int128>(1) << (64 + log);
+    uint64_t multiplier = static_cast<uint64_t>(numerator / divisor);
+    const uint64_t remainder = static_cast<uint64_t>(numerator % divisor);
+    if (divisor - remainder < (uint64_t { 1 } << log)) {
+        // ceil(2^(64 + log) / divisor) is within the rounding error bound
+        return { multiplier + 1, log, false };
+    }
+    // Otherwise round 2^(65 + log) / divisor up, which takes a 65th bit
+    const uint64_t twice_remainder = remainder + remainder;
+    multiplier += multiplier;
+    if (twice_remainder >= divisor || twice_remainder < remainder) {
+        multiplier++;
+    }
+    return { multiplier + 1, log, true };
+}
+
+namespace arm64 {
+
+// rd = rn * factor. Writes `tmp` only when it falls back to mul; rd may be rn.
+inline void emit_mul_imm(std::vector<Inst>& code, const Reg rd, const Reg rn, const uint64_t factor, const Reg tmp)
+{
+    if (factor == 0) {
+        code.push_back({ Opcode::mov_imm, rd, no_reg, no_reg, 0, 0 });
+        return;
+    }
+    // factor = odd << zeros, and odd is 1 or 2^k +- 1 when a shifted add or
+    // subtract can form it
+    const uint8_t zeros = static_cast<uint8_t>(__builtin_ctzll(factor));
+    const uint64_t odd = factor >> zeros;
+    Reg shifted = rn;
+    if (odd == 1) {
+        if (zeros == 0) {
+            if (rd != rn) {
+                code.push_back({ Opcode::mov, rd, rn });
+            }
+            return;
+        }
+    }
+    else if (is_power_of_two(odd - 1)) {
+        // rn + (rn << k)
+        code.push_back({ Opcode::add_lsl, rd, rn, rn, floor_log2(odd - 1) });
+        shifted = rd;
+    }
+    else if (is_power_of_two(odd + 1)) {
+        // -(rn - (rn << k))
+        code.push_back({ Opcode::sub_lsl, rd, rn, rn, floor_log2(odd + 1) });
+        code.push_back({ Opcode::neg, rd, rd });
+        shifted = rd;
+    }
+    else {
+        emit_mov_imm(code, tmp, factor);
+        code.push_back({ Opcode::mul, rd, rn, tmp });
+        return;
+    }
+    if (zeros > 0) {
+        code.push_back({ Opcode::lsl_imm, rd, shifted, no_reg, 0, zeros });
+    }
+}
+
+// rd = rn / divisor, with x / 0 = 0 as udiv gives. Writes `tmp` for the magic
+// number; rd may be rn.
+inline void emit_udiv_imm(std::vector<Inst>& code, const Reg rd, const Reg rn, const uint64_t divisor, const Reg tmp)
+{
+    if (divisor == 0) {
+        code.push_back({ Opcode::mov_imm, rd, no_reg, no_reg, 0, 0 });
+        return;
+    }
+    if (divisor == 1) {
+        if (rd != rn) {
+            code.push_back({ Opcode::mov, rd, rn });
+        }
+        return;
+    }
+    if (is_power_of_two(divisor)) {
+        code.push_back({ Opcode::lsr_imm, rd, rn, no_reg, 0, floor_log2(divisor) });
+        return;
+    }
+    const DivisionMagic magic = division_magic(divisor);
+    emit_mov_imm(code, tmp, magic.magic);
+    if (magic.add) {
+        code.push_back({ Opcode::umulh, tmp, rn, tmp });
+        code.push_back({ Opcode::sub, rd, rn, tmp });
+        code.push_back({ Opcode::add_lsr, rd, tmp, rd, 1 });
+    }
+    else {
+        code.push_back({ Opcode::umulh, rd, rn, tmp });
+    }
+    if (magic.shift > 0) {
+        code.push_back({ Opcode::lsr_imm, rd, rd, no_reg, 0, magic.shift });
+    }
+}
+
+} // namespace arm64
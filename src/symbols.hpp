@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Dense identifier id handed out by the Interner: the first distinct name is 0,
+// the next 1, and so on.
+using SymbolId = std::uint32_t;
+
+// Maps identifier spellings to dense SymbolIds. The views must outlive the
+// Interner (they point into the mapped source).
+class Interner {
+public:
+    SymbolId intern(const std::string_view name)
+    {
+        const auto [it, inserted] = m_ids.try_emplace(name, static_cast<SymbolId>(m_names.size()));
+        if (inserted) {
+            m_names.push_back(name);
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] std::string_view name(const SymbolId id) const
+    {
+        return m_names[id];
+    }
+
+    [[nodiscard]] std::size_t size() const
+    {
+        return m_names.size();
+    }
+
+private:
+    std::unordered_map<std::string_view, SymbolId> m_ids {};
+    std::vector<std::string_view> m_names {};
+};
+
+// Symbol -> T bindings with lexical scoping. Because ids are dense the "hash"
+// is the id itself, so lookup and declare are a single index. Every declare
+// records the binding it replaced in an undo log, and end_scope() replays the
+// log back to the mark taken by begin_scope().
+template <typename T>
+class ScopedSymbolTable {
+public:
+    explicit ScopedSymbolTable(const std::size_t num_symbols)
+        : m_bindings(num_symbols)
+    {
+    }
+
+    [[nodiscard]] const T* lookup(const SymbolId id) const
+    {
+        const std::optional<T>& binding = m_bindings[id];
+        return binding.has_value() ? &binding.value() : nullptr;
+    }
+
+    [[nodiscard]] T* lookup(const SymbolId id)
+    {
+        std::optional<T>& binding = m_bindings[id];
+        return binding.has_value() ? &binding.value() : nullptr;
+    }
+
+    void declare(const SymbolId id, T value)
+    {
+        m_undo.emplace_back(id, std::move(m_bindings[id]));
+        m_bindings[id] = std::move(value);
+    }
+
+    void begin_scope()
+    {
+        m_scope_marks.push_back(m_undo.size());
+    }
+
+    // Drops every binding declared since the matching begin_scope() and
+    // returns how many there were
+    std::size_t end_scope()
+    {
+        const std::size_t mark = m_scope_marks.back();
+        const std::size_t count = m_undo.size() - mark;
+        while (m_undo.size() > mark) {
+            auto& [id, previous] = m_undo.back();
+            m_bindings[id] = std::move(previous);
+            m_undo.pop_back();
+        }
+        m_scope_marks.pop_back();
+        return count;
+    }
+
+private:
+    std::vector<std::optional<T>> m_bindings;
+    std::vector<std::pair<SymbolId, std::optional<T>>> m_undo {};
+    std::vector<std::size_t> m_scope_marks {};
+};
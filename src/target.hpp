@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+// The machine and OS a program is compiled for. Each one has a backend: a
+// struct of static members that the generators and machine passes take as a
+// template parameter, so choosing the target costs one switch in main and
+// emitting an instruction never goes through a virtual call. A backend has
+//
+//   Isa                   the instruction set: Inst, Opcode, Reg, and what
+//                         the peephole optimiser needs to know about them
+//   Code                  std::vector<Isa::Inst>
+//   num_regs, reg(i)      the registers the generators assign to values, with
+//                         reg(0) holding the exit status
+//   scratch(n)            two more registers, n = 0 or 1, for the generators'
+//                         temporaries; the backend itself only writes
+//                         scratch(0) in reserve_frame and scratch(1) in
+//                         store_slot
+//   mov, mov_imm, binary, add_imm, mul_imm, udiv_imm
+//                         rd = an operation on registers and constants, with
+//                         fits_add_imm(k) saying whether add_imm takes k
+//   load_slot, store_slot, reserve_frame
+//                         8-byte stack slots and the frame that holds them
+//   label, jump, branch_zero, branch_nonzero, exit
+//                         control flow, by label number
+//   encode(code), elf_machine, system_toolchain
+//                         machine code for an ELF executable, or whether the
+//                         code is printed as assembly for the system's as and
+//                         ld instead, by print(out, code), or by
+//                         print_insts(out, code) without the entry header
+enum class Target : uint8_t {
+    arm64_macos,
+    arm64_linux,
+    x86_64_linux
+};
+
+// The operators of the language, as the generators hand them to a backend
+enum class BinaryOp : uint8_t {
+    add,
+    sub,
+    mul,
+    udiv
+};
@@ -1,12 +1,19 @@
 #pragma once
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <limits>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <iostream>
 #include <optional>
+#include "compile_error.hpp"
+#include "scan.hpp"
 
 using namespace std;
 
-enum class TokenType {
+enum class TokenType : uint8_t {
     _exit,
     int_lit,
     semi,
@@ -78,148 +85,278 @@ inline optional<int> bin_prec(TokenType type) {
     }
 }
 
+// A single lexed token as handed from the Tokeniser to a TokenBuffer. It owns
+// nothing: identifier text is recovered from the source by offset and length.
 struct Token {
     TokenType type;
-    int line;
-    optional<string> value {};
+    uint32_t line;
+    uint32_t offset;
+    // Value of an integer literal, length of an identifier, otherwise 0
+    int64_t value = 0;
 };
 
+// Tokens stored as parallel arrays (17 bytes per token) so scanning the type
+// column during lookahead touches as little memory as possible.
+class TokenBuffer {
+public:
+    TokenBuffer() = default;
+
+    inline explicit TokenBuffer(const size_t size)
+        : m_types(size)
+        , m_lines(size)
+        , m_offsets(size)
+        , m_values(size)
+    {
+    }
+
+    inline void push_back(const Token& token) {
+        m_types.push_back(token.type);
+        m_lines.push_back(token.line);
+        m_offsets.push_back(token.offset);
+        m_values.push_back(token.value);
+    }
+
+    inline void set(const size_t index, const Token& token) {
+        m_types[index] = token.type;
+        m_lines[index] = token.line;
+        m_offsets[index] = token.offset;
+        m_values[index] = token.value;
+    }
+
+    [[nodiscard]] inline size_t size() const {
+        return m_types.size();
+    }
+
+    [[nodiscard]] inline TokenType type(const size_t index) const {
+        return m_types[index];
+    }
+
+    [[nodiscard]] inline uint32_t line(const size_t index) const {
+        return m_lines[index];
+    }
+
+    [[nodiscard]] inline uint32_t offset(const size_t index) const {
+        return m_offsets[index];
+    }
+
+    [[nodiscard]] inline int64_t value(const size_t index) const {
+        return m_values[index];
+    }
+
+private:
+    vector<TokenType> m_types {};
+    vector<uint32_t> m_lines {};
+    vector<uint32_t> m_offsets {};
+    vector<int64_t> m_values {};
+};
+
+// Lexical class of every byte. The tokeniser dispatches on this table instead
+// of the locale-dependent <cctype> predicates.
+enum class CharClass : uint8_t {
+    invalid,
+    space,
+    alpha,
+    digit,
+    slash,
+    punct
+};
+
+constexpr array<CharClass, 256> make_char_classes() {
+    array<CharClass, 256> classes {};
+    for (int c = 'a'; c <= 'z'; c++) {
+        classes[c] = CharClass::alpha;
+    }
+    for (int c = 'A'; c <= 'Z'; c++) {
+        classes[c] = CharClass::alpha;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        classes[c] = CharClass::digit;
+    }
+    for (const char c : { ' ', '\t', '\n', '\v', '\f', '\r' }) {
+        classes[static_cast<unsigned char>(c)] = CharClass::space;
+    }
+    for (const char c : { '(', ')', ';', '=', '*', '+', '-', '{', '}' }) {
+        classes[static_cast<unsigned char>(c)] = CharClass::punct;
+    }
+    classes['/'] = CharClass::slash;
+    return classes;
+}
+
+// Token produced by each single-character punctuator (only meaningful for
+// bytes classed as CharClass::punct)
+constexpr array<TokenType, 256> make_punct_tokens() {
+    array<TokenType, 256> tokens {};
+    tokens['('] = TokenType::open_paren;
+    tokens[')'] = TokenType::close_paren;
+    tokens[';'] = TokenType::semi;
+    tokens['='] = TokenType::eq;
+    tokens['*'] = TokenType::star;
+    tokens['+'] = TokenType::plus;
+    tokens['-'] = TokenType::sub;
+    tokens['{'] = TokenType::open_brace;
+    tokens['}'] = TokenType::close_brace;
+    return tokens;
+}
+
+inline constexpr array<CharClass, 256> char_classes = make_char_classes();
+inline constexpr array<TokenType, 256> punct_tokens = make_punct_tokens();
+
+inline CharClass char_class(const char c) {
+    return char_classes[static_cast<unsigned char>(c)];
+}
+
+inline bool is_ident_char(const char c) {
+    const CharClass cls = char_class(c);
+    return cls == CharClass::alpha || cls == CharClass::digit;
+}
+
+struct Keyword {
+    string_view text;
+    TokenType type;
+};
+
+inline constexpr array<Keyword, 5> keywords { {
+    { "exit", TokenType::_exit },
+    { "var", TokenType::var },
+    { "if", TokenType::if_ },
+    { "elif", TokenType::elif },
+    { "else", TokenType::else_ },
+} };
+
+// Perfect hash over the keyword set: length, first and last byte. Words that
+// hash to an empty slot or to a different keyword are identifiers, so every
+// lookup is one table probe plus at most one short compare.
+constexpr size_t keyword_slots = 16;
+
+constexpr size_t keyword_hash(const string_view word) {
+    return (word.size() * 7 + static_cast<unsigned char>(word.front()) + static_cast<unsigned char>(word.back()) * 3)
+        % keyword_slots;
+}
+
+// Empty slots hold an empty text, which no identifier can match
+constexpr array<Keyword, keyword_slots> make_keyword_table() {
+    array<Keyword, keyword_slots> table {};
+    for (const Keyword& keyword : keywords) {
+        table[keyword_hash(keyword.text)] = keyword;
+    }
+    return table;
+}
+
+inline constexpr array<Keyword, keyword_slots> keyword_table = make_keyword_table();
+
+constexpr bool keyword_hash_is_perfect() {
+    for (const Keyword& keyword : keywords) {
+        if (keyword_table[keyword_hash(keyword.text)].text != keyword.text) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(keyword_hash_is_perfect(), "keyword_hash collides; adjust its constants or keyword_slots");
+
+inline optional<TokenType> keyword_type(const string_view word) {
+    const Keyword& slot = keyword_table[keyword_hash(word)];
+    if (slot.text == word) {
+        return slot.type;
+    }
+    return {};
+}
 
 class Tokeniser {
 
 public:
-    inline explicit Tokeniser(const string& src) : m_src(std::move(src)) {
-        
-    }
-
-    inline vector<Token> tokenise(const string& str) {
-        vector<Token> tokens{};
-        int line_count = 1;
-        string buffer;
-        while (peek().has_value()) {
-            if (isalpha(peek().value())) {
-                buffer.push_back(consume());
-                while (peek().has_value() && isalnum(peek().value())) {
-                    buffer.push_back(consume());
-                }
+    // The tokeniser never copies the source: identifier and literal tokens are
+    // string_views into `src`, which must outlive the returned tokens.
+    inline explicit Tokeniser(string_view src) : m_src(src) {
+        // Token offsets are 32-bit
+        if (m_src.size() > numeric_limits<uint32_t>::max()) {
+            throw CompileError("Source file too large");
+        }
+    }
 
-                if (buffer == "exit") {
-                    tokens.push_back({TokenType::_exit, line_count});
-                    buffer.clear();
-                    continue;
-                } else if (buffer == "var") {
-                    tokens.push_back({ TokenType::var, line_count});
-                    buffer.clear();
-                    continue;
-                } else if (buffer == "if") {
-                    tokens.push_back({ TokenType::if_, line_count});
-                    buffer.clear();
-                    continue;
-                } else if (buffer == "elif") {
-                    tokens.push_back({ TokenType::elif, line_count});
-                    buffer.clear();
-                    continue;
-                } else if (buffer == "else") {
-                    tokens.push_back({ TokenType::else_, line_count});
-                    buffer.clear();
-                    continue;
-                } else {
-                    tokens.push_back({TokenType::ident, line_count, buffer});
-                    buffer.clear();
-                    continue;
-                }
-            } else if (isdigit(peek().value())) {
-                buffer.push_back(consume());
-                while (peek().has_value() && isdigit(peek().value())) {
-                    buffer.push_back(consume());
-                }
-                tokens.push_back({TokenType::int_lit, line_count, buffer});
-                buffer.clear();
-                continue; 
-            } else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '/') {
-                consume();
-                consume();
-                while (peek().has_value() && peek().value() != '\n' && peek().value() != '\r') {
-                    consume(); 
-                }
-                consume(); 
+    // Lexes from byte `start`, which is on line `line`. The caller knows no
+    // comment or token spans `start`, as when an incremental compile re-lexes
+    // from the end of an unchanged statement.
+    inline Tokeniser(string_view src, const size_t start, const uint32_t line)
+        : Tokeniser(src)
+    {
+        m_index = start;
+        m_line = line;
+    }
 
-                if (peek().has_value() && peek().value() == '\n') {
-                    consume();
+    inline TokenBuffer tokenise() {
+        TokenBuffer tokens{};
+        while (auto token = next()) {
+            tokens.push_back(token.value());
+        }
+        m_index = 0;
+        m_line = 1;
+        return tokens;
+    }
+
+    // Lexes and returns the next token, or nothing at the end of the source.
+    // This is the pull interface TokenStream uses to feed the Parser lazily.
+    inline optional<Token> next() {
+        while (m_index < m_src.size()) {
+            const char c = m_src[m_index];
+            switch (char_class(c)) {
+                case CharClass::alpha: {
+                    const size_t start = m_index;
+                    const char* pos = cursor() + 1;
+                    while (pos < src_end() && is_ident_char(*pos)) {
+                        pos++;
+                    }
+                    advance_to(pos);
+                    const string_view word = m_src.substr(start, m_index - start);
+                    if (const auto type = keyword_type(word)) {
+                        return Token{type.value(), m_line, static_cast<uint32_t>(start)};
+                    }
+                    return Token{TokenType::ident, m_line, static_cast<uint32_t>(start), static_cast<int64_t>(word.size())};
                 }
-            }  else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '*') {
-                consume(); 
-                consume(); 
-                
-                while (peek().has_value()) {
-                    if (peek().value() == '*' && peek(1).has_value() && peek(1).value() == '/') {
-                        consume(); 
-                        consume(); 
-                        break;
+                case CharClass::digit: {
+                    const size_t start = m_index;
+                    advance_to(scan::skip_digits(cursor(), src_end()));
+                    // Literals are parsed once here; anything up to 2^64 - 1 is
+                    // kept as its 64-bit pattern
+                    uint64_t value = 0;
+                    if (from_chars(m_src.data() + start, cursor(), value).ec != errc {}) {
+                        throw CompileError("Integer literal out of range on line " + to_string(m_line));
                     }
-                    consume();
+                    return Token{TokenType::int_lit, m_line, static_cast<uint32_t>(start), static_cast<int64_t>(value)};
                 }
+                case CharClass::slash:
+                    if (peek(1) == '/') {
+                        // Stop at the line break and leave it to the whitespace skip,
+                        // which counts lines; the view has no terminator to overrun.
+                        advance_to(scan::find_line_end(cursor() + 2, src_end()));
+                        break;
+                    } else if (peek(1) == '*') {
+                        advance_to(scan::skip_block_comment(cursor() + 2, src_end(), m_line));
+                        break;
+                    }
+                    m_index++;
+                    return Token{TokenType::div, m_line, static_cast<uint32_t>(m_index - 1)};
+                case CharClass::punct:
+                    m_index++;
+                    return Token{punct_tokens[static_cast<unsigned char>(c)], m_line, static_cast<uint32_t>(m_index - 1)};
+                case CharClass::space:
+                    advance_to(scan::skip_spaces(cursor(), src_end(), m_line));
+                    break;
+                case CharClass::invalid:
+                    throw CompileError("Error, invalid character");
             }
-            else if (peek().value() == '(') {
-                consume();
-                tokens.push_back({TokenType::open_paren, line_count});
-                continue;
-            } else if (peek().value() == ')') {
-                consume();
-                tokens.push_back({TokenType::close_paren, line_count});
-                continue;
-            } else if (peek().value() == ';') {
-                consume();
-                tokens.push_back({TokenType::semi, line_count});
-                continue;
-            } else if (peek().value() == '=') {
-                consume();
-                tokens.push_back({TokenType::eq, line_count});
-                continue;
-            } else if (peek().value() == '*') {
-                consume();
-                tokens.push_back({TokenType::star, line_count});
-                continue;
-            } else if (peek().value() == '+') {
-                consume();
-                tokens.push_back({TokenType::plus, line_count});
-                continue;
-            } else if (peek().value() == '-') {
-                consume();
-                tokens.push_back({TokenType::sub, line_count});
-                continue;
-            } else if (peek().value() == '/') {
-                consume();
-                tokens.push_back({TokenType::div, line_count});
-                continue;
-            } else if (peek().value() == '{') {
-                consume();
-                tokens.push_back({TokenType::open_brace, line_count});
-                continue;
-            } else if (peek().value() == '}') {
-                consume();
-                tokens.push_back({TokenType::close_brace, line_count});
-                continue;
-            } else if (peek().value() == '\n') {
-                consume();
-                line_count++;
-                continue;
-            } else if (isspace(peek().value())) {
-                consume();
-                continue;
-            } else {
-                cout << "Error, invalid character" << endl;
-                exit(EXIT_FAILURE);
-            }
-            
         }
-        m_index = 0;
-        return tokens;
+        return {};
+    }
+
+    [[nodiscard]] inline string_view source() const {
+        return m_src;
     }
 
 private:
 
-    [[nodiscard]] inline optional<char> peek(int n=0) const {
+    [[nodiscard]] inline optional<char> peek(size_t n=0) const {
         if (m_index + n >= m_src.length()) {
             return {};
         } else {
@@ -227,12 +364,93 @@ private:
         }
     }
 
-    inline char consume() {
-        return m_src[m_index++];
+    [[nodiscard]] inline const char* cursor() const {
+        return m_src.data() + m_index;
     }
 
-    const string& m_src;
-    int m_index = 0;
+    [[nodiscard]] inline const char* src_end() const {
+        return m_src.data() + m_src.size();
+    }
 
+    inline void advance_to(const char* pos) {
+        m_index = static_cast<size_t>(pos - m_src.data());
+    }
 
+    const string_view m_src;
+    size_t m_index = 0;
+    uint32_t m_line = 1;
+
+
+};
+
+// Source of tokens for the Parser. It either walks a fully materialised token
+// buffer or pulls from a Tokeniser on demand, keeping only a small ring of
+// recent tokens so memory stays bounded however large the input is. Tokens are
+// addressed by absolute index and read a field at a time; nothing is copied.
+class TokenStream {
+public:
+    // The parser looks at most two tokens ahead (peek(2) in parse_stmt) and one
+    // behind (the line of the last consumed token in error messages)
+    static constexpr size_t max_lookahead = 2;
+    static constexpr size_t max_lookbehind = 1;
+    static constexpr size_t ring_size = 4;
+    static_assert(ring_size >= max_lookahead + max_lookbehind + 1, "ring too small for the parser's window");
+    static_assert((ring_size & (ring_size - 1)) == 0, "ring size must be a power of two");
+
+    inline TokenStream(TokenBuffer tokens, const string_view src)
+        : m_tokens(std::move(tokens))
+        , m_src(src)
+        , m_end(m_tokens.size())
+        , m_mask(SIZE_MAX)
+    {
+    }
+
+    inline explicit TokenStream(Tokeniser& tokeniser)
+        : m_tokens(ring_size)
+        , m_src(tokeniser.source())
+        , m_mask(ring_size - 1)
+        , m_tokeniser(&tokeniser)
+    {
+    }
+
+    // Whether a token exists at absolute position `index`, lexing up to it if
+    // needed. In streaming mode `index` must lie within the parser's window.
+    [[nodiscard]] inline bool has(const size_t index) {
+        while (m_tokeniser != nullptr && index >= m_end) {
+            if (const auto token = m_tokeniser->next()) {
+                m_tokens.set(m_end++ & m_mask, token.value());
+            } else {
+                m_tokeniser = nullptr;
+            }
+        }
+        return index < m_end;
+    }
+
+    // Field accessors; `index` must already have been checked with has()
+    [[nodiscard]] inline TokenType type(const size_t index) const {
+        return m_tokens.type(index & m_mask);
+    }
+
+    [[nodiscard]] inline uint32_t line(const size_t index) const {
+        return m_tokens.line(index & m_mask);
+    }
+
+    [[nodiscard]] inline int64_t value(const size_t index) const {
+        return m_tokens.value(index & m_mask);
+    }
+
+    [[nodiscard]] inline uint32_t offset(const size_t index) const {
+        return m_tokens.offset(index & m_mask);
+    }
+
+    [[nodiscard]] inline string_view text(const size_t index) const {
+        return m_src.substr(m_tokens.offset(index & m_mask), static_cast<size_t>(m_tokens.value(index & m_mask)));
+    }
+
+private:
+    TokenBuffer m_tokens;
+    string_view m_src;
+    size_t m_end = 0;
+    size_t m_mask;
+    Tokeniser* m_tokeniser = nullptr;
 };
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "bytecode.hpp"
+#include <cstdint>
+#include <vector>
+
+namespace bytecode {
+
+// Runs a bytecode program (see bytecode.hpp) in-process and returns its exit
+// value, which the caller truncates to 8 bits as a process exit would.
+// Dispatch is threaded with computed gotos: each handler ends in its own
+// indirect jump through the table, instead of all of them sharing the one
+// jump at the top of a switch, which gives the branch predictor a separate
+// history per opcode. The language has no loops, so every run terminates.
+inline uint64_t run(const Program& program)
+{
+    // Zeroed like the fresh stack pages a native program's frame starts on
+    std::vector<uint64_t> frame(program.num_regs);
+    uint64_t* const r = frame.data();
+    const Inst* const code = program.code.data();
+    const Inst* ip = code;
+
+    // In the order of Op
+    static const void* const handlers[] = { &&load_imm, &&mov, &&add, &&sub, &&mul, &&div, &&add_imm, &&mul_imm,
+        &&div_imm, &&shr_imm, &&rsub_imm, &&rdiv_imm, &&jump, &&jump_zero, &&jump_eq, &&jump_eq_imm, &&exit,
+        &&exit_imm };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == op_count);
+
+#define VM_DISPATCH() goto* handlers[static_cast<uint8_t>(ip->op)]
+#define VM_NEXT() goto* handlers[static_cast<uint8_t>((++ip)->op)]
+
+    VM_DISPATCH();
+load_imm:
+    r[ip->a] = ip->imm;
+    VM_NEXT();
+mov:
+    r[ip->a] = r[ip->b];
+    VM_NEXT();
+add:
+    r[ip->a] = r[ip->b] + r[ip->c];
+    VM_NEXT();
+sub:
+    r[ip->a] = r[ip->b] - r[ip->c];
+    VM_NEXT();
+mul:
+    r[ip->a] = r[ip->b] * r[ip->c];
+    VM_NEXT();
+div: {
+    const uint64_t divisor = r[ip->c];
+    r[ip->a] = divisor == 0 ? 0 : r[ip->b] / divisor;
+    VM_NEXT();
+}
+add_imm:
+    r[ip->a] = r[ip->b] + ip->imm;
+    VM_NEXT();
+mul_imm:
+    r[ip->a] = r[ip->b] * ip->imm;
+    VM_NEXT();
+div_imm:
+    r[ip->a] = r[ip->b] / ip->imm;
+    VM_NEXT();
+shr_imm:
+    r[ip->a] = r[ip->b] >> ip->imm;
+    VM_NEXT();
+rsub_imm:
+    r[ip->a] = ip->imm - r[ip->b];
+    VM_NEXT();
+rdiv_imm: {
+    const uint64_t divisor = r[ip->b];
+    r[ip->a] = divisor == 0 ? 0 : ip->imm / divisor;
+    VM_NEXT();
+}
+jump:
+    ip = code + ip->imm;
+    VM_DISPATCH();
+jump_zero:
+    ip = r[ip->a] == 0 ? code + ip->imm : ip + 1;
+    VM_DISPATCH();
+jump_eq:
+    ip = r[ip->a] == r[ip->b] ? code + ip->imm : ip + 1;
+    VM_DISPATCH();
+jump_eq_imm:
+    ip = r[ip->a] == ip->imm ? code + ip->b : ip + 1;
+    VM_DISPATCH();
+exit:
+    return r[ip->a];
+exit_imm:
+    return ip->imm;
+
+#undef VM_NEXT
+#undef VM_DISPATCH
+}
+
+} // namespace bytecode
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs body(worker, index) for every index in [0, count) on `workers` threads,
+// the calling thread being worker 0. Each worker starts with an even share of
+// the indices as a contiguous range and takes from its front. One that runs
+// dry steals the back half of another's range, so a worker stuck on a few
+// slow tasks hands the rest of its range to whoever is free. No task ever
+// adds more, so once every range is empty all of them are done.
+template <typename Body>
+void run_work_stealing(const std::size_t count, const unsigned workers, Body&& body)
+{
+    struct Range {
+        std::mutex mutex;
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+    const auto threads = static_cast<unsigned>(std::clamp<std::size_t>(workers, 1, std::max<std::size_t>(count, 1)));
+    const std::unique_ptr<Range[]> ranges(new Range[threads]);
+    for (unsigned i = 0; i < threads; i++) {
+        ranges[i].begin = count * i / threads;
+        ranges[i].end = count * (i + 1) / threads;
+    }
+
+    const auto take = [&](const unsigned self, std::size_t& index) {
+        {
+            Range& own = ranges[self];
+            const std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.begin < own.end) {
+                index = own.begin++;
+                return true;
+            }
+        }
+        for (unsigned step = 1; step < threads; step++) {
+            Range& victim = ranges[(self + step) % threads];
+            std::size_t begin;
+            std::size_t end;
+            {
+                const std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.begin == victim.end) {
+                    continue;
+                }
+                // Leave the victim the front half, which it is working through
+                end = victim.end;
+                begin = victim.begin + (victim.end - victim.begin) / 2;
+                victim.end = begin;
+            }
+            index = begin;
+            if (begin + 1 < end) {
+                Range& own = ranges[self];
+                const std::lock_guard<std::mutex> lock(own.mutex);
+                own.begin = begin + 1;
+                own.end = end;
+            }
+            return true;
+        }
+        return false;
+    };
+    const auto work = [&](const unsigned self) {
+        std::size_t index;
+        while (take(self, index)) {
+            body(self, index);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(work, i);
+    }
+    work(0);
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+}
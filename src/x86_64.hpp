@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Structured x86-64 instructions, as the generators emit them through
+// x86_64::Backend. They keep ARM64's three-operand shape, rd = rn op rm, so
+// the same passes can rewrite them; the encoder turns each one into the
+// two-operand instructions the hardware has, adding a mov where rd is not
+// already rn. udiv and umulh go through rax and rdx, which no value ever
+// lives in, so those two registers are never named here.
+namespace x86_64 {
+
+// Hardware register numbers, as they go into ModRM, SIB and REX
+using Reg = uint8_t;
+constexpr Reg rax = 0;
+constexpr Reg rcx = 1;
+constexpr Reg rdx = 2;
+constexpr Reg rbx = 3;
+constexpr Reg rsp = 4;
+constexpr Reg rbp = 5;
+constexpr Reg rsi = 6;
+constexpr Reg rdi = 7;
+constexpr Reg r8 = 8;
+constexpr Reg r9 = 9;
+constexpr Reg r10 = 10;
+constexpr Reg r11 = 11;
+constexpr Reg r12 = 12;
+constexpr Reg r13 = 13;
+constexpr Reg r14 = 14;
+constexpr Reg r15 = 15;
+constexpr Reg no_reg = UINT8_MAX;
+
+enum class Opcode : uint8_t {
+    // rd = rn
+    mov,
+    // rd = imm, any 64-bit value
+    mov_imm,
+    // rd = rn op rm; udiv gives 0 when rm is 0, as ARM64's does
+    add,
+    sub,
+    mul,
+    udiv,
+    // rd = rn op imm, imm sign-extended from 32 bits
+    add_imm,
+    sub_imm,
+    mul_imm,
+    // rd = rn + (rm << shift), shift <= 3
+    lea,
+    // rd = rn shifted by imm
+    shl_imm,
+    shr_imm,
+    // rd = high 64 bits of rn * rm
+    umulh,
+    // rd = -rn
+    neg,
+    // rd <-> [rn + imm]
+    load,
+    store,
+    // Flags from rn - imm
+    cmp_imm,
+    // To label imm; jz/jnz test rn
+    jmp,
+    je,
+    jz,
+    jnz,
+    // Exits, with the status in rdi and the syscall number in rax
+    syscall,
+    // Defines label imm
+    label,
+    // Deleted by an optimisation; never encoded
+    nop
+};
+
+struct Inst {
+    Opcode op;
+    Reg rd = no_reg;
+    Reg rn = no_reg;
+    Reg rm = no_reg;
+    uint8_t shift = 0;
+    uint64_t imm = 0;
+};
+
+inline bool is_branch(const Opcode op)
+{
+    return op == Opcode::jmp || op == Opcode::je || op == Opcode::jz || op == Opcode::jnz;
+}
+
+// The register an instruction writes, if any, leaving out the rax and rdx
+// that udiv and umulh clobber
+inline Reg def(const Inst& inst)
+{
+    switch (inst.op) {
+    case Opcode::mov:
+    case Opcode::mov_imm:
+    case Opcode::add:
+    case Opcode::sub:
+    case Opcode::mul:
+    case Opcode::udiv:
+    case Opcode::add_imm:
+    case Opcode::sub_imm:
+    case Opcode::mul_imm:
+    case Opcode::lea:
+    case Opcode::shl_imm:
+    case Opcode::shr_imm:
+    case Opcode::umulh:
+    case Opcode::neg:
+    case Opcode::load:
+        return inst.rd;
+    default:
+        return no_reg;
+    }
+}
+
+// The instruction set as the target-independent machine passes see it (see
+// arm64::Isa)
+struct Isa {
+    using Inst = x86_64::Inst;
+    using Opcode = x86_64::Opcode;
+    using Reg = x86_64::Reg;
+
+    static constexpr Reg sp = rsp;
+    static constexpr Reg no_reg = x86_64::no_reg;
+
+    static constexpr Opcode mov = Opcode::mov;
+    static constexpr Opcode mov_imm = Opcode::mov_imm;
+    static constexpr Opcode load = Opcode::load;
+    static constexpr Opcode store = Opcode::store;
+    static constexpr Opcode add_imm = Opcode::add_imm;
+    static constexpr Opcode sub_imm = Opcode::sub_imm;
+    // cmp rn, 0; je fuses into test rn, rn; je
+    static constexpr Opcode cmp_imm = Opcode::cmp_imm;
+    static constexpr Opcode branch_eq = Opcode::je;
+    static constexpr Opcode branch_zero = Opcode::jz;
+    static constexpr Opcode jump = Opcode::jmp;
+    static constexpr Opcode label = Opcode::label;
+    static constexpr Opcode nop = Opcode::nop;
+
+    static Reg def(const Inst& inst)
+    {
+        return x86_64::def(inst);
+    }
+
+    static bool ends_block(const Inst& inst)
+    {
+        return inst.op == Opcode::label || is_branch(inst.op) || inst.op == Opcode::syscall;
+    }
+};
+
+} // namespace x86_64
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "strength_reduction.hpp"
+#include "target.hpp"
+#include "x86_64.hpp"
+#include "x86_64_encoder.hpp"
+
+namespace x86_64 {
+
+// The x86-64 System V Linux backend (see target.hpp). Eleven registers hold
+// values, rdi first since the exit syscall takes its status there, and r15
+// and rbp are the scratch registers. rax and rdx are left for the encoder's
+// divides and multiply-highs, and rsp is the frame.
+struct Backend {
+    using Isa = x86_64::Isa;
+    using Code = std::vector<Inst>;
+
+    static constexpr uint32_t num_regs = 11;
+    static constexpr uint16_t elf_machine = 62; // EM_X86_64
+    static constexpr bool system_toolchain = false;
+
+    static Reg reg(const uint32_t index)
+    {
+        assert(index < num_regs);
+        return regs[index];
+    }
+
+    static Reg scratch(const uint32_t n)
+    {
+        assert(n < 2);
+        return regs[num_regs + n];
+    }
+
+    static void mov(Code& code, const Reg rd, const Reg rn)
+    {
+        code.push_back({ Opcode::mov, rd, rn });
+    }
+
+    static void mov_imm(Code& code, const Reg rd, const uint64_t value)
+    {
+        code.push_back({ Opcode::mov_imm, rd, no_reg, no_reg, 0, value });
+    }
+
+    static void binary(Code& code, const BinaryOp op, const Reg rd, const Reg rn, const Reg rm)
+    {
+        switch (op) {
+        case BinaryOp::add:
+            code.push_back({ Opcode::add, rd, rn, rm });
+            return;
+        case BinaryOp::sub:
+            code.push_back({ Opcode::sub, rd, rn, rm });
+            return;
+        case BinaryOp::mul:
+            code.push_back({ Opcode::mul, rd, rn, rm });
+            return;
+        case BinaryOp::udiv:
+            code.push_back({ Opcode::udiv, rd, rn, rm });
+            return;
+        }
+    }
+
+    // add takes a 32-bit immediate, sign-extended
+    static bool fits_add_imm(const uint64_t value)
+    {
+        return static_cast<int64_t>(value) == static_cast<int32_t>(value);
+    }
+
+    static void add_imm(Code& code, const Reg rd, const Reg rn, const uint64_t value)
+    {
+        assert(fits_add_imm(value));
+        code.push_back({ Opcode::add_imm, rd, rn, no_reg, 0, value });
+    }
+
+    // rd = rn * factor: a shift for a power of two, an lea for 3, 5 or 9
+    // times one, imul with an immediate when the factor fits 32 bits, and
+    // imul with the factor in `tmp` otherwise. rd may be rn.
+    static void mul_imm(Code& code, const Reg rd, const Reg rn, const uint64_t factor, const Reg tmp)
+    {
+        if (factor == 0) {
+            mov_imm(code, rd, 0);
+            return;
+        }
+        const uint8_t zeros = static_cast<uint8_t>(__builtin_ctzll(factor));
+        const uint64_t odd = factor >> zeros;
+        if (odd == 1 && zeros == 0) {
+            if (rd != rn) {
+                mov(code, rd, rn);
+            }
+        }
+        else if (odd == 1) {
+            code.push_back({ Opcode::shl_imm, rd, rn, no_reg, 0, zeros });
+        }
+        else if (odd == 3 || odd == 5 || odd == 9) {
+            // rn + (rn << k)
+            code.push_back({ Opcode::lea, rd, rn, rn, floor_log2(odd - 1) });
+            if (zeros > 0) {
+                code.push_back({ Opcode::shl_imm, rd, rd, no_reg, 0, zeros });
+            }
+        }
+        else if (fits_add_imm(factor)) {
+            code.push_back({ Opcode::mul_imm, rd, rn, no_reg, 0, factor });
+        }
+        else {
+            mov_imm(code, tmp, factor);
+            code.push_back({ Opcode::mul, rd, rn, tmp });
+        }
+    }
+
+    // rd = rn / divisor, with x / 0 = 0, by the same multiply-high as ARM64
+    // (see division_magic). Writes `tmp` for the magic number; rd may be rn.
+    static void udiv_imm(Code& code, const Reg rd, const Reg rn, const uint64_t divisor, const Reg tmp)
+    {
+        if (divisor == 0) {
+            mov_imm(code, rd, 0);
+            return;
+        }
+        if (divisor == 1) {
+            if (rd != rn) {
+                mov(code, rd, rn);
+            }
+            return;
+        }
+        if (is_power_of_two(divisor)) {
+            code.push_back({ Opcode::shr_imm, rd, rn, no_reg, 0, floor_log2(divisor) });
+            return;
+        }
+        const DivisionMagic magic = division_magic(divisor);
+        mov_imm(code, tmp, magic.magic);
+        if (magic.add) {
+            code.push_back({ Opcode::umulh, tmp, rn, tmp });
+            code.push_back({ Opcode::sub, rd, rn, tmp });
+            code.push_back({ Opcode::shr_imm, rd, rd, no_reg, 0, 1 });
+            code.push_back({ Opcode::add, rd, rd, tmp });
+        }
+        else {
+            code.push_back({ Opcode::umulh, rd, rn, tmp });
+        }
+        if (magic.shift > 0) {
+            code.push_back({ Opcode::shr_imm, rd, rd, no_reg, 0, magic.shift });
+        }
+    }
+
+    // Slots are addressed as [rsp + disp32], so no offset needs a register
+    static void load_slot(Code& code, const Reg rd, const uint64_t slot)
+    {
+        code.push_back({ Opcode::load, rd, rsp, no_reg, 0, slot_offset(slot) });
+    }
+
+    static void store_slot(Code& code, const Reg rs, const uint64_t slot)
+    {
+        code.push_back({ Opcode::store, rs, rsp, no_reg, 0, slot_offset(slot) });
+    }
+
+    static void reserve_frame(Code& code, const uint64_t bytes)
+    {
+        assert(fits_add_imm(bytes));
+        if (bytes > 0) {
+            code.push_back({ Opcode::sub_imm, rsp, rsp, no_reg, 0, bytes });
+        }
+    }
+
+    static void label(Code& code, const uint64_t label)
+    {
+        code.push_back({ Opcode::label, no_reg, no_reg, no_reg, 0, label });
+    }
+
+    static void jump(Code& code, const uint64_t label)
+    {
+        code.push_back({ Opcode::jmp, no_reg, no_reg, no_reg, 0, label });
+    }
+
+    static void branch_zero(Code& code, const Reg cond, const uint64_t label)
+    {
+        code.push_back({ Opcode::jz, no_reg, cond, no_reg, 0, label });
+    }
+
+    static void branch_nonzero(Code& code, const Reg cond, const uint64_t label)
+    {
+        code.push_back({ Opcode::jnz, no_reg, cond, no_reg, 0, label });
+    }
+
+    // exit(2) is syscall 60, with the status already in rdi
+    static void exit(Code& code)
+    {
+        mov_imm(code, rax, 60);
+        code.push_back({ Opcode::syscall });
+    }
+
+    [[nodiscard]] static std::vector<uint8_t> encode(const Code& code)
+    {
+        return Encoder(code).encode();
+    }
+
+private:
+    static constexpr std::array<Reg, num_regs + 2> regs = { rdi, rsi, rcx, rbx, r8, r9, r10, r11, r12, r13, r14,
+        r15, rbp };
+
+    static uint64_t slot_offset(const uint64_t slot)
+    {
+        assert(fits_add_imm(slot * 8));
+        return slot * 8;
+    }
+};
+
+} // namespace x86_64
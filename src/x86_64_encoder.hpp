@@ -0,0 +1,359 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "x86_64.hpp"
+
+namespace x86_64 {
+
+// Turns structured instructions into x86-64 machine code, so no assembler is
+// needed. Every operation is 64-bit. Branches start out in the two-byte rel8
+// form and are lengthened to rel32 only when their label is out of reach.
+class Encoder {
+public:
+    inline explicit Encoder(const std::vector<Inst>& code)
+        : m_code(code)
+        , m_length(code.size(), 0)
+        , m_long(code.size(), false)
+    {
+    }
+
+    [[nodiscard]] std::vector<uint8_t> encode()
+    {
+        std::vector<uint8_t> bytes;
+        for (size_t i = 0; i < m_code.size(); i++) {
+            if (!is_branch(m_code[i].op)) {
+                encode_inst(bytes, i);
+                m_length[i] = static_cast<uint8_t>(bytes.size());
+                bytes.clear();
+            }
+        }
+        // Lengthening one branch can only push others out of range, so this
+        // settles after a few rounds
+        while (layout()) { }
+        bytes.reserve(m_size);
+        for (size_t i = 0; i < m_code.size(); i++) {
+            encode_inst(bytes, i);
+        }
+        assert(bytes.size() == m_size);
+        return bytes;
+    }
+
+private:
+    // Places every instruction and label with the current branch lengths, then
+    // lengthens the branches that cannot reach. Returns whether any did, in
+    // which case the layout has to be redone.
+    bool layout()
+    {
+        m_offset.resize(m_code.size());
+        m_label_offset.clear();
+        m_size = 0;
+        for (size_t i = 0; i < m_code.size(); i++) {
+            const Inst& inst = m_code[i];
+            m_offset[i] = m_size;
+            if (inst.op == Opcode::label) {
+                if (inst.imm >= m_label_offset.size()) {
+                    m_label_offset.resize(inst.imm + 1, 0);
+                }
+                m_label_offset[inst.imm] = m_size;
+            }
+            m_size += length(i);
+        }
+        bool lengthened = false;
+        for (size_t i = 0; i < m_code.size(); i++) {
+            if (is_branch(m_code[i].op) && !m_long[i] && !fits_int8(distance(i))) {
+                m_long[i] = true;
+                lengthened = true;
+            }
+        }
+        return lengthened;
+    }
+
+    [[nodiscard]] size_t length(const size_t i) const
+    {
+        switch (m_code[i].op) {
+        case Opcode::jmp:
+            return m_long[i] ? 5 : 2;
+        case Opcode::je:
+            return m_long[i] ? 6 : 2;
+        case Opcode::jz:
+        case Opcode::jnz:
+            // After a three-byte test
+            return m_long[i] ? 9 : 5;
+        default:
+            return m_length[i];
+        }
+    }
+
+    // Bytes from the end of branch `i` to its label
+    [[nodiscard]] int64_t distance(const size_t i) const
+    {
+        return static_cast<int64_t>(m_label_offset[m_code[i].imm]) - static_cast<int64_t>(m_offset[i] + length(i));
+    }
+
+    static bool fits_int8(const int64_t value)
+    {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    static bool fits_int32(const int64_t value)
+    {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    static void put(std::vector<uint8_t>& out, const uint64_t value, const size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            out.push_back(static_cast<uint8_t>(value >> (i * 8)));
+        }
+    }
+
+    // REX.W, then `opcode` (one or two bytes, the first in the low byte), then
+    // a ModRM that names `reg` and the register `rm` directly
+    static void op_rr(std::vector<uint8_t>& out, const uint16_t opcode, const Reg reg, const Reg rm)
+    {
+        assert(reg < 16 && rm < 16);
+        out.push_back(static_cast<uint8_t>(0x48 | (reg >> 3) << 2 | rm >> 3));
+        put(out, opcode, opcode > 0xff ? 2 : 1);
+        out.push_back(static_cast<uint8_t>(0xc0 | (reg & 7) << 3 | (rm & 7)));
+    }
+
+    // REX.W, `opcode`, and a ModRM for [base + (index << scale) + disp]. rsp
+    // and r12 as a base need a SIB byte; rbp and r13 need a displacement.
+    static void op_mem(std::vector<uint8_t>& out, const uint8_t opcode, const Reg reg, const Reg base,
+        const Reg index, const uint8_t scale, const int64_t disp)
+    {
+        assert(reg < 16 && base < 16 && (index == no_reg || (index < 16 && index != rsp)) && scale <= 3);
+        assert(fits_int32(disp));
+        const bool sib = index != no_reg || (base & 7) == 4;
+        const uint8_t mod = disp == 0 && (base & 7) != 5 ? 0 : fits_int8(disp) ? 1 : 2;
+        const uint8_t index_bits = index == no_reg ? 4 : index;
+        out.push_back(static_cast<uint8_t>(0x48 | (reg >> 3) << 2 | (index_bits >> 3) << 1 | base >> 3));
+        out.push_back(opcode);
+        out.push_back(static_cast<uint8_t>(mod << 6 | (reg & 7) << 3 | (sib ? 4 : base & 7)));
+        if (sib) {
+            out.push_back(static_cast<uint8_t>(scale << 6 | (index_bits & 7) << 3 | (base & 7)));
+        }
+        put(out, static_cast<uint64_t>(disp), mod == 0 ? 0 : mod == 1 ? 1 : 4);
+    }
+
+    // An ALU operation on rd with a sign-extended immediate: add is /0, sub
+    // /5, cmp /7
+    static void op_imm(std::vector<uint8_t>& out, const uint8_t ext, const Reg rd, const int64_t imm)
+    {
+        assert(fits_int32(imm));
+        if (fits_int8(imm)) {
+            op_rr(out, 0x83, ext, rd);
+            put(out, static_cast<uint64_t>(imm), 1);
+        }
+        else {
+            op_rr(out, 0x81, ext, rd);
+            put(out, static_cast<uint64_t>(imm), 4);
+        }
+    }
+
+    static void mov(std::vector<uint8_t>& out, const Reg rd, const Reg rn)
+    {
+        op_rr(out, 0x89, rn, rd);
+    }
+
+    // rd = rn, unless they are the same register, ahead of a two-operand op
+    static void copy(std::vector<uint8_t>& out, const Reg rd, const Reg rn)
+    {
+        if (rd != rn) {
+            mov(out, rd, rn);
+        }
+    }
+
+    // xor r32, r32; writing a 32-bit register clears the top half
+    static void zero(std::vector<uint8_t>& out, const Reg rd)
+    {
+        if (rd >= 8) {
+            out.push_back(0x45);
+        }
+        out.push_back(0x31);
+        out.push_back(static_cast<uint8_t>(0xc0 | (rd & 7) << 3 | (rd & 7)));
+    }
+
+    static void mov_imm(std::vector<uint8_t>& out, const Reg rd, const uint64_t value)
+    {
+        if (value == 0) {
+            zero(out, rd);
+        }
+        else if (value <= UINT32_MAX) {
+            // mov r32, imm32
+            if (rd >= 8) {
+                out.push_back(0x41);
+            }
+            out.push_back(static_cast<uint8_t>(0xb8 | (rd & 7)));
+            put(out, value, 4);
+        }
+        else if (fits_int32(static_cast<int64_t>(value))) {
+            // mov r/m64, imm32, sign-extended
+            op_rr(out, 0xc7, 0, rd);
+            put(out, value, 4);
+        }
+        else {
+            // movabs r64, imm64
+            out.push_back(static_cast<uint8_t>(0x48 | rd >> 3));
+            out.push_back(static_cast<uint8_t>(0xb8 | (rd & 7)));
+            put(out, value, 8);
+        }
+    }
+
+    void encode_inst(std::vector<uint8_t>& out, const size_t i) const
+    {
+        const Inst& inst = m_code[i];
+        const auto imm = static_cast<int64_t>(inst.imm);
+        switch (inst.op) {
+        case Opcode::mov:
+            mov(out, inst.rd, inst.rn);
+            return;
+        case Opcode::mov_imm:
+            mov_imm(out, inst.rd, inst.imm);
+            return;
+        case Opcode::add:
+            if (inst.rd == inst.rn) {
+                op_rr(out, 0x01, inst.rm, inst.rd);
+            }
+            else if (inst.rd == inst.rm) {
+                op_rr(out, 0x01, inst.rn, inst.rd);
+            }
+            else {
+                // lea rd, [rn + rm] leaves both operands alone
+                op_mem(out, 0x8d, inst.rd, inst.rn, inst.rm, 0, 0);
+            }
+            return;
+        case Opcode::sub:
+            if (inst.rd == inst.rm && inst.rd != inst.rn) {
+                // -(rm) + rn
+                op_rr(out, 0xf7, 3, inst.rd);
+                op_rr(out, 0x01, inst.rn, inst.rd);
+            }
+            else {
+                copy(out, inst.rd, inst.rn);
+                op_rr(out, 0x29, inst.rm, inst.rd);
+            }
+            return;
+        case Opcode::mul:
+            // imul reg, r/m, which commutes like add
+            if (inst.rd == inst.rm) {
+                op_rr(out, 0xaf0f, inst.rd, inst.rn);
+            }
+            else {
+                copy(out, inst.rd, inst.rn);
+                op_rr(out, 0xaf0f, inst.rd, inst.rm);
+            }
+            return;
+        case Opcode::udiv:
+            // rax = 0; if rm != 0 then rdx:rax = 0:rn and rax = rdx:rax / rm
+            zero(out, rax);
+            op_rr(out, 0x85, inst.rm, inst.rm);
+            out.push_back(0x74);
+            out.push_back(8);
+            mov(out, rax, inst.rn);
+            zero(out, rdx);
+            op_rr(out, 0xf7, 6, inst.rm);
+            mov(out, inst.rd, rax);
+            return;
+        case Opcode::add_imm:
+        case Opcode::sub_imm:
+            if (inst.rd == inst.rn) {
+                op_imm(out, inst.op == Opcode::add_imm ? 0 : 5, inst.rd, imm);
+            }
+            else {
+                op_mem(out, 0x8d, inst.rd, inst.rn, no_reg, 0, inst.op == Opcode::add_imm ? imm : -imm);
+            }
+            return;
+        case Opcode::mul_imm:
+            assert(fits_int32(imm));
+            if (fits_int8(imm)) {
+                op_rr(out, 0x6b, inst.rd, inst.rn);
+                put(out, inst.imm, 1);
+            }
+            else {
+                op_rr(out, 0x69, inst.rd, inst.rn);
+                put(out, inst.imm, 4);
+            }
+            return;
+        case Opcode::lea:
+            op_mem(out, 0x8d, inst.rd, inst.rn, inst.rm, inst.shift, 0);
+            return;
+        case Opcode::shl_imm:
+        case Opcode::shr_imm:
+            assert(inst.imm < 64);
+            copy(out, inst.rd, inst.rn);
+            op_rr(out, 0xc1, inst.op == Opcode::shl_imm ? 4 : 5, inst.rd);
+            put(out, inst.imm, 1);
+            return;
+        case Opcode::umulh:
+            // rdx:rax = rax * rm
+            mov(out, rax, inst.rn);
+            op_rr(out, 0xf7, 4, inst.rm);
+            mov(out, inst.rd, rdx);
+            return;
+        case Opcode::neg:
+            copy(out, inst.rd, inst.rn);
+            op_rr(out, 0xf7, 3, inst.rd);
+            return;
+        case Opcode::load:
+            op_mem(out, 0x8b, inst.rd, inst.rn, no_reg, 0, imm);
+            return;
+        case Opcode::store:
+            op_mem(out, 0x89, inst.rd, inst.rn, no_reg, 0, imm);
+            return;
+        case Opcode::cmp_imm:
+            op_imm(out, 7, inst.rn, imm);
+            return;
+        case Opcode::jmp:
+            if (m_long[i]) {
+                out.push_back(0xe9);
+                put(out, static_cast<uint64_t>(distance(i)), 4);
+            }
+            else {
+                out.push_back(0xeb);
+                put(out, static_cast<uint64_t>(distance(i)), 1);
+            }
+            return;
+        case Opcode::je:
+        case Opcode::jz:
+        case Opcode::jnz: {
+            if (inst.op != Opcode::je) {
+                op_rr(out, 0x85, inst.rn, inst.rn);
+            }
+            // je is condition 4, jne 5
+            const uint8_t cond = inst.op == Opcode::jnz ? 5 : 4;
+            if (m_long[i]) {
+                out.push_back(0x0f);
+                out.push_back(static_cast<uint8_t>(0x80 | cond));
+                put(out, static_cast<uint64_t>(distance(i)), 4);
+            }
+            else {
+                out.push_back(static_cast<uint8_t>(0x70 | cond));
+                put(out, static_cast<uint64_t>(distance(i)), 1);
+            }
+            return;
+        }
+        case Opcode::syscall:
+            out.push_back(0x0f);
+            out.push_back(0x05);
+            return;
+        case Opcode::label:
+        case Opcode::nop:
+            return;
+        }
+    }
+
+    const std::vector<Inst>& m_code;
+    // Bytes taken by each instruction other than a branch
+    std::vector<uint8_t> m_length;
+    // Branches that take a 32-bit displacement
+    std::vector<bool> m_long;
+    // Byte offset of each instruction and each label
+    std::vector<size_t> m_offset {};
+    std::vector<size_t> m_label_offset {};
+    size_t m_size = 0;
+};
+
+} // namespace x86_64
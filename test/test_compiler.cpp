@@ -5,6 +5,13 @@
 #include <stdexcept>
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <chrono>
+#include <sstream>
+#include <vector>
+#include <sys/resource.h> // For wait4
+#include <sys/wait.h>
+#include <unistd.h>
 
 // Function to execute a command and get its output
 std::string execCommand(const std::string& cmd) {
@@ -31,6 +38,125 @@ std::string runCompilerWithFile(const std::string& filePath) {
     return execOutput;
 }
 
+std::string readFile(const std::string& filePath) {
+    std::ifstream in(filePath);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+// Every program in test_inputs that compiles, by name
+const std::vector<std::string> validPrograms = {
+    "multiline_comment",
+    "test_addition_subtraction",
+    "test_addition_subtraction_chained",
+    "test_combined_operations",
+    "test_complex_pemdas",
+    "test_conditional_elif",
+    "test_conditional_else_nested_simple",
+    "test_conditional_else_simple",
+    "test_conditional_nested_simple",
+    "test_constant_propagation",
+    "test_dead_code",
+    "test_multilevel_elif",
+    "test_multiplication_division",
+    "test_strength_reduction",
+    "test_wide_literals",
+    "variable_reassignment",
+};
+
+// Writes a program that declares `count` variables, each one more than the last,
+// and exits with the final one
+std::string writeManyVariablesProgram(const std::string& filePath, int count) {
+    std::ofstream out(filePath);
+    out << "var v0 = 1;\n";
+    for (int i = 1; i < count; i++) {
+        out << "var v" << i << " = v" << i - 1 << " + 1;\n";
+    }
+    out << "exit(v" << count - 1 << ");\n";
+    return filePath;
+}
+
+double timeCompilerWithFile(const std::string& filePath, std::string& output) {
+    const auto start = std::chrono::steady_clock::now();
+    output = runCompilerWithFile(filePath);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Writes a program that exits with `value` wrapped in `depth` parentheses
+std::string writeNestedParenthesesProgram(const std::string& filePath, int depth, int value) {
+    std::ofstream out(filePath);
+    out << "exit(" << std::string(depth, '(') << value << std::string(depth, ')') << ");\n";
+    return filePath;
+}
+
+// Writes a program that exits with 1 + (1 + (1 + ... (1) ...)), `depth` operators deep
+std::string writeNestedAdditionProgram(const std::string& filePath, int depth) {
+    std::ofstream out(filePath);
+    out << "exit(";
+    for (int i = 0; i < depth; i++) {
+        out << "1 + (";
+    }
+    out << "1" << std::string(depth, ')') << ");\n";
+    return filePath;
+}
+
+// A balanced tree of additions, `depth` deep, whose leftmost leaf is `name` and
+// whose other leaves are the zero variable z: it evaluates to `name` but needs
+// depth + 1 registers
+std::string balancedSum(const std::string& name, int depth, bool leftmost = true) {
+    if (depth == 0) {
+        return leftmost ? name : "z";
+    }
+    return "(" + balancedSum(name, depth - 1, leftmost) + " + " + balancedSum(name, depth - 1, false) + ")";
+}
+
+// Writes a program that exits with c `op` b, where both operands need more
+// registers than any target has, so one of them is spilled. The values are
+// assigned inside an if so that constant propagation cannot fold them.
+std::string writeSpillingProgram(const std::string& filePath, const std::string& op, int c, int b) {
+    std::ofstream out(filePath);
+    out << "var z = 1;\nvar c = 0;\nvar b = 0;\n";
+    out << "if (z) {\n    z = 0;\n    c = " << c << ";\n    b = " << b << ";\n}\n";
+    out << "exit(" << balancedSum("c", 16) << " " << op << " " << balancedSum("b", 16) << ");\n";
+    return filePath;
+}
+
+// Like runCompilerWithFile, but also reports the peak resident set size in
+// bytes of the compiler and the tools it ran
+std::string runCompilerMeasuringMemory(const std::string& filePath, long& peak_rss_bytes) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw std::runtime_error("pipe() failed!");
+    }
+    const pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("./build/microcompiler", "microcompiler", filePath.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    close(fds[1]);
+    std::string result;
+    std::array<char, 128> buffer;
+    ssize_t count;
+    while ((count = read(fds[0], buffer.data(), buffer.size())) > 0) {
+        result.append(buffer.data(), static_cast<size_t>(count));
+    }
+    close(fds[0]);
+    int status;
+    rusage usage {};
+    wait4(pid, &status, 0, &usage);
+#ifdef __APPLE__
+    peak_rss_bytes = usage.ru_maxrss;
+#else
+    peak_rss_bytes = usage.ru_maxrss * 1024;
+#endif
+    return result;
+}
+
 TEST(MicroCompilerTests, MissingBracket) {
     std::string output = runCompilerWithFile("./test_inputs/no_brackets.micro");
     std::string expected_output = "Invalid scope\n";
@@ -61,6 +187,18 @@ TEST(MicroCompilerTests, MultiplicationDivisionChained) {
     EXPECT_EQ(output, expected_output);
 }
 
+TEST(MicroCompilerTests, StrengthReduction) {
+    std::string output = runCompilerWithFile("-O0 ./test_inputs/test_strength_reduction.micro");
+    std::string expected_output = "Program exited with status: 30\n";  // Based on the calculations in the file
+    EXPECT_EQ(output, expected_output);
+}
+
+TEST(MicroCompilerTests, WideLiterals) {
+    std::string output = runCompilerWithFile("-O0 ./test_inputs/test_wide_literals.micro");
+    std::string expected_output = "Program exited with status: 221\n";  // Based on the calculations in the file
+    EXPECT_EQ(output, expected_output);
+}
+
 TEST(MicroCompilerTests, CombinedOperationsChained) {
     std::string output = runCompilerWithFile("./test_inputs/test_combined_operations.micro");
     std::string expected_output = "Program exited with status: 31\n";  // Based on the calculations in the file
@@ -127,6 +265,278 @@ TEST(MicroCompilerTests, Undeclared) {
     EXPECT_EQ(output, expected_output);
 }
 
+TEST(MicroCompilerTests, VarUsedInItsOwnInitialiser) {
+    const std::string path = "./test_inputs/self_initialised_var.micro";
+    for (const char* level : { "-O0 ", "-O1 ", "-O2 ", "--run ", "-O2 --emit-ir " }) {
+        EXPECT_EQ(runCompilerWithFile(level + path), "Undeclared identifier: x\n") << level;
+    }
+}
+
+TEST(MicroCompilerTests, ConstantPropagation) {
+    std::string output = runCompilerWithFile("./test_inputs/test_constant_propagation.micro");
+    std::string expected_output = "Program exited with status: 14\n";
+    EXPECT_EQ(output, expected_output);
+}
+
+TEST(MicroCompilerTests, DeadCode) {
+    std::string output = runCompilerWithFile("./test_inputs/test_dead_code.micro");
+    std::string expected_output = "Program exited with status: 28\n";
+    EXPECT_EQ(output, expected_output);
+}
+
+TEST(MicroCompilerTests, DeadCodeStats) {
+    std::string output = runCompilerWithFile("--stats ./test_inputs/test_dead_code.micro");
+    std::string expected_output = "Removed 5 unreachable statements\nProgram exited with status: 28\n";
+    EXPECT_EQ(output, expected_output);
+}
+
+TEST(MicroCompilerTests, IrDumps) {
+    for (const std::string& name : validPrograms) {
+        std::string output = runCompilerWithFile("-O0 --emit-ir ./test_inputs/" + name + ".micro");
+        EXPECT_EQ(output, readFile("./test_inputs/ir/" + name + ".ir")) << name;
+    }
+}
+
+TEST(MicroCompilerTests, OptimisedIr) {
+    std::string output = runCompilerWithFile("-O2 --emit-ir ./test_inputs/test_dead_code.micro");
+    std::string expected_output = "fn main {\nb0:\n    exit 28\n}\n";
+    EXPECT_EQ(output, expected_output);
+}
+
+TEST(MicroCompilerTests, OptimisationLevelsAgree) {
+    for (const std::string& name : validPrograms) {
+        const std::string path = "./test_inputs/" + name + ".micro";
+        const std::string expected_output = runCompilerWithFile(path);
+        EXPECT_EQ(runCompilerWithFile("-O0 " + path), expected_output) << name;
+        EXPECT_EQ(runCompilerWithFile("-O2 " + path), expected_output) << name;
+    }
+}
+
+TEST(MicroCompilerTests, RunInProcessMatchesNative) {
+    for (const std::string& name : validPrograms) {
+        const std::string path = "./test_inputs/" + name + ".micro";
+        const std::string expected_output = runCompilerWithFile(path);
+        for (const char* level : { "-O0 ", "-O1 ", "-O2 " }) {
+            EXPECT_EQ(runCompilerWithFile(std::string("--run ") + level + path), expected_output) << level << name;
+        }
+    }
+    EXPECT_EQ(runCompilerWithFile("--run ./test_inputs/undeclare_var.micro"), "Identifier has not been declared: y\n");
+    EXPECT_EQ(runCompilerWithFile("--run --cache=test_cache ./test_inputs/test_dead_code.micro"),
+        "--run takes a single file and no --serve, --client, --cache, --emit-ir or --peephole-stats\n");
+}
+
+TEST(MicroCompilerTests, SpilledOperandsKeepTheirOrder) {
+    const std::string sub = writeSpillingProgram("./test_inputs/generated_spill_sub.micro", "-", 5, 2);
+    const std::string div = writeSpillingProgram("./test_inputs/generated_spill_div.micro", "/", 6, 2);
+    for (const char* level : { "-O0 ", "-O1 ", "-O2 ", "--run " }) {
+        EXPECT_EQ(runCompilerWithFile(level + sub), "Program exited with status: 3\n") << level;
+        EXPECT_EQ(runCompilerWithFile(level + div), "Program exited with status: 3\n") << level;
+    }
+    std::remove(sub.c_str());
+    std::remove(div.c_str());
+}
+
+TEST(MicroCompilerTests, TimePasses) {
+    std::string output = runCompilerWithFile("-O2 --time-passes --emit-ir ./test_inputs/test_dead_code.micro");
+    size_t previous = 0;
+    for (const char* pass : { "pass resolve: ", "pass lower: ", "pass constfold: ", "pass simplifycfg: ", "pass dce: " }) {
+        const size_t found = output.find(pass);
+        ASSERT_NE(found, std::string::npos) << pass;
+        EXPECT_GE(found, previous) << pass;
+        previous = found;
+    }
+}
+
+TEST(MicroCompilerTests, PeepholeStats) {
+    std::string output = runCompilerWithFile("--peephole-stats ./test_inputs/test_conditional_else_nested_simple.micro");
+    std::string expected_output =
+        "peephole store-load: 3\n"
+        "peephole load-load: 0\n"
+        "peephole dead-store: 0\n"
+        "peephole copy-constant: 0\n"
+        "peephole self-move: 0\n"
+        "peephole zero-sp-adjust: 0\n"
+        "peephole cancel-sp-adjust: 0\n"
+        "peephole compare-branch: 0\n"
+        "peephole branch-to-next: 0\n"
+        "Program exited with status: 10\n";
+    EXPECT_EQ(output, expected_output);
+}
+
+TEST(MicroCompilerTests, PeepholeWindows) {
+    for (const char* window : { "--peephole-window=2 ", "--peephole-window=64 " }) {
+        for (const std::string& name : validPrograms) {
+            const std::string path = "./test_inputs/" + name + ".micro";
+            EXPECT_EQ(runCompilerWithFile(window + path), runCompilerWithFile(path)) << window << name;
+        }
+    }
+    EXPECT_EQ(runCompilerWithFile("--peephole-window=0 ./test_inputs/test_dead_code.micro"), "Invalid peephole window: 0\n");
+    EXPECT_EQ(runCompilerWithFile("--peephole-window=1a2 ./test_inputs/test_dead_code.micro"), "Invalid peephole window: 1a2\n");
+    EXPECT_EQ(runCompilerWithFile("--peephole-window=18446744073709551617 ./test_inputs/test_dead_code.micro"),
+        "Invalid peephole window: 18446744073709551617\n");
+}
+
+TEST(MicroCompilerTests, LinuxExecutable) {
+    std::remove("out");
+    runCompilerWithFile("--target=linux ./test_inputs/test_complex_pemdas.micro");
+    const std::string executable = readFile("out");
+    ASSERT_GE(executable.size(), 120u);
+    EXPECT_EQ(executable.substr(0, 4), "\x7f" "ELF");
+    EXPECT_EQ(executable[4], 2);                          // 64-bit
+    EXPECT_EQ(static_cast<unsigned char>(executable[18]), 183);  // EM_AARCH64
+    EXPECT_EQ(executable.size() % 4, 0u);                 // Headers, then whole instructions
+}
+
+TEST(MicroCompilerTests, X86_64Executable) {
+    std::remove("out");
+    runCompilerWithFile("--target=x86_64-linux ./test_inputs/test_complex_pemdas.micro");
+    const std::string executable = readFile("out");
+    ASSERT_GE(executable.size(), 120u);
+    EXPECT_EQ(executable.substr(0, 4), "\x7f" "ELF");
+    EXPECT_EQ(executable[4], 2);                          // 64-bit
+    EXPECT_EQ(static_cast<unsigned char>(executable[18]), 62);   // EM_X86_64
+}
+
+TEST(MicroCompilerTests, UnknownTarget) {
+    std::string output = runCompilerWithFile("--target=windows ./test_inputs/test_dead_code.micro");
+    EXPECT_EQ(output, "Unknown target: windows\n");
+}
+
+TEST(MicroCompilerTests, BatchWritesEachExecutableBesideItsSource) {
+    {
+        std::ofstream manifest("batch_manifest.txt");
+        for (const std::string& name : validPrograms) {
+            manifest << "./test_inputs/" << name << ".micro\n";
+        }
+    }
+    const std::string output = runCompilerWithFile("--target=linux --jobs=4 --manifest=batch_manifest.txt");
+    const std::string count = std::to_string(validPrograms.size());
+    EXPECT_EQ(output.rfind("Compiled " + count + " of " + count + " files", 0), 0u) << output;
+    for (const std::string& name : validPrograms) {
+        const std::string executable = readFile("./test_inputs/" + name + ".out");
+        EXPECT_EQ(executable.substr(0, 4), "\x7f" "ELF") << name;
+        std::remove(("./test_inputs/" + name + ".out").c_str());
+    }
+    std::remove("batch_manifest.txt");
+}
+
+TEST(MicroCompilerTests, BatchReportsEachFailureWithItsFile) {
+    const std::string output = runCompilerWithFile(
+        "--target=linux ./test_inputs/undeclare_var.micro ./test_inputs/test_dead_code.micro");
+    EXPECT_EQ(output.rfind("./test_inputs/undeclare_var.micro: Identifier has not been declared: y\n"
+                           "Compiled 1 of 2 files", 0), 0u) << output;
+    std::remove("./test_inputs/test_dead_code.out");
+    EXPECT_EQ(runCompilerWithFile("./test_inputs/test_dead_code.micro ./test_inputs/test_dead_code.micro"),
+        "Inputs would share the output: ./test_inputs/test_dead_code.out\n");
+    EXPECT_EQ(runCompilerWithFile("--jobs=1a2 ./test_inputs/test_dead_code.micro"), "Invalid job count: 1a2\n");
+}
+
+TEST(MicroCompilerTests, CacheReusesExecutableForSameSourceAndFlags) {
+    execCommand("rm -rf test_cache");
+    const std::string flags = "--cache=test_cache --cache-stats ";
+    const std::string first = runCompilerWithFile(flags + "./test_inputs/test_complex_pemdas.micro");
+    EXPECT_EQ(first.rfind("Cache: 0 hits, 1 misses, ", 0), 0u) << first;
+    const std::string second = runCompilerWithFile(flags + "./test_inputs/test_complex_pemdas.micro");
+    EXPECT_EQ(second.rfind("Cache: 1 hits, 1 misses, ", 0), 0u) << second;
+    EXPECT_EQ(first.substr(first.find('\n')), second.substr(second.find('\n')));
+    // Other flags are another entry
+    const std::string third = runCompilerWithFile(flags + "-O2 ./test_inputs/test_complex_pemdas.micro");
+    EXPECT_EQ(third.rfind("Cache: 1 hits, 2 misses, ", 0), 0u) << third;
+    execCommand("rm -rf test_cache");
+    EXPECT_EQ(runCompilerWithFile("--cache=test_cache --cache-size=99999999999999999999 ./test_inputs/test_dead_code.micro"),
+        "Invalid cache size: 99999999999999999999\n");
+}
+
+TEST(MicroCompilerTests, ClientCompilesThroughServer) {
+    std::remove("test.sock");
+    const std::string pid = execCommand("./build/microcompiler --serve=test.sock --jobs=2 > /dev/null 2>&1 & echo $!");
+    for (int i = 0; i < 200 && access("test.sock", F_OK) != 0; i++) {
+        usleep(10000);
+    }
+    EXPECT_EQ(runCompilerWithFile("--client=test.sock ./test_inputs/test_complex_pemdas.micro"),
+        runCompilerWithFile("./test_inputs/test_complex_pemdas.micro"));
+    EXPECT_EQ(runCompilerWithFile("--client=test.sock ./test_inputs/undeclare_var.micro"),
+        "Identifier has not been declared: y\n");
+    execCommand("kill " + pid);
+    std::remove("test.sock");
+    EXPECT_EQ(runCompilerWithFile("--client=test.sock ./test_inputs/test_complex_pemdas.micro"),
+        "Could not reach the compile server at: test.sock\n");
+}
+
+TEST(MicroCompilerTests, IncrementalServerFollowsEdits) {
+    std::remove("test.sock");
+    const std::string pid = execCommand("./build/microcompiler --serve=test.sock --incremental > /dev/null 2>&1 & echo $!");
+    for (int i = 0; i < 200 && access("test.sock", F_OK) != 0; i++) {
+        usleep(10000);
+    }
+    // Each version is an edit of the one before, and a failed compile leaves
+    // the last good one for the next edit to start from
+    const std::string path = "./test_inputs/generated_incremental.micro";
+    const std::vector<std::pair<std::string, std::string>> versions = {
+        { "var a = 1;\nvar b = 2;\nif (a) { b = b * 10; }\nexit(a + b);\n", "Program exited with status: 21\n" },
+        { "var a = 1;\nvar b = 2;\nif (a) { b = b * 30; }\nexit(a + b);\n", "Program exited with status: 61\n" },
+        { "var a = 1;\nvar c = 4;\nvar b = 2;\nif (a) { b = b * 30; }\nexit(a + b + c);\n",
+            "Program exited with status: 65\n" },
+        { "var a = 1;\nvar b = 2;\nif (a) { b = b * 30; }\nexit(a + b + c);\n", "Undeclared identifier: c\n" },
+        { "var a = 1;\nvar b = 2;\nif (a) { b = b * 30 }\nexit(a + b);\n", "[Parser Error] Expected ';' on line 3\n" },
+        { "var a = 1;\nvar b = 2;\n/* var c = 4; */\nif (a) { var c = 3; b = b * c; }\nexit(a + b);\n",
+            "Program exited with status: 7\n" },
+        // Appending else or elif extends the if before it
+        { "var a = 0;\nvar b = 2;\nif (a) { b = 3; }\nexit(b);\n", "Program exited with status: 2\n" },
+        { "var a = 0;\nvar b = 2;\nif (a) { b = 3; } else { b = 4; }\nexit(b);\n", "Program exited with status: 4\n" },
+        { "var a = 0;\nvar b = 2;\nif (a) { b = 3; }\nexit(b);\n", "Program exited with status: 2\n" },
+        { "var a = 0;\nvar b = 2;\nif (a) { b = 3; }\nelif (b) { b = 5; }\nexit(b);\n",
+            "Program exited with status: 5\n" },
+    };
+    for (const auto& [source, expected] : versions) {
+        std::ofstream(path) << source;
+        EXPECT_EQ(runCompilerWithFile("--client=test.sock " + path), expected) << source;
+        EXPECT_EQ(runCompilerWithFile(path), expected) << source;
+    }
+    execCommand("kill " + pid);
+    std::remove("test.sock");
+    EXPECT_EQ(runCompilerWithFile("--incremental " + path), "--incremental applies only to --serve\n");
+    std::remove(path.c_str());
+}
+
+TEST(MicroCompilerTests, ManyVariablesScaleLinearly) {
+    std::string small_output;
+    std::string large_output;
+    const double small_seconds = timeCompilerWithFile(writeManyVariablesProgram("./test_inputs/generated_vars_20k.micro", 20000), small_output);
+    const double large_seconds = timeCompilerWithFile(writeManyVariablesProgram("./test_inputs/generated_vars_100k.micro", 100000), large_output);
+    EXPECT_EQ(small_output, "Program exited with status: 32\n");   // 20000 % 256
+    EXPECT_EQ(large_output, "Program exited with status: 160\n");  // 100000 % 256
+    // 5x the variables must cost nowhere near the 25x of a quadratic lookup
+    EXPECT_LT(large_seconds, small_seconds * 12);
+    std::remove("./test_inputs/generated_vars_20k.micro");
+    std::remove("./test_inputs/generated_vars_100k.micro");
+}
+
+TEST(MicroCompilerTests, MillionDeepParentheses) {
+    long peak_rss_bytes = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const std::string output = runCompilerMeasuringMemory(
+        writeNestedParenthesesProgram("./test_inputs/generated_parens_1m.micro", 1000000, 7), peak_rss_bytes);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    EXPECT_EQ(output, "Program exited with status: 7\n");
+    // Parentheses leave no AST nodes, so this needs only the parser's stacks
+    EXPECT_LT(peak_rss_bytes, 256L * 1024 * 1024);
+    EXPECT_LT(seconds, 10.0);
+    std::remove("./test_inputs/generated_parens_1m.micro");
+}
+
+TEST(MicroCompilerTests, MillionDeepOperatorsScaleLinearly) {
+    std::string small_output;
+    std::string large_output;
+    const double small_seconds = timeCompilerWithFile(writeNestedAdditionProgram("./test_inputs/generated_ops_100k.micro", 100000), small_output);
+    const double large_seconds = timeCompilerWithFile(writeNestedAdditionProgram("./test_inputs/generated_ops_1m.micro", 1000000), large_output);
+    EXPECT_EQ(small_output, "Program exited with status: 161\n");  // 100001 % 256
+    EXPECT_EQ(large_output, "Program exited with status: 65\n");   // 1000001 % 256
+    EXPECT_LT(large_seconds, small_seconds * 20);
+    std::remove("./test_inputs/generated_ops_100k.micro");
+    std::remove("./test_inputs/generated_ops_1m.micro");
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();